@@ -0,0 +1,388 @@
+/** SpectralEngine の各処理と RingBuffer のマイクロベンチマーク
+ *
+ *  FFT サイズとオーバーラップ数のすべての組み合わせについて処理時間を計測し、JSON で出力する。
+ *
+ *  SpectralEngine の各段階 (FFT・スペクトル包絡・フォルマントシフト・Phase Vocoder の解析と合成・微細構造など) は、
+ *  実際の処理の流れの中で計測するために、Profiler のイベントから段階ごとの処理時間を集計する。
+ *  このターゲットは HWM_ENABLE_PROFILER=1 でビルドする。
+ *  RingBuffer の各操作は、エンジンと同じ使い方で直接呼び出して計測する。
+ *
+ *  使い方:
+ *      FormantAndPitchBenchmark [--fft-sizes=256,512,...] [--overlap-counts=2,4,...]
+ *                               [--frames=N] [--repetitions=N] [--output=path]
+ */
+
+#include "Prefix.h"
+#include "FFTDefines.h"
+#include "RingBuffer.h"
+#include "SpectralEngine.h"
+#include "Profiler.h"
+#include <algorithm>
+#include <iostream>
+#include <map>
+#include <numeric>
+#include <vector>
+
+#if HWM_ENABLE_PROFILER == 0
+ #error "The benchmark requires HWM_ENABLE_PROFILER=1"
+#endif
+
+NS_HWM_BEGIN
+
+static constexpr double kSampleRate = 48000.0;
+static constexpr int kNumChannels = 1;          // プラグインのデフォルトの入力バスと同じモノラル
+static constexpr int kEnvelopeOrder = 20;       // Envelope Order パラメータのデフォルト値
+static constexpr int kDefaultNumFrames = 400;
+static constexpr int kMaxNumFrames = 4096;      // ウォームアップと合わせて、全段階のイベントが Profiler に収まる数
+static constexpr int kDefaultRepetitions = 200;
+
+// 計測対象の処理が最適化で取り除かれないように、結果をここに書き込む
+static volatile float sink = 0;
+
+//! 1 回の呼び出しあたりの処理時間 (ナノ秒) の分布
+struct Statistics
+{
+    int _numSamples = 0;
+    double _min = 0;
+    double _median = 0;
+    double _p90 = 0;
+    double _mean = 0;
+};
+
+static Statistics computeStatistics(std::vector<double> values)
+{
+    Statistics stats;
+    if(values.empty()) { return stats; }
+
+    std::sort(values.begin(), values.end());
+
+    auto const percentile = [&](double q) {
+        auto const index = (std::size_t)std::round(q * (values.size() - 1));
+        return values[index];
+    };
+
+    stats._numSamples = (int)values.size();
+    stats._min = values.front();
+    stats._median = percentile(0.5);
+    stats._p90 = percentile(0.9);
+    stats._mean = std::accumulate(values.begin(), values.end(), 0.0) / values.size();
+    return stats;
+}
+
+static double ticksToNanoseconds(juce::int64 ticks)
+{
+    return juce::Time::highResolutionTicksToSeconds(ticks) * 1.0e9;
+}
+
+/** prepare() で状態を作り直してから body() を numCalls 回呼び出す、という計測を numRepetitions 回繰り返す
+ *
+ *  1 回の呼び出しが短い処理でも時刻の取得のコストが無視できるように、numCalls 回の呼び出しをまとめて計測して、その平均を 1 つの値とする。
+ */
+template<class Prepare, class Body>
+static Statistics measure(int numRepetitions, int numCalls, Prepare &&prepare, Body &&body)
+{
+    std::vector<double> values;
+    values.reserve((std::size_t)numRepetitions);
+
+    for(int r = 0; r < numRepetitions; ++r) {
+        prepare();
+
+        auto const start = juce::Time::getHighResolutionTicks();
+        for(int i = 0; i < numCalls; ++i) {
+            body();
+        }
+        auto const end = juce::Time::getHighResolutionTicks();
+
+        values.push_back(ticksToNanoseconds(end - start) / numCalls);
+    }
+
+    return computeStatistics(std::move(values));
+}
+
+//! 再現性のある入力信号。倍音を含む音に、固定のシードのノイズを少し加える
+class TestSignal
+{
+public:
+    void render(juce::AudioBuffer<float> &buffer)
+    {
+        for(int i = 0; i < buffer.getNumSamples(); ++i) {
+            auto const t = _position++ / kSampleRate;
+            auto value = 0.0;
+            for(int h = 1; h <= 8; ++h) {
+                value += 0.25 / h * std::sin(2.0 * juce::MathConstants<double>::pi * 220.0 * h * t);
+            }
+            value += 0.01 * (_random.nextFloat() * 2.0 - 1.0);
+
+            for(int ch = 0; ch < buffer.getNumChannels(); ++ch) {
+                buffer.getWritePointer(ch)[i] = (float)value;
+            }
+        }
+    }
+
+private:
+    juce::int64 _position = 0;
+    juce::Random _random { 1234 };
+};
+
+/** 計測結果を JSON の配列の要素として書き出す
+ *
+ *  全体は { "config": {...}, "results": [ {...}, ... ] } の形になる。
+ */
+class ResultWriter
+{
+public:
+    ResultWriter(juce::OutputStream &stream, int numFrames, int numRepetitions)
+    :   _stream(stream)
+    {
+        _stream << "{\"config\":{\"sampleRate\":" << kSampleRate
+                << ",\"numChannels\":" << kNumChannels
+                << ",\"envelopeOrder\":" << kEnvelopeOrder
+                << ",\"frames\":" << numFrames
+                << ",\"repetitions\":" << numRepetitions
+               #if JUCE_DEBUG
+                << ",\"build\":\"debug\""
+               #else
+                << ",\"build\":\"release\""
+               #endif
+                << ",\"hardwareCounters\":" << (HWM_ENABLE_PERF_COUNTERS ? "true" : "false")
+                << "},\"results\":[";
+    }
+
+    void write(char const *kernel, int fftSize, int overlapCount, Statistics const &stats,
+               PerfCounterValues const *counters = nullptr)
+    {
+        if(_numResults++ != 0) { _stream << ","; }
+
+        _stream << "\n{\"kernel\":\"" << kernel << "\""
+                << ",\"fftSize\":" << fftSize
+                << ",\"overlapCount\":" << overlapCount
+                << ",\"samples\":" << stats._numSamples
+                << ",\"minNs\":" << stats._min
+                << ",\"medianNs\":" << stats._median
+                << ",\"p90Ns\":" << stats._p90
+                << ",\"meanNs\":" << stats._mean;
+
+        // ハードウェアカウンタは 1 回の呼び出しあたりの平均
+        if(counters != nullptr && stats._numSamples > 0) {
+            for(int i = 0; i < PerfCounters::kNumCounters; ++i) {
+                _stream << ",\"" << PerfCounters::getCounterName((PerfCounter)i) << "\":"
+                        << (double)counters->_values[(std::size_t)i] / stats._numSamples;
+            }
+        }
+
+        _stream << "}";
+    }
+
+    void finish()
+    {
+        _stream << "\n]";
+
+        // カウンタの値が欠けているときは、その理由も書き出す
+        auto const counterStatus = PerfCounters::getStatusMessage();
+        if(HWM_ENABLE_PERF_COUNTERS && counterStatus.isNotEmpty()) {
+            _stream << ",\"hardwareCountersStatus\":\"" << counterStatus << "\"";
+        }
+
+        _stream << "}\n";
+        _stream.flush();
+    }
+
+private:
+    juce::OutputStream &_stream;
+    int _numResults = 0;
+};
+
+//==============================================================================
+static void benchmarkRingBuffer(int fftSize, int overlapCount, int numRepetitions, ResultWriter &writer)
+{
+    auto const hopSize = fftSize / overlapCount;
+
+    juce::AudioBuffer<float> block(kNumChannels, hopSize);
+    juce::AudioBuffer<float> frame(kNumChannels, fftSize);
+    TestSignal signal;
+    signal.render(block);
+    signal.render(frame);
+
+    // SpectralEngine の入力リングバッファと同じく、ホップごとに書き込んで FFT サイズ分を溜める
+    {
+        RingBuffer<float> ring(kNumChannels, fftSize);
+        auto const stats = measure(numRepetitions, overlapCount,
+                                   [&] { ring.discardAll(); },
+                                   [&] {
+            auto const result = ring.write(block);
+            jassert(result);
+            juce::ignoreUnused(result);
+        });
+        writer.write("ringBuffer.write", fftSize, overlapCount, stats);
+    }
+
+    // 出力リングバッファと同じく、フレームの末尾のホップ分だけ拡張しながらオーバーラップ加算する
+    {
+        RingBuffer<float> ring(kNumChannels, fftSize * 2);
+        auto const stats = measure(numRepetitions, overlapCount,
+                                   [&] { ring.discardAll(); ring.fill(fftSize - hopSize); },
+                                   [&] {
+            auto const result = ring.overlapAdd(frame, fftSize - hopSize);
+            jassert(result);
+            juce::ignoreUnused(result);
+        });
+        writer.write("ringBuffer.overlapAdd", fftSize, overlapCount, stats);
+    }
+
+    // 溜まった FFT サイズ分のサンプルを、コピーせずに参照する
+    {
+        RingBuffer<float> ring(kNumChannels, fftSize);
+        ring.fill(fftSize);
+
+        int const numCalls = 256;
+        auto const stats = measure(numRepetitions, numCalls,
+                                   [] {},
+                                   [&] {
+            ring.readWithoutCopy([](int ch, auto const &bi) {
+                juce::ignoreUnused(ch);
+                sink = sink + bi._buf1[bi._len1 - 1];
+            });
+        });
+        writer.write("ringBuffer.readWithoutCopy", fftSize, overlapCount, stats);
+    }
+}
+
+//==============================================================================
+static void benchmarkSpectralEngine(int fftSize, int overlapCount, int numFrames, ResultWriter &writer)
+{
+    auto const hopSize = fftSize / overlapCount;
+
+    // Profiler は大きいので、ヒープに確保する
+    auto profiler = std::make_unique<Profiler>();
+
+    SpectralEngineBase::Config config;
+    config._sampleRate = kSampleRate;
+    config._fftSize = fftSize;
+    config._overlapCount = overlapCount;
+    config._numChannels = kNumChannels;
+    config._maxBlockSize = hopSize;
+    config._hostBlockSize = hopSize;
+    config._profiler = profiler.get();
+
+    SpectralEngine<float> engine;
+    engine.prepare(config);
+
+    SpectralEngineBase::FrameParameters params;
+    params._voices[0]._pitchChangeAmount = 1.25;
+    params._voices[0]._formantExpandAmount = 0.9;
+    params._envelopeOrder = kEnvelopeOrder;
+
+    // ホップと同じ長さのブロックを渡すと、呼び出しごとにちょうど 1 フレームを処理する
+    juce::AudioBuffer<float> input(kNumChannels, hopSize);
+    juce::AudioBuffer<float> output(kNumChannels, hopSize);
+    TestSignal signal;
+
+    auto const processFrames = [&](int n) {
+        for(int i = 0; i < n; ++i) {
+            signal.render(input);
+            engine.process(input, output, params);
+            sink = sink + output.getReadPointer(0)[0];
+        }
+    };
+
+    // キャッシュと分岐予測を温めて、位相の状態が定常になってから計測する
+    auto const numWarmupFrames = std::max(16, overlapCount * 2);
+    jassert((numWarmupFrames + numFrames) * (int)ProfileStage::kNumStages < Profiler::kCapacity);
+    processFrames(numWarmupFrames);
+
+    std::vector<Profiler::Event> events;
+    profiler->copyEvents(events);
+    auto const numWarmupEvents = events.size();
+
+    processFrames(numFrames);
+    profiler->copyEvents(events);
+    events.erase(events.begin(), events.begin() + (std::ptrdiff_t)numWarmupEvents);
+
+    std::map<ProfileStage, std::vector<double>> durations;
+    std::map<ProfileStage, PerfCounterValues> counters;
+    for(auto const &e: events) {
+        durations[e._stage].push_back(ticksToNanoseconds(e._endTicks - e._startTicks));
+        counters[e._stage] += e._counters;
+    }
+
+    for(auto const &entry: durations) {
+        auto const stage = entry.first;
+        writer.write(Profiler::getStageName(stage), fftSize, overlapCount,
+                     computeStatistics(entry.second),
+                     HWM_ENABLE_PERF_COUNTERS ? &counters[stage] : nullptr);
+    }
+}
+
+//==============================================================================
+//! "256,512" のようなカンマ区切りの値を読み込む。指定がないときは defaults を返す
+template<std::size_t N>
+static std::vector<int> parseIntList(juce::String const &text, int const (&defaults)[N])
+{
+    if(text.isEmpty()) {
+        return std::vector<int>(std::begin(defaults), std::end(defaults));
+    }
+
+    std::vector<int> values;
+    for(auto const &token: juce::StringArray::fromTokens(text, ",", "")) {
+        values.push_back(token.trim().getIntValue());
+    }
+    return values;
+}
+
+static int runBenchmarks(juce::ArgumentList const &args)
+{
+    auto const fftSizes = parseIntList(args.getValueForOption("--fft-sizes"), FFTDefines::fftSizes);
+    auto const overlapCounts = parseIntList(args.getValueForOption("--overlap-counts"), FFTDefines::overlapCounts);
+
+    auto const getIntOption = [&](char const *option, int defaultValue) {
+        auto const value = args.getValueForOption(option);
+        return value.isEmpty() ? defaultValue : std::max(1, value.getIntValue());
+    };
+
+    auto const numFrames = std::min(getIntOption("--frames", kDefaultNumFrames), kMaxNumFrames);
+    auto const numRepetitions = getIntOption("--repetitions", kDefaultRepetitions);
+
+    for(auto fftSize: fftSizes) {
+        if(FFTBackend::isSupportedSize(fftSize) == false) {
+            std::cerr << "Unsupported FFT size: " << fftSize << std::endl;
+            return 1;
+        }
+    }
+
+    juce::MemoryOutputStream stream;
+    ResultWriter writer(stream, numFrames, numRepetitions);
+
+    for(auto fftSize: fftSizes) {
+        for(auto overlapCount: overlapCounts) {
+            // ホップが 1 サンプル未満になる組み合わせは、プラグインでも処理できないので飛ばす
+            if(fftSize / overlapCount < 1) { continue; }
+
+            std::cerr << "fftSize " << fftSize << ", overlapCount " << overlapCount << std::endl;
+            benchmarkRingBuffer(fftSize, overlapCount, numRepetitions, writer);
+            benchmarkSpectralEngine(fftSize, overlapCount, numFrames, writer);
+        }
+    }
+
+    writer.finish();
+
+    auto const outputPath = args.getValueForOption("--output");
+    if(outputPath.isEmpty()) {
+        std::cout << stream.toString().toStdString();
+        return 0;
+    }
+
+    auto const file = juce::File::getCurrentWorkingDirectory().getChildFile(outputPath);
+    if(file.replaceWithText(stream.toString()) == false) {
+        std::cerr << "Failed to write " << file.getFullPathName().toStdString() << std::endl;
+        return 1;
+    }
+
+    return 0;
+}
+
+NS_HWM_END
+
+int main(int argc, char *argv[])
+{
+    return hwm::runBenchmarks(juce::ArgumentList(argc, argv));
+}
@@ -0,0 +1,167 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <type_traits>
+#include "Prefix.h"
+
+#if JUCE_LINUX
+#include <sys/mman.h>
+#endif
+
+NS_HWM_BEGIN
+
+/** Arena から切り出した固定長の配列
+ *
+ *  メモリを所有しないビューで、ReferenceableArray のうち要素へのアクセスに使用する関数だけを持つ。
+ *  サイズは Arena::build() の中でだけ決まり、それ以外の場所で変更することはできない。
+ */
+template<class T>
+class ArenaArray
+{
+public:
+    int size() const { return _size; }
+    bool isEmpty() const { return _size == 0; }
+
+    T * data() { return _data; }
+    T const * data() const { return _data; }
+    T * getRawDataPointer() { return _data; }
+    T const * getRawDataPointer() const { return _data; }
+
+    T * begin() { return _data; }
+    T * end() { return _data + _size; }
+    T const * begin() const { return _data; }
+    T const * end() const { return _data + _size; }
+
+    T & operator[](int index) { jassert(juce::isPositiveAndBelow(index, _size)); return _data[index]; }
+    T const & operator[](int index) const { jassert(juce::isPositiveAndBelow(index, _size)); return _data[index]; }
+    T & getReference(int index) { return (*this)[index]; }
+    T const & getReference(int index) const { return (*this)[index]; }
+    T getUnchecked(int index) const { return _data[index]; }
+    void setUnchecked(int index, T const &value) { _data[index] = value; }
+
+    void fill(T const &value) { std::fill(begin(), end(), value); }
+
+private:
+    friend class Arena;
+
+    T *_data = nullptr;
+    int _size = 0;
+};
+
+/** エンジンの作業用のメモリをまとめて確保するアロケータ
+ *
+ *  build() に渡したレイアウト関数を 2 回呼び出す。
+ *  1 回目は bind() で必要なサイズを数えるだけにして、合計のサイズのメモリを 1 回で確保し、
+ *  2 回目で同じ順番に各バッファへ切り出す。レイアウト関数の中では、処理でアクセスする順にバッファを並べておく。
+ *
+ *  それぞれのバッファ (AudioSampleBuffer はチャンネルごと) の先頭は kAlignment バイトに揃える。
+ *  Linux では、合計のサイズが大きいときに Transparent Huge Pages を使用するように要求する。
+ *  確保したメモリは 0 で初期化される。
+ */
+class Arena
+{
+public:
+    //! SIMD のロードとキャッシュラインに合わせたアライメント
+    inline static constexpr std::size_t kAlignment = 64;
+
+    //! この大きさ以上のときは、Huge Page の境界に揃えて確保する
+    inline static constexpr std::size_t kHugePageSize = 2 * 1024 * 1024;
+
+    Arena() = default;
+    Arena(Arena const &) = delete;
+    Arena & operator=(Arena const &) = delete;
+
+    //! メモリを確保し直して、レイアウト関数 layout(Arena &) に従ってバッファを切り出す
+    template<class F>
+    void build(F layout)
+    {
+        _storage.reset();
+        _base = nullptr;
+
+        _measuring = true;
+        _offset = 0;
+        layout(*this);
+
+        allocate(_offset);
+
+        _measuring = false;
+        _offset = 0;
+        layout(*this);
+        jassert(_offset == _totalSize);
+    }
+
+    template<class T>
+    void bind(ArenaArray<T> &arr, int numElements)
+    {
+        static_assert(std::is_trivially_copyable_v<T> && std::is_trivially_destructible_v<T>,
+                      "Arena には、0 で初期化したメモリをそのまま使用できる型しか置けない");
+
+        auto *p = take(sizeof(T) * numElements);
+        arr._data = reinterpret_cast<T *>(p);
+        arr._size = numElements;
+    }
+
+    //! juce::AudioBuffer が Arena のメモリを参照するようにする
+    template<class SampleType>
+    void bind(juce::AudioBuffer<SampleType> &buffer, int numChannels, int numSamples)
+    {
+        jassert(numChannels <= kMaxBufferChannels);
+
+        std::array<SampleType *, kMaxBufferChannels> channels {};
+        for(int ch = 0; ch < numChannels; ++ch) {
+            channels[ch] = reinterpret_cast<SampleType *>(take(sizeof(SampleType) * numSamples));
+        }
+
+        if(_measuring == false) {
+            buffer.setDataToReferTo(channels.data(), numChannels, numSamples);
+        }
+    }
+
+    //! 確保しているメモリのサイズ
+    std::size_t getTotalSize() const { return _totalSize; }
+
+private:
+    // juce::AudioBuffer がチャンネルのポインタの配列を内部の領域に保持できるチャンネル数
+    inline static constexpr int kMaxBufferChannels = 32;
+
+    std::unique_ptr<std::byte[]> _storage;
+    std::byte *_base = nullptr;
+    std::size_t _totalSize = 0;
+    std::size_t _offset = 0;
+    bool _measuring = false;
+
+    std::byte * take(std::size_t numBytes)
+    {
+        auto const begin = _offset;
+        _offset += (numBytes + kAlignment - 1) / kAlignment * kAlignment;
+        return _measuring ? nullptr : _base + begin;
+    }
+
+    void allocate(std::size_t numBytes)
+    {
+        _totalSize = numBytes;
+        if(numBytes == 0) { return; }
+
+        auto const useHugePages = (JUCE_LINUX != 0) && numBytes >= kHugePageSize;
+        auto const alignment = useHugePages ? kHugePageSize : kAlignment;
+
+        _storage.reset(new std::byte[numBytes + alignment]);
+        auto const address = reinterpret_cast<std::uintptr_t>(_storage.get());
+        _base = _storage.get() + (alignment - address % alignment) % alignment;
+
+       #if JUCE_LINUX
+        if(useHugePages) {
+            // ページに触れる前に要求しておく。失敗しても通常のページのまま使用できるので、結果は確認しない
+            madvise(_base, numBytes / kHugePageSize * kHugePageSize, MADV_HUGEPAGE);
+        }
+       #endif
+
+        std::memset(_base, 0, numBytes);
+    }
+};
+
+NS_HWM_END
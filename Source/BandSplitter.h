@@ -0,0 +1,76 @@
+#pragma once
+
+#include <array>
+#include "Prefix.h"
+
+NS_HWM_BEGIN
+
+/** Linkwitz-Riley フィルタで信号を 3 つの帯域に分割するクロスオーバー
+ *
+ *  低域には高い方のクロスオーバー周波数のオールパスフィルタを掛けて、
+ *  中域・高域と位相特性を揃えている。これによって、各帯域を足し合わせると元の信号のオールパス応答になる。
+ */
+template<class T>
+struct BandSplitter
+{
+    inline static constexpr int kNumBands = 3;
+
+    void prepare(double sampleRate, int numChannels, int maxBlockSize, T lowCrossover, T highCrossover)
+    {
+        juce::dsp::ProcessSpec spec { sampleRate, (juce::uint32)maxBlockSize, (juce::uint32)numChannels };
+
+        _lowCrossover.prepare(spec);
+        _lowCrossover.setCutoffFrequency(lowCrossover);
+
+        _highCrossover.prepare(spec);
+        _highCrossover.setCutoffFrequency(highCrossover);
+
+        _lowBandAllpass.prepare(spec);
+        _lowBandAllpass.setType(juce::dsp::LinkwitzRileyFilterType::allpass);
+        _lowBandAllpass.setCutoffFrequency(highCrossover);
+
+        for(auto &band: _bands) {
+            band.setSize(numChannels, maxBlockSize);
+            band.clear();
+        }
+    }
+
+    void reset()
+    {
+        _lowCrossover.reset();
+        _highCrossover.reset();
+        _lowBandAllpass.reset();
+    }
+
+    /** 入力信号を帯域ごとに分割して、内部のバッファに書き込む
+     *
+     *  @pre numSamples <= prepare() に指定した maxBlockSize
+     */
+    void process(juce::AudioBuffer<T> const &input, int numChannels, int numSamples)
+    {
+        for(int ch = 0; ch < numChannels; ++ch) {
+            auto const src = input.getReadPointer(ch);
+            auto const low = _bands[0].getWritePointer(ch);
+            auto const mid = _bands[1].getWritePointer(ch);
+            auto const high = _bands[2].getWritePointer(ch);
+
+            for(int i = 0; i < numSamples; ++i) {
+                T lowPart {};
+                T highPart {};
+                _lowCrossover.processSample(ch, src[i], lowPart, highPart);
+                low[i] = _lowBandAllpass.processSample(ch, lowPart);
+                _highCrossover.processSample(ch, highPart, mid[i], high[i]);
+            }
+        }
+    }
+
+    juce::AudioBuffer<T> & getBand(int index) { return _bands[index]; }
+
+private:
+    juce::dsp::LinkwitzRileyFilter<T> _lowCrossover;
+    juce::dsp::LinkwitzRileyFilter<T> _highCrossover;
+    juce::dsp::LinkwitzRileyFilter<T> _lowBandAllpass;
+    std::array<juce::AudioBuffer<T>, kNumBands> _bands;
+};
+
+NS_HWM_END
@@ -0,0 +1,110 @@
+#include "CpuGovernor.h"
+
+NS_HWM_BEGIN
+
+void CpuGovernor::prepare(double sampleRate)
+{
+    _sampleRate = sampleRate;
+    _smoothedLoad = 0;
+    _settleSeconds = kSettleSeconds;
+    _headroomSeconds = 0;
+    _numOverruns = 0;
+    _level.store(0, std::memory_order_relaxed);
+    _load.store(0, std::memory_order_relaxed);
+}
+
+bool CpuGovernor::update(double elapsedSeconds, int numSamples, bool canMeasure, Settings requested)
+{
+    if(numSamples <= 0) { return false; }
+
+    auto const blockSeconds = numSamples / _sampleRate;
+    auto const load = elapsedSeconds / blockSeconds;
+
+    // クロスフェード中は 2 つのエンジンで処理しているので、その間の処理時間は判定に使用しない
+    if(canMeasure == false) {
+        _settleSeconds = kSettleSeconds;
+        return false;
+    }
+
+    if(_settleSeconds > 0) {
+        _settleSeconds -= blockSeconds;
+        _smoothedLoad = load;
+        _load.store((float)load, std::memory_order_relaxed);
+        return false;
+    }
+
+    auto const coeff = 1.0 - std::exp(-blockSeconds / kLoadSmoothingSeconds);
+    _smoothedLoad += (load - _smoothedLoad) * coeff;
+    _load.store((float)_smoothedLoad, std::memory_order_relaxed);
+
+    _numOverruns = (load >= 1.0) ? _numOverruns + 1 : 0;
+
+    // ユーザーが設定を変更して、下げられる段階が減っていることもある
+    auto const maxLevel = getMaxLevel(requested);
+    auto const level = std::min(getLevel(), maxLevel);
+
+    if(_smoothedLoad > kHighLoad || _numOverruns >= kMaxOverruns) {
+        _headroomSeconds = 0;
+        if(level < maxLevel) {
+            changeLevel(level + 1);
+            return true;
+        }
+        return false;
+    }
+
+    if(level > 0 && _smoothedLoad < kLowLoad) {
+        _headroomSeconds += blockSeconds;
+        if(_headroomSeconds >= kStepUpSeconds) {
+            changeLevel(level - 1);
+            return true;
+        }
+    } else {
+        _headroomSeconds = 0;
+    }
+
+    return false;
+}
+
+bool CpuGovernor::reset()
+{
+    _settleSeconds = kSettleSeconds;
+    _headroomSeconds = 0;
+    _numOverruns = 0;
+    return _level.exchange(0, std::memory_order_relaxed) != 0;
+}
+
+void CpuGovernor::changeLevel(int level)
+{
+    _level.store(level, std::memory_order_relaxed);
+    _settleSeconds = kSettleSeconds;
+    _headroomSeconds = 0;
+    _numOverruns = 0;
+}
+
+CpuGovernor::Settings CpuGovernor::apply(Settings requested, int level)
+{
+    auto settings = requested;
+    for(int i = 0; i < level; ++i) {
+        if(settings._overlapCount / 2 >= kMinOverlapCount) {
+            settings._overlapCount /= 2;
+        } else if(settings._fftSize / 2 >= kMinFFTSize && settings._fftSize % 2 == 0) {
+            settings._fftSize /= 2;
+        } else {
+            break;
+        }
+    }
+
+    return settings;
+}
+
+int CpuGovernor::getMaxLevel(Settings requested)
+{
+    int level = 0;
+    while(apply(requested, level + 1) != apply(requested, level)) {
+        ++level;
+    }
+
+    return level;
+}
+
+NS_HWM_END
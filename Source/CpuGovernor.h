@@ -0,0 +1,90 @@
+#pragma once
+
+#include <atomic>
+#include "Prefix.h"
+
+NS_HWM_BEGIN
+
+/** 処理時間が足りないときに、オーバーラップ数と FFT サイズを一時的に下げるガバナー
+ *
+ *  オーディオスレッドから毎回のコールバックの処理時間を update() に渡す。
+ *  処理時間がブロックの長さに対して大きいときは品質を 1 段階ずつ下げ、十分な余裕が続いたときは 1 段階ずつ戻す。
+ *  段階を下げるときは、まずオーバーラップ数を半分にし、kMinOverlapCount に達したら FFT サイズを半分にする。
+ *
+ *  ガバナーは段階を決めるだけで、エンジンの作り直しは行わない。
+ *  呼び出し側は update() が true を返したときに、apply() で求めた設定のエンジンをバックグラウンドで構築して、クロスフェードで差し替える。
+ */
+class CpuGovernor
+{
+public:
+    struct Settings
+    {
+        int _fftSize = 0;
+        int _overlapCount = 0;
+
+        bool operator==(Settings const &rhs) const { return _fftSize == rhs._fftSize && _overlapCount == rhs._overlapCount; }
+        bool operator!=(Settings const &rhs) const { return !(*this == rhs); }
+    };
+
+    //! ガバナーが下げられる設定の下限
+    inline static constexpr int kMinOverlapCount = 4;
+    inline static constexpr int kMinFFTSize = 512;
+
+    //! 処理時間とブロックの長さの比がこの値を超えたら段階を下げる
+    inline static constexpr double kHighLoad = 0.75;
+
+    //! 処理時間とブロックの長さの比がこの値を下回る状態が kStepUpSeconds 続いたら段階を戻す。
+    //! 段階を戻すと処理量はおよそ 2 倍になるので、kHighLoad の半分より小さくしておく
+    inline static constexpr double kLowLoad = 0.3;
+    inline static constexpr double kStepUpSeconds = 2.0;
+
+    //! 処理時間を平均する時定数
+    inline static constexpr double kLoadSmoothingSeconds = 0.25;
+
+    //! 段階を変えたあと、新しいエンジンの処理時間が安定するまで判定を待つ時間
+    inline static constexpr double kSettleSeconds = 0.5;
+
+    //! 締め切りを超えたコールバックがこの回数続いたら、平均を待たずに段階を下げる
+    inline static constexpr int kMaxOverruns = 2;
+
+    void prepare(double sampleRate);
+
+    /** 1 回のコールバックの処理時間を渡して、段階を更新する (オーディオスレッドから呼び出す)
+     *
+     *  @param elapsedSeconds コールバックの処理時間
+     *  @param numSamples コールバックのブロックサイズ
+     *  @param canMeasure エンジンの差し替え中など、処理時間が通常と異なるときは false を渡す
+     *  @param requested ユーザーが選択した設定
+     *  @return 段階を変更したかどうか
+     */
+    bool update(double elapsedSeconds, int numSamples, bool canMeasure, Settings requested);
+
+    //! 段階を 0 に戻す。@return 段階が変わったかどうか
+    bool reset();
+
+    //! 現在の段階。0 のときはユーザーが選択した設定のまま処理する
+    int getLevel() const { return _level.load(std::memory_order_relaxed); }
+
+    //! 平均した処理時間とブロックの長さの比 (UI 表示用)
+    float getLoad() const { return _load.load(std::memory_order_relaxed); }
+
+    //! requested から level 段階だけ品質を下げた設定
+    static Settings apply(Settings requested, int level);
+
+    //! requested から下げられる段階の数
+    static int getMaxLevel(Settings requested);
+
+private:
+    double _sampleRate = 44100.0;
+    double _smoothedLoad = 0;
+    double _settleSeconds = 0;
+    double _headroomSeconds = 0;
+    int _numOverruns = 0;
+
+    std::atomic<int> _level { 0 };
+    std::atomic<float> _load { 0 };
+
+    void changeLevel(int level);
+};
+
+NS_HWM_END
@@ -0,0 +1,99 @@
+#include "DeadlineMonitor.h"
+
+NS_HWM_BEGIN
+
+// 書き込むのはオーディオスレッドだけなので、read-modify-write の atomic 命令は使わずに読んでから書き戻す
+template<class T>
+static void increment(std::atomic<T> &value) noexcept
+{
+    value.store(value.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+}
+
+void DeadlineMonitor::prepare(double sampleRate)
+{
+    _sampleRate = sampleRate;
+    _resetRequested.store(false, std::memory_order_relaxed);
+    clear();
+}
+
+void DeadlineMonitor::record(double elapsedSeconds, int numSamples) noexcept
+{
+    if(numSamples <= 0) { return; }
+
+    if(_resetRequested.load(std::memory_order_relaxed) && _resetRequested.exchange(false, std::memory_order_acquire)) {
+        clear();
+    }
+
+    auto const ratio = elapsedSeconds * _sampleRate / numSamples;
+
+    increment(_bins[(std::size_t)getBinIndex(ratio)]);
+    increment(_numCallbacks);
+    if(ratio > 1.0) {
+        increment(_numMisses);
+    }
+
+    if(ratio > _max.load(std::memory_order_relaxed)) {
+        _max.store((float)ratio, std::memory_order_relaxed);
+    }
+}
+
+DeadlineMonitor::Statistics DeadlineMonitor::getStatistics() const
+{
+    std::array<juce::uint32, kNumBins> bins;
+    juce::uint64 total = 0;
+    for(int i = 0; i < kNumBins; ++i) {
+        bins[i] = _bins[i].load(std::memory_order_relaxed);
+        total += bins[i];
+    }
+
+    Statistics stats;
+    stats._numCallbacks = _numCallbacks.load(std::memory_order_relaxed);
+    stats._numMisses = _numMisses.load(std::memory_order_relaxed);
+    stats._max = _max.load(std::memory_order_relaxed);
+
+    if(total == 0) { return stats; }
+
+    // 累積の度数が total * q 以上になった最初のビンの上端を分位点とする。最大値を超えないように切り詰める
+    auto const findQuantile = [&](double q) {
+        auto const threshold = (juce::uint64)std::ceil(total * q);
+        juce::uint64 sum = 0;
+        for(int i = 0; i < kNumBins; ++i) {
+            sum += bins[i];
+            if(sum >= threshold) {
+                return std::min(getBinUpperEdge(i), stats._max);
+            }
+        }
+        return stats._max;
+    };
+
+    stats._p50 = findQuantile(0.5);
+    stats._p99 = findQuantile(0.99);
+    stats._p999 = findQuantile(0.999);
+    return stats;
+}
+
+void DeadlineMonitor::clear() noexcept
+{
+    for(auto &bin: _bins) {
+        bin.store(0, std::memory_order_relaxed);
+    }
+
+    _numCallbacks.store(0, std::memory_order_relaxed);
+    _numMisses.store(0, std::memory_order_relaxed);
+    _max.store(0, std::memory_order_relaxed);
+}
+
+int DeadlineMonitor::getBinIndex(double ratio) noexcept
+{
+    if(ratio <= 0) { return 0; }
+
+    auto const index = (int)std::floor((std::log2(ratio) - kMinOctave) * kBinsPerOctave);
+    return juce::jlimit(0, kNumBins - 1, index);
+}
+
+float DeadlineMonitor::getBinUpperEdge(int index)
+{
+    return (float)std::exp2((double)(index + 1) / kBinsPerOctave + kMinOctave);
+}
+
+NS_HWM_END
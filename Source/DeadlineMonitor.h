@@ -0,0 +1,67 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include "Prefix.h"
+
+NS_HWM_BEGIN
+
+/** processBlock の処理時間を、そのブロックの長さ (締め切り) に対する比で集計する
+ *
+ *  オーディオスレッドから毎回のコールバックの処理時間を record() に渡す。
+ *  比は対数で等間隔なヒストグラムに数えるので、メモリの確保もロックも行わず、コールバックあたりのコストは数十ナノ秒程度で済む。
+ *  UI スレッドは getStatistics() でヒストグラムから分位点を求める。集計中のヒストグラムを読むので、値は近似になる。
+ *
+ *  ヒストグラムのビンの幅は 1 オクターブあたり kBinsPerOctave 個なので、分位点の誤差は 10% 程度になる。
+ */
+class DeadlineMonitor
+{
+public:
+    //! ヒストグラムで数える比の範囲 (2 の累乗)。範囲外のものは両端のビンに数える
+    inline static constexpr int kMinOctave = -10;
+    inline static constexpr int kMaxOctave = 4;
+    inline static constexpr int kBinsPerOctave = 8;
+    inline static constexpr int kNumBins = (kMaxOctave - kMinOctave) * kBinsPerOctave;
+
+    struct Statistics
+    {
+        juce::uint64 _numCallbacks = 0;
+        juce::uint64 _numMisses = 0;    //!< 処理時間がブロックの長さを超えたコールバックの数
+
+        // 処理時間とブロックの長さの比。1.0 を超えると締め切りに間に合っていない
+        float _p50 = 0;
+        float _p99 = 0;
+        float _p999 = 0;
+        float _max = 0;
+    };
+
+    //! 集計をリセットする (オーディオスレッドが止まっているときに呼び出す)
+    void prepare(double sampleRate);
+
+    //! コールバックの処理時間を記録する (オーディオスレッドから呼び出す)
+    void record(double elapsedSeconds, int numSamples) noexcept;
+
+    //! 集計結果を取得する (オーディオスレッド以外から呼び出す)
+    Statistics getStatistics() const;
+
+    //! 次のコールバックで集計をリセットするように要求する (オーディオスレッド以外から呼び出す)
+    void requestReset() { _resetRequested.store(true, std::memory_order_release); }
+
+private:
+    double _sampleRate = 44100.0;
+
+    std::array<std::atomic<juce::uint32>, kNumBins> _bins {};
+    std::atomic<juce::uint64> _numCallbacks { 0 };
+    std::atomic<juce::uint64> _numMisses { 0 };
+    std::atomic<float> _max { 0 };
+    std::atomic<bool> _resetRequested { false };
+
+    void clear() noexcept;
+
+    static int getBinIndex(double ratio) noexcept;
+
+    //! ビンの上端の比
+    static float getBinUpperEdge(int index);
+};
+
+NS_HWM_END
@@ -0,0 +1,241 @@
+#include "EngineState.h"
+#include "AudioBufferUtil.h"
+#include <type_traits>
+
+NS_HWM_BEGIN
+
+//==============================================================================
+/** SampleType の AudioBuffer で処理する EngineState の実装
+ *
+ *  帯域分割・遅延バッファ・ドライ/ウェットの作業用バッファもすべて SampleType で持つので、
+ *  ホストのバッファから出力まで型の変換が入らない。
+ */
+template<class SampleType>
+class TypedEngineState final : public EngineState
+{
+public:
+    using AudioBufferType = juce::AudioBuffer<SampleType>;
+
+    explicit TypedEngineState(Config const &config);
+
+    SpectralEngineBase const * getDisplayEngine() const override;
+
+    bool process(juce::AudioBuffer<float> &buffer,
+                 SpectralEngineBase::FrameParameters const &params,
+                 GainRamp dryLevel,
+                 GainRamp wetLevel) override
+    {
+        return processIfMatched(buffer, params, dryLevel, wetLevel);
+    }
+
+    bool process(juce::AudioBuffer<double> &buffer,
+                 SpectralEngineBase::FrameParameters const &params,
+                 GainRamp dryLevel,
+                 GainRamp wetLevel) override
+    {
+        return processIfMatched(buffer, params, dryLevel, wetLevel);
+    }
+
+private:
+    using RingBufferType = RingBuffer<SampleType>;
+
+    // 帯域の出力とドライ・ウェット信号の作業用のバッファは、_arena からまとめて切り出す
+    Arena _arena;
+
+    // 帯域ごとのエンジン。Multi Resolution が無効のときは全帯域を 1 つのエンジンで処理する
+    std::vector<std::unique_ptr<SpectralEngine<SampleType>>> _engines;
+    BandSplitter<SampleType> _bandSplitter;
+    std::array<RingBufferType, BandSplitter<SampleType>::kNumBands> _bandDelays; // 帯域ごとのレイテンシーの差を揃えるための遅延バッファ
+    AudioBufferType _bandOutput;
+
+    // Engine が PSOLA のときは、_engines の代わりにこちらで処理する
+    std::unique_ptr<PsolaEngine<SampleType>> _psolaEngine;
+
+    RingBufferType _dryRingBuffer; // ドライ信号をウェット信号のレイテンシーに揃えるための遅延バッファ
+
+    AudioBufferType _wetBuffer;
+    AudioBufferType _dryBuffer;
+
+    //! 構築した精度と buffer の型が一致するときだけ処理する
+    template<class T>
+    bool processIfMatched(juce::AudioBuffer<T> &buffer,
+                          SpectralEngineBase::FrameParameters const &params,
+                          GainRamp dryLevel,
+                          GainRamp wetLevel)
+    {
+        if constexpr(std::is_same_v<T, SampleType>) {
+            return processBuffer(buffer, params, dryLevel, wetLevel);
+        } else {
+            jassertfalse;
+            juce::ignoreUnused(buffer, params, dryLevel, wetLevel);
+            return false;
+        }
+    }
+
+    bool processBuffer(AudioBufferType &buffer,
+                       SpectralEngineBase::FrameParameters const &params,
+                       GainRamp dryLevel,
+                       GainRamp wetLevel);
+};
+
+template<class SampleType>
+TypedEngineState<SampleType>::TypedEngineState(Config const &config)
+:   EngineState(config)
+{
+    auto const sampleRate = config._sampleRate;
+    auto const numChannels = config._numChannels;
+    auto const maxBlockSize = config._maxBlockSize;
+    auto const fftSize = config._fftSize;
+
+    SpectralEngineBase::Config engineConfig;
+    engineConfig._sampleRate = sampleRate;
+    engineConfig._fftSize = fftSize;
+    engineConfig._overlapCount = config._overlapCount;
+    engineConfig._numChannels = numChannels;
+    engineConfig._maxBlockSize = maxBlockSize;
+    engineConfig._hostBlockSize = config._hostBlockSize;
+    engineConfig._latencyMode = config._latencyMode;
+    engineConfig._windowMode = config._windowMode;
+    engineConfig._profiler = config._profiler;
+    engineConfig._health = config._health;
+
+    // Multi Resolution が有効なときは、低域ほど長い FFT で処理する。
+    // 低域は指定した FFT サイズ、中域はその 1/2、高域は 1/4 (ただし 256 以上) にする。
+    int const numBands = config._multiResolution ? BandSplitter<SampleType>::kNumBands : 1;
+    int const minimumFFTSize = 256;
+
+    int latency = 0;
+
+    if(config._engineType == EngineType::kPsola) {
+        typename PsolaEngine<SampleType>::Config psolaConfig;
+        psolaConfig._sampleRate = sampleRate;
+        psolaConfig._numChannels = numChannels;
+        psolaConfig._maxBlockSize = maxBlockSize;
+
+        _psolaEngine = std::make_unique<PsolaEngine<SampleType>>();
+        _psolaEngine->prepare(psolaConfig);
+        latency = _psolaEngine->getLatencySamples();
+    }
+
+    for(int b = 0; _psolaEngine == nullptr && b < numBands; ++b) {
+        auto bandConfig = engineConfig;
+        bandConfig._fftSize = std::max(fftSize >> b, std::min(fftSize, minimumFFTSize));
+
+        auto engine = std::make_unique<SpectralEngine<SampleType>>();
+        engine->prepare(bandConfig);
+        latency = std::max(latency, engine->getLatencySamples());
+        _engines.push_back(std::move(engine));
+    }
+
+    if(_engines.size() > 1) {
+        _bandSplitter.prepare(sampleRate, numChannels, maxBlockSize, 500.0f, 2500.0f);
+
+        // 帯域ごとのレイテンシーを、最もレイテンシーが大きい帯域に揃える
+        for(int b = 0; b < numBands; ++b) {
+            auto const delay = latency - _engines[b]->getLatencySamples();
+            _bandDelays[b].resize(numChannels, delay + maxBlockSize);
+            _bandDelays[b].discardAll();
+            _bandDelays[b].fill(delay);
+        }
+    }
+
+    _dryRingBuffer.resize(numChannels, latency + maxBlockSize);
+    _dryRingBuffer.discardAll();
+    _dryRingBuffer.fill(latency);
+
+    _arena.build([&](Arena &arena) {
+        if(_engines.size() > 1) {
+            arena.bind(_bandOutput, numChannels, maxBlockSize);
+        }
+        arena.bind(_wetBuffer, numChannels, maxBlockSize);
+        arena.bind(_dryBuffer, numChannels, maxBlockSize);
+    });
+
+    _latencySamples = latency;
+}
+
+template<class SampleType>
+SpectralEngineBase const * TypedEngineState<SampleType>::getDisplayEngine() const
+{
+    // Multi Resolution のときは低域のエンジンのスペクトルを UI に表示する
+    return _engines.empty() ? nullptr : _engines[0].get();
+}
+
+template<class SampleType>
+bool TypedEngineState<SampleType>::processBuffer(AudioBufferType &buffer,
+                                                 SpectralEngineBase::FrameParameters const &params,
+                                                 GainRamp dryLevel,
+                                                 GainRamp wetLevel)
+{
+    auto const numChannels = _config._numChannels;
+    auto const bufferSize = buffer.getNumSamples();
+    jassert(bufferSize <= _config._maxBlockSize);
+
+    auto inputSubBuffer = getSubBufferOf(buffer, numChannels, bufferSize);
+    auto wetSubBuffer = getSubBufferOf(_wetBuffer, numChannels, bufferSize);
+
+    bool processed = false;
+
+    if(_psolaEngine) {
+        _psolaEngine->process(inputSubBuffer, wetSubBuffer, params._voices[0]._pitchChangeAmount, params._voices[0]._formantExpandAmount);
+    } else if(_engines.size() == 1) {
+        processed = _engines[0]->process(inputSubBuffer, wetSubBuffer, params);
+    } else {
+        _bandSplitter.process(buffer, numChannels, bufferSize);
+
+        auto bandOutput = getSubBufferOf(_bandOutput, numChannels, bufferSize);
+        wetSubBuffer.clear();
+
+        auto bandParams = params;
+
+        for(int b = 0; b < (int)_engines.size(); ++b) {
+            auto bandInput = getSubBufferOf(_bandSplitter.getBand(b), numChannels, bufferSize);
+            auto const bandProcessed = _engines[b]->process(bandInput, bandOutput, bandParams);
+
+            if(b == 0) {
+                processed = bandProcessed;
+
+                // 基本周波数は低域のエンジンだけで追跡し、中域と高域は低域と同じ補正量で移調する
+                bandParams._pitchCorrectionRatios = _engines[0]->getPitchCorrectionRatios();
+            }
+
+            auto const writeResult = _bandDelays[b].write(bandOutput);
+            auto const readResult = _bandDelays[b].read(bandOutput);
+            jassert(writeResult && readResult);
+            juce::ignoreUnused(writeResult, readResult);
+            _bandDelays[b].discard(bufferSize);
+
+            for(int ch = 0; ch < numChannels; ++ch) {
+                wetSubBuffer.addFrom(ch, 0, bandOutput, ch, 0, bufferSize);
+            }
+        }
+    }
+
+    // ドライ信号もウェット信号と同じだけ遅延させる
+    {
+        auto const writeResult = _dryRingBuffer.write(inputSubBuffer);
+        auto const readResult = _dryRingBuffer.read(getSubBufferOf(_dryBuffer, numChannels, bufferSize));
+        jassert(writeResult && readResult);
+        juce::ignoreUnused(writeResult, readResult);
+        _dryRingBuffer.discard(bufferSize);
+    }
+
+    for(int ch = 0; ch < numChannels; ++ch) {
+        buffer.copyFromWithRamp(ch, 0, _dryBuffer.getReadPointer(ch), bufferSize, dryLevel._start, dryLevel._end);
+        buffer.addFromWithRamp(ch, 0, _wetBuffer.getReadPointer(ch), bufferSize, wetLevel._start, wetLevel._end);
+    }
+
+    return processed;
+}
+
+//==============================================================================
+std::unique_ptr<EngineState> EngineState::create(Config const &config)
+{
+    if(config._doublePrecision) {
+        return std::make_unique<TypedEngineState<double>>(config);
+    } else {
+        return std::make_unique<TypedEngineState<float>>(config);
+    }
+}
+
+NS_HWM_END
@@ -0,0 +1,83 @@
+#pragma once
+
+#include "Prefix.h"
+#include "RingBuffer.h"
+#include "SpectralEngine.h"
+#include "BandSplitter.h"
+#include "PsolaEngine.h"
+#include "ParameterSnapshot.h"
+
+NS_HWM_BEGIN
+
+//! ピッチシフトとフォルマントシフトに使用する処理方式
+enum class EngineType {
+    kPhaseVocoder,  //!< SpectralEngine による周波数領域の処理
+    kPsola,         //!< PsolaEngine による時間領域の処理。低レイテンシー・低負荷だが、単一のピッチを持つ音声向け
+};
+
+/** 1 つの設定で処理するためのエンジンとバッファ一式
+ *
+ *  FFT サイズなどの設定を変更するときは、バックグラウンドスレッドで新しい EngineState を丸ごと構築して
+ *  オーディオスレッドに渡す。オーディオスレッドは構築済みの EngineState を差し替えるだけで、メモリの確保や解放を行わない。
+ *  ウェット信号だけでなく、ドライ信号の遅延もこのクラスで行う (レイテンシーが設定によって変わるため)。
+ *
+ *  エンジンとバッファはホストの処理精度 (Config::_doublePrecision) に合わせた型で構築する。
+ *  process() は構築した精度のものだけが使用でき、もう一方を呼び出したときは何もしない。
+ */
+class EngineState
+{
+public:
+    struct Config
+    {
+        double _sampleRate = 44100.0;
+        int _numChannels = 1;
+        int _maxBlockSize = 512;
+        int _hostBlockSize = 512;       //!< ホストが prepareToPlay で指定したブロックサイズ。レイテンシーの計算に使用する
+        int _fftSize = 1024;
+        int _overlapCount = 8;
+        LatencyMode _latencyMode = LatencyMode::kStandard;
+        WindowMode _windowMode = WindowMode::kSymmetric;
+        bool _multiResolution = false;
+        EngineType _engineType = EngineType::kPhaseVocoder;
+        bool _doublePrecision = false;  //!< double の AudioBuffer で処理するかどうか
+        Profiler *_profiler = nullptr;  //!< SpectralEngine に渡す計測結果の記録先
+        NumericalHealth *_health = nullptr; //!< SpectralEngine に渡す数値の異常の集計先
+    };
+
+    //! 設定に従ってエンジンを構築し、すべてのバッファを確保する
+    static std::unique_ptr<EngineState> create(Config const &config);
+
+    virtual ~EngineState() = default;
+
+    Config const & getConfig() const { return _config; }
+    int getLatencySamples() const { return _latencySamples; }
+
+    //! UI にスペクトルを表示するためのエンジン。PSOLA のときは nullptr
+    virtual SpectralEngineBase const * getDisplayEngine() const = 0;
+
+    /** buffer を処理して、遅延させたドライ信号とウェット信号を混ぜたものを書き戻す
+     *
+     *  @return 表示用のエンジンが新しいフレームを処理したかどうか
+     *  @pre buffer.getNumSamples() <= Config::_maxBlockSize
+     *  @pre Config::_doublePrecision が buffer のサンプルの型と一致していること
+     */
+    virtual bool process(juce::AudioBuffer<float> &buffer,
+                         SpectralEngineBase::FrameParameters const &params,
+                         GainRamp dryLevel,
+                         GainRamp wetLevel) = 0;
+
+    virtual bool process(juce::AudioBuffer<double> &buffer,
+                         SpectralEngineBase::FrameParameters const &params,
+                         GainRamp dryLevel,
+                         GainRamp wetLevel) = 0;
+
+protected:
+    explicit EngineState(Config const &config)
+    :   _config(config)
+    {}
+
+    Config _config;
+    int _latencySamples = 0;
+};
+
+NS_HWM_END
@@ -0,0 +1,49 @@
+#pragma once
+
+#include "Prefix.h"
+#include <iterator>
+
+NS_HWM_BEGIN
+
+//! プラグインで選択できる FFT サイズとオーバーラップ数。パラメータの選択肢と、ベンチマークの計測対象に使用する
+struct FFTDefines {
+    /** 選択できる FFT サイズ。2 の累乗の間に 3 * 2^n と 5 * 2^n のサイズを挟んで、細かく分解能を選べるようにしている
+     *
+     *  2 の累乗だけを選択できたときのサイズ (legacyFFTSizes) は、インデックスが legacyIndexStride の倍数の位置に並ぶ。
+     *  ホストは選択肢の値を index / (選択肢の数 - 1) に正規化して保存するので、
+     *  2 の累乗だけの選択肢のときに記録したオートメーションの値も、同じ FFT サイズを指す。
+     *  選択肢を追加するときは、この関係を崩さないこと
+     */
+    inline static constexpr int fftSizes[] = {
+        256, 320, 384, 512, 640, 768, 1024, 1280, 1536, 2048, 2560, 3072,
+        4096, 5120, 6144, 8192, 10240, 12288, 16384
+    };
+    inline static constexpr int fftSizeDefaultIndex = 6;
+
+    //! 2 の累乗のサイズだけを選択できたときの FFT サイズ
+    inline static constexpr int legacyFFTSizes[] = { 256, 512, 1024, 2048, 4096, 8192, 16384 };
+    inline static constexpr int legacyIndexStride = (int)(std::size(fftSizes) - 1) / (int)(std::size(legacyFFTSizes) - 1);
+
+    //! legacyFFTSizes のインデックスに対応する、fftSizes のインデックス
+    static constexpr int getIndexOfLegacyFFTSize(int legacyIndex) { return legacyIndex * legacyIndexStride; }
+
+    //! 2 の累乗だけの選択肢の正規化した値が、fftSizes の同じサイズを指しているかどうか
+    static constexpr bool isCompatibleWithLegacyFFTSizes()
+    {
+        if((std::size(fftSizes) - 1) % (std::size(legacyFFTSizes) - 1) != 0) { return false; }
+
+        for(int i = 0; i < (int)std::size(legacyFFTSizes); ++i) {
+            if(fftSizes[getIndexOfLegacyFFTSize(i)] != legacyFFTSizes[i]) { return false; }
+        }
+        return true;
+    }
+
+    //! 選択できるオーバーラップ数
+    inline static constexpr int overlapCounts[] = { 2, 4, 8, 16, 32, 64 };
+    inline static constexpr int overlapCountDefaultIndex = 2;
+};
+
+static_assert(FFTDefines::isCompatibleWithLegacyFFTSizes(),
+              "The power-of-two FFT sizes must keep their normalised parameter values");
+
+NS_HWM_END
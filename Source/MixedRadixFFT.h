@@ -0,0 +1,287 @@
+#pragma once
+
+#include <cmath>
+#include <memory>
+#include <vector>
+#include "Prefix.h"
+
+NS_HWM_BEGIN
+
+/** 2, 3, 5 の積で表せるサイズを扱える混合基数の FFT
+ *
+ *  Stockham の自動ソート型アルゴリズムで実装しているので、ビットリバースの並べ替えが不要。
+ *  juce::dsp::FFT と同じく、逆変換の結果は 1/N でスケーリングされる。
+ *  基数の分解と回転因子は変更されない Plan にまとめてあり、同じサイズのインスタンス間で共有できる。
+ */
+struct MixedRadixFFT
+{
+    using Complex = juce::dsp::Complex<float>;
+
+    //! サイズごとに決まる、FFT の実行中に変更されないデータ
+    struct Plan
+    {
+        explicit Plan(int size)
+        :   _size(size)
+        {
+            jassert(isSupportedSize(size));
+
+            // 基数 4 を優先して使用して、段数を減らす
+            for(int n = size; n > 1; ) {
+                for(int radix: { 4, 2, 3, 5 }) {
+                    if(n % radix == 0) {
+                        _factors.push_back(radix);
+                        n /= radix;
+                        break;
+                    }
+                }
+            }
+
+            _twiddles.resize(size);
+            for(int i = 0; i < size; ++i) {
+                auto const theta = -2.0 * M_PI * i / size;
+                _twiddles[i] = Complex { (float)std::cos(theta), (float)std::sin(theta) };
+            }
+        }
+
+        int _size = 0;
+        std::vector<int> _factors;
+        std::vector<Complex> _twiddles;
+    };
+
+    explicit MixedRadixFFT(int size)
+    :   MixedRadixFFT(std::make_shared<Plan const>(size))
+    {}
+
+    explicit MixedRadixFFT(std::shared_ptr<Plan const> plan)
+    :   _plan(std::move(plan))
+    ,   _size(_plan->_size)
+    {
+        _scratch.resize(_size);
+    }
+
+    //! 2, 3, 5 以外の素因数を持たないサイズかどうか
+    static bool isSupportedSize(int size)
+    {
+        if(size < 1) { return false; }
+
+        for(int radix: { 2, 3, 5 }) {
+            while(size % radix == 0) {
+                size /= radix;
+            }
+        }
+
+        return size == 1;
+    }
+
+    int getSize() const { return _size; }
+
+    /** FFT を実行する
+     *
+     *  input と output は同じバッファでもよい。
+     *  内部の作業用バッファを使用するので、同じインスタンスを複数のスレッドから同時に呼び出すことはできない。
+     */
+    void perform(Complex const *input, Complex *output, bool inverse)
+    {
+        std::copy_n(input, _size, output);
+
+        Complex *x = output;
+        Complex *y = _scratch.data();
+
+        int n = _size;
+        int stride = 1;
+        for(auto radix: _plan->_factors) {
+            switch(radix) {
+                case 2: processRadix2(n, stride, x, y, inverse); break;
+                case 3: processRadix3(n, stride, x, y, inverse); break;
+                case 4: processRadix4(n, stride, x, y, inverse); break;
+                case 5: processRadix5(n, stride, x, y, inverse); break;
+                default: jassertfalse; break;
+            }
+
+            n /= radix;
+            stride *= radix;
+            std::swap(x, y);
+        }
+
+        if(x != output) {
+            std::copy_n(x, _size, output);
+        }
+
+        if(inverse) {
+            auto const scale = 1.0f / _size;
+            for(int i = 0; i < _size; ++i) {
+                output[i] *= scale;
+            }
+        }
+    }
+
+private:
+    std::shared_ptr<Plan const> _plan;
+    int _size = 0;
+    std::vector<Complex> _scratch;
+
+    //! exp(-2πi k / N)。逆変換のときは共役を返す
+    Complex getTwiddle(int k, bool inverse) const
+    {
+        auto const w = _plan->_twiddles[k];
+        return inverse ? std::conj(w) : w;
+    }
+
+    //! 逆変換のときに回転方向を反転した -i の乗算
+    static Complex rotate(Complex v, bool inverse)
+    {
+        return inverse ? Complex { -v.imag(), v.real() } : Complex { v.imag(), -v.real() };
+    }
+
+    // 各ステージでは、長さ n の部分列 (要素の間隔 stride) を基数 radix で分解する。
+    // n * stride は常に N に等しいので、回転因子は Plan::_twiddles[p * j * stride] で求まる。
+
+    void processRadix2(int n, int stride, Complex const *x, Complex *y, bool inverse) const
+    {
+        int const m = n / 2;
+        for(int p = 0; p < m; ++p) {
+            auto const w1 = getTwiddle(p * stride, inverse);
+            for(int q = 0; q < stride; ++q) {
+                auto const a0 = x[q + stride * p];
+                auto const a1 = x[q + stride * (p + m)];
+                y[q + stride * (2 * p + 0)] = a0 + a1;
+                y[q + stride * (2 * p + 1)] = (a0 - a1) * w1;
+            }
+        }
+    }
+
+    void processRadix3(int n, int stride, Complex const *x, Complex *y, bool inverse) const
+    {
+        int const m = n / 3;
+        float const c1 = -0.5f;
+        float const s1 = (float)(std::sqrt(3.0) * 0.5);
+
+        for(int p = 0; p < m; ++p) {
+            auto const w1 = getTwiddle(p * stride, inverse);
+            auto const w2 = getTwiddle(2 * p * stride, inverse);
+            for(int q = 0; q < stride; ++q) {
+                auto const a0 = x[q + stride * p];
+                auto const a1 = x[q + stride * (p + m)];
+                auto const a2 = x[q + stride * (p + 2 * m)];
+
+                auto const t1 = a1 + a2;
+                auto const t2 = a0 + c1 * t1;
+                auto const t3 = rotate(a1 - a2, inverse) * s1;
+
+                y[q + stride * (3 * p + 0)] = a0 + t1;
+                y[q + stride * (3 * p + 1)] = (t2 + t3) * w1;
+                y[q + stride * (3 * p + 2)] = (t2 - t3) * w2;
+            }
+        }
+    }
+
+    void processRadix4(int n, int stride, Complex const *x, Complex *y, bool inverse) const
+    {
+        int const m = n / 4;
+        for(int p = 0; p < m; ++p) {
+            auto const w1 = getTwiddle(p * stride, inverse);
+            auto const w2 = getTwiddle(2 * p * stride, inverse);
+            auto const w3 = getTwiddle(3 * p * stride, inverse);
+            for(int q = 0; q < stride; ++q) {
+                auto const a0 = x[q + stride * p];
+                auto const a1 = x[q + stride * (p + m)];
+                auto const a2 = x[q + stride * (p + 2 * m)];
+                auto const a3 = x[q + stride * (p + 3 * m)];
+
+                auto const t0 = a0 + a2;
+                auto const t1 = a0 - a2;
+                auto const t2 = a1 + a3;
+                auto const t3 = rotate(a1 - a3, inverse);
+
+                y[q + stride * (4 * p + 0)] = t0 + t2;
+                y[q + stride * (4 * p + 1)] = (t1 + t3) * w1;
+                y[q + stride * (4 * p + 2)] = (t0 - t2) * w2;
+                y[q + stride * (4 * p + 3)] = (t1 - t3) * w3;
+            }
+        }
+    }
+
+    void processRadix5(int n, int stride, Complex const *x, Complex *y, bool inverse) const
+    {
+        int const m = n / 5;
+        float const c1 = (float)std::cos(2.0 * M_PI / 5.0);
+        float const c2 = (float)std::cos(4.0 * M_PI / 5.0);
+        float const s1 = (float)std::sin(2.0 * M_PI / 5.0);
+        float const s2 = (float)std::sin(4.0 * M_PI / 5.0);
+
+        for(int p = 0; p < m; ++p) {
+            auto const w1 = getTwiddle(p * stride, inverse);
+            auto const w2 = getTwiddle(2 * p * stride, inverse);
+            auto const w3 = getTwiddle(3 * p * stride, inverse);
+            auto const w4 = getTwiddle(4 * p * stride, inverse);
+            for(int q = 0; q < stride; ++q) {
+                auto const a0 = x[q + stride * p];
+                auto const a1 = x[q + stride * (p + m)];
+                auto const a2 = x[q + stride * (p + 2 * m)];
+                auto const a3 = x[q + stride * (p + 3 * m)];
+                auto const a4 = x[q + stride * (p + 4 * m)];
+
+                auto const b1 = a1 + a4;
+                auto const b2 = a2 + a3;
+                auto const d1 = rotate(a1 - a4, inverse);
+                auto const d2 = rotate(a2 - a3, inverse);
+
+                auto const t1 = a0 + c1 * b1 + c2 * b2;
+                auto const t2 = a0 + c2 * b1 + c1 * b2;
+                auto const t3 = s1 * d1 + s2 * d2;
+                auto const t4 = s2 * d1 - s1 * d2;
+
+                y[q + stride * (5 * p + 0)] = a0 + b1 + b2;
+                y[q + stride * (5 * p + 1)] = (t1 + t3) * w1;
+                y[q + stride * (5 * p + 2)] = (t2 + t4) * w2;
+                y[q + stride * (5 * p + 3)] = (t2 - t4) * w3;
+                y[q + stride * (5 * p + 4)] = (t1 - t3) * w4;
+            }
+        }
+    }
+};
+
+/** FFT のバックエンド
+ *
+ *  2 の累乗のサイズでは juce::dsp::FFT を、それ以外のサイズでは MixedRadixFFT を使用する。
+ *  juce::dsp::FFT は環境によっては perform() の中でロックを取るので、インスタンス間では共有しない。
+ */
+struct FFTBackend
+{
+    using Complex = juce::dsp::Complex<float>;
+
+    /** @param mixedRadixPlan MixedRadixFFT を使用するときに共有する Plan。nullptr のときは新しく作成する
+     */
+    explicit FFTBackend(int size, std::shared_ptr<MixedRadixFFT::Plan const> mixedRadixPlan = nullptr)
+    :   _size(size)
+    {
+        if(juce::isPowerOfTwo(size)) {
+            _pow2FFT = std::make_unique<juce::dsp::FFT>(juce::roundToInt(std::log2(size)));
+        } else if(mixedRadixPlan) {
+            jassert(mixedRadixPlan->_size == size);
+            _mixedRadixFFT = std::make_unique<MixedRadixFFT>(std::move(mixedRadixPlan));
+        } else {
+            _mixedRadixFFT = std::make_unique<MixedRadixFFT>(size);
+        }
+    }
+
+    static bool isSupportedSize(int size) { return MixedRadixFFT::isSupportedSize(size); }
+
+    int getSize() const { return _size; }
+
+    void perform(Complex const *input, Complex *output, bool inverse)
+    {
+        if(_pow2FFT) {
+            _pow2FFT->perform(input, output, inverse);
+        } else {
+            _mixedRadixFFT->perform(input, output, inverse);
+        }
+    }
+
+private:
+    int _size = 0;
+    std::unique_ptr<juce::dsp::FFT> _pow2FFT;
+    std::unique_ptr<MixedRadixFFT> _mixedRadixFFT;
+};
+
+NS_HWM_END
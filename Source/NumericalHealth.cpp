@@ -0,0 +1,181 @@
+#include "NumericalHealth.h"
+#include <cstring>
+
+NS_HWM_BEGIN
+
+//! IEEE 754 の浮動小数点数の、符号を除いたビット表現の境界
+template<class T> struct FloatBits;
+
+template<> struct FloatBits<float>
+{
+    using Type = juce::uint32;
+    inline static constexpr Type kAbsMask = 0x7fffffffu;
+    inline static constexpr Type kExponentMask = 0x7f800000u;  //!< Inf のビット表現
+    inline static constexpr Type kMinNormal = 0x00800000u;
+};
+
+template<> struct FloatBits<double>
+{
+    using Type = juce::uint64;
+    inline static constexpr Type kAbsMask = 0x7fffffffffffffffull;
+    inline static constexpr Type kExponentMask = 0x7ff0000000000000ull;
+    inline static constexpr Type kMinNormal = 0x0010000000000000ull;
+};
+
+template<class T>
+static typename FloatBits<T>::Type getAbsBits(T value) noexcept
+{
+    typename FloatBits<T>::Type bits;
+    std::memcpy(&bits, &value, sizeof(bits));
+    return bits & FloatBits<T>::kAbsMask;
+}
+
+template<class T>
+HealthCounts NumericalHealth::scan(T const *data, int n, T overflowThreshold) noexcept
+{
+    using Bits = FloatBits<T>;
+
+    // 符号を除いたビット表現は、非負の浮動小数点数の大小関係と一致するので、整数の比較だけで分類できる
+    auto const thresholdBits = getAbsBits(overflowThreshold);
+
+    int numNaN = 0;
+    int numInf = 0;
+    int numDenormal = 0;
+    int numOverflow = 0;
+
+    for(int i = 0; i < n; ++i) {
+        auto const bits = getAbsBits(data[i]);
+        numNaN += (bits > Bits::kExponentMask);
+        numInf += (bits == Bits::kExponentMask);
+        numDenormal += (bits != 0) & (bits < Bits::kMinNormal);
+        numOverflow += (bits > thresholdBits) & (bits < Bits::kExponentMask);
+    }
+
+    HealthCounts counts;
+    counts._counts[(int)HealthIssue::kNaN] = numNaN;
+    counts._counts[(int)HealthIssue::kInf] = numInf;
+    counts._counts[(int)HealthIssue::kDenormal] = numDenormal;
+    counts._counts[(int)HealthIssue::kOverflow] = numOverflow;
+    return counts;
+}
+
+template HealthCounts NumericalHealth::scan<float>(float const *, int, float) noexcept;
+template HealthCounts NumericalHealth::scan<double>(double const *, int, double) noexcept;
+
+void NumericalHealth::record(HealthStage stage, HealthCounts const &counts) noexcept
+{
+    if(counts.hasIssue() == false) { return; }
+
+    auto &events = _numEvents[(std::size_t)stage];
+    for(int i = 0; i < kNumIssues; ++i) {
+        if(counts._counts[i] != 0) {
+            events[i].fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+}
+
+void NumericalHealth::recordRecovery() noexcept
+{
+    _numRecoveries.fetch_add(1, std::memory_order_relaxed);
+}
+
+NumericalHealth::Report NumericalHealth::getReport() const
+{
+    Report report;
+    for(int s = 0; s < kNumStages; ++s) {
+        for(int i = 0; i < kNumIssues; ++i) {
+            report._numEvents[s][i] = _numEvents[s][i].load(std::memory_order_relaxed);
+        }
+    }
+
+    report._numRecoveries = _numRecoveries.load(std::memory_order_relaxed);
+    return report;
+}
+
+void NumericalHealth::reset() noexcept
+{
+    for(auto &events: _numEvents) {
+        for(auto &e: events) {
+            e.store(0, std::memory_order_relaxed);
+        }
+    }
+
+    _numRecoveries.store(0, std::memory_order_relaxed);
+}
+
+juce::uint64 NumericalHealth::Report::getTotal(HealthIssue issue) const
+{
+    juce::uint64 total = 0;
+    for(auto const &events: _numEvents) {
+        total += events[(std::size_t)issue];
+    }
+    return total;
+}
+
+juce::uint64 NumericalHealth::Report::getNumSeriousEvents() const
+{
+    juce::uint64 total = _numRecoveries;
+    for(int s = 0; s < kNumStages; ++s) {
+        if(s == (int)HealthStage::kInput) { continue; }
+
+        auto const &events = _numEvents[(std::size_t)s];
+        total += events[(std::size_t)HealthIssue::kNaN];
+        total += events[(std::size_t)HealthIssue::kInf];
+        total += events[(std::size_t)HealthIssue::kOverflow];
+    }
+    return total;
+}
+
+bool NumericalHealth::Report::hasIssues() const
+{
+    return getNumSeriousEvents() != 0;
+}
+
+juce::String NumericalHealth::Report::toString() const
+{
+    juce::String str;
+    str << "recoveries " << (juce::int64)_numRecoveries;
+
+    for(int s = 0; s < kNumStages; ++s) {
+        juce::String issues;
+        for(int i = 0; i < kNumIssues; ++i) {
+            if(_numEvents[s][i] == 0) { continue; }
+            if(issues.isNotEmpty()) { issues << ", "; }
+            issues << getIssueName((HealthIssue)i) << " " << (juce::int64)_numEvents[s][i];
+        }
+
+        if(issues.isNotEmpty()) {
+            str << "; " << getStageName((HealthStage)s) << ": " << issues;
+        }
+    }
+
+    return str;
+}
+
+char const * NumericalHealth::getStageName(HealthStage stage)
+{
+    switch(stage) {
+        case HealthStage::kInput:           return "input";
+        case HealthStage::kForwardFFT:      return "forwardFFT";
+        case HealthStage::kEnvelope:        return "envelope";
+        case HealthStage::kAnalysis:        return "vocoderAnalysis";
+        case HealthStage::kSynthesis:       return "vocoderSynthesis";
+        case HealthStage::kFineStructure:   return "fineStructure";
+        case HealthStage::kRecombine:       return "recombine";
+        case HealthStage::kOutput:          return "output";
+        default:                            return "unknown";
+    }
+}
+
+char const * NumericalHealth::getIssueName(HealthIssue issue)
+{
+    switch(issue) {
+        case HealthIssue::kNaN:         return "NaN";
+        case HealthIssue::kInf:         return "Inf";
+        case HealthIssue::kDenormal:    return "denormal";
+        case HealthIssue::kOverflow:    return "overflow";
+        default:                        return "unknown";
+    }
+}
+
+NS_HWM_END
@@ -0,0 +1,125 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include "Prefix.h"
+
+NS_HWM_BEGIN
+
+//! 数値の異常を検査する処理の段階
+enum class HealthStage {
+    kInput,             //!< ホストから受け取った入力信号
+    kForwardFFT,        //!< 解析フレームのスペクトル
+    kEnvelope,          //!< スペクトル包絡 (対数振幅)
+    kAnalysis,          //!< Phase Vocoder の振幅と瞬時周波数
+    kSynthesis,         //!< ピッチシフトしたスペクトルと合成位相
+    kFineStructure,     //!< 微細構造 (対数振幅)
+    kRecombine,         //!< 再結合したスペクトル
+    kOutput,            //!< 窓掛けと音量補正を終えた合成フレーム
+    kNumStages,
+};
+
+//! 検査する数値の異常の種類
+enum class HealthIssue {
+    kNaN,
+    kInf,
+    kDenormal,
+    kOverflow,      //!< 有限だが、段階ごとに決めた上限を超える値
+    kNumIssues,
+};
+
+//! 1 つの配列を検査した結果。異常の種類ごとの要素数
+struct HealthCounts
+{
+    std::array<int, (int)HealthIssue::kNumIssues> _counts {};
+
+    int get(HealthIssue issue) const { return _counts[(int)issue]; }
+
+    //! NaN と Inf を含まないかどうか
+    bool isFinite() const { return get(HealthIssue::kNaN) == 0 && get(HealthIssue::kInf) == 0; }
+
+    //! 後続の処理の状態を壊すおそれがある値 (NaN / Inf / 上限を超える値) を含むかどうか
+    bool isCorrupted() const { return isFinite() == false || get(HealthIssue::kOverflow) != 0; }
+
+    bool hasIssue() const { return isCorrupted() || get(HealthIssue::kDenormal) != 0; }
+
+    HealthCounts & operator+=(HealthCounts const &rhs)
+    {
+        for(std::size_t i = 0; i < _counts.size(); ++i) { _counts[i] += rhs._counts[i]; }
+        return *this;
+    }
+};
+
+/** リリースビルドでも有効な、数値の異常の検査と集計
+ *
+ *  SpectralEngine はフレームごとに各段階の結果を scan() で検査して、異常があれば record() で数える。
+ *  scan() は値のビット表現を整数として比較するだけの分岐のないループなので、コンパイラがベクトル化でき、FFT に比べて十分に軽い。
+ *
+ *  集計はプラグインのインスタンスごとに 1 つ持ち、異常のあったフレームの数を段階と種類ごとに atomic 変数で数える。
+ *  書き込むのは異常があったときだけなので、ロックは取らずに fetch_add する。
+ */
+class NumericalHealth
+{
+public:
+    inline static constexpr int kNumStages = (int)HealthStage::kNumStages;
+    inline static constexpr int kNumIssues = (int)HealthIssue::kNumIssues;
+
+    struct Report
+    {
+        //! 段階と種類ごとの、異常を含んでいたフレームの数
+        std::array<std::array<juce::uint64, kNumIssues>, kNumStages> _numEvents {};
+
+        //! 壊れた状態をリセットした回数
+        juce::uint64 _numRecoveries = 0;
+
+        juce::uint64 getTotal(HealthIssue issue) const;
+
+        /** 出力を壊すおそれがある異常の数
+         *
+         *  kInput 以外の段階の NaN / Inf / 上限を超える値と、状態をリセットした回数の合計。
+         *  非正規化数は減衰する余韻などで普通に現れるので含めない。
+         *  入力信号の NaN / Inf は、後続の段階の検査とリセットで数えられるので含めない。
+         */
+        juce::uint64 getNumSeriousEvents() const;
+
+        //! getNumSeriousEvents() が 0 でないかどうか
+        bool hasIssues() const;
+
+        //! ログ出力用の文字列。異常のあった段階だけを並べる
+        juce::String toString() const;
+    };
+
+    /** data の n 個の要素を検査する
+     *
+     *  @param overflowThreshold この値より絶対値が大きい有限の値を kOverflow として数える
+     */
+    template<class T>
+    static HealthCounts scan(T const *data, int n, T overflowThreshold) noexcept;
+
+    //! 複素数の配列を、実部と虚部の 2n 個の要素として検査する
+    static HealthCounts scan(ComplexType const *data, int n, float overflowThreshold) noexcept
+    {
+        return scan(reinterpret_cast<float const *>(data), n * 2, overflowThreshold);
+    }
+
+    //! 検査の結果を数える (オーディオスレッドから呼び出す)
+    void record(HealthStage stage, HealthCounts const &counts) noexcept;
+
+    //! 状態をリセットしたことを数える (オーディオスレッドから呼び出す)
+    void recordRecovery() noexcept;
+
+    //! 集計結果を取得する (オーディオスレッド以外から呼び出す)
+    Report getReport() const;
+
+    //! 集計をリセットする (オーディオスレッド以外から呼び出す)。同時に数えられたものは失われることがある
+    void reset() noexcept;
+
+    static char const * getStageName(HealthStage stage);
+    static char const * getIssueName(HealthIssue issue);
+
+private:
+    std::array<std::array<std::atomic<juce::uint64>, kNumIssues>, kNumStages> _numEvents {};
+    std::atomic<juce::uint64> _numRecoveries { 0 };
+};
+
+NS_HWM_END
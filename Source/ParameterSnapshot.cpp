@@ -0,0 +1,109 @@
+#include "ParameterSnapshot.h"
+#include "PluginProcessor.h"
+
+NS_HWM_BEGIN
+
+RealtimeParameters::RealtimeParameters(juce::AudioProcessorValueTreeState &apvts)
+{
+    auto const getValue = [&apvts](juce::String const &id) {
+        auto *value = apvts.getRawParameterValue(id);
+        jassert(value != nullptr);
+        return value;
+    };
+
+    _voices[0]._pitch = getValue(ParameterIds::pitch);
+    _voices[0]._formant = getValue(ParameterIds::formant);
+    for(int v = 1; v < SpectralEngineBase::kMaxVoices; ++v) {
+        _voices[v]._pitch = getValue(ParameterIds::harmonyPitches[v - 1]);
+        _voices[v]._formant = getValue(ParameterIds::harmonyFormants[v - 1]);
+    }
+
+    _envelopeOrder = getValue(ParameterIds::envelopeOrder);
+    _numVoices = getValue(ParameterIds::numVoices);
+    _stereoLink = getValue(ParameterIds::stereoLink);
+    _pitchCorrection = getValue(ParameterIds::pitchCorrection);
+    _dryWetRate = getValue(ParameterIds::dryWetRate);
+    _outputGain = getValue(ParameterIds::outputGain);
+
+    _lastFrameValues.fill(0.0f);
+}
+
+void RealtimeParameters::prepare(double sampleRate)
+{
+    _wetLevelSmoother.reset(sampleRate, kSmoothingSeconds);
+    _outputGainSmoother.reset(sampleRate, kSmoothingSeconds);
+    _firstUpdate = true;
+}
+
+ParameterSnapshot const & RealtimeParameters::update(int numSamples)
+{
+    auto &snapshot = _snapshot;
+
+    // FrameParameters に影響する値を読み込んで、前回の値と比較する
+    std::array<float, kNumFrameValues> frameValues;
+    {
+        int i = 0;
+        for(auto const &voice: _voices) {
+            frameValues[i++] = voice._pitch->load(std::memory_order_relaxed);
+            frameValues[i++] = voice._formant->load(std::memory_order_relaxed);
+        }
+        frameValues[i++] = _envelopeOrder->load(std::memory_order_relaxed);
+        frameValues[i++] = _numVoices->load(std::memory_order_relaxed);
+        frameValues[i++] = _stereoLink->load(std::memory_order_relaxed);
+        frameValues[i++] = _pitchCorrection->load(std::memory_order_relaxed);
+        jassert(i == kNumFrameValues);
+    }
+
+    if(_firstUpdate || frameValues != _lastFrameValues) {
+        _lastFrameValues = frameValues;
+
+        auto &params = snapshot._frameParameters;
+        int i = 0;
+        for(auto &voice: params._voices) {
+            voice._pitchChangeAmount = std::pow(2.0, frameValues[i++] / 100.0);
+            voice._formantExpandAmount = std::pow(2.0, frameValues[i++] / 100.0);
+        }
+        params._envelopeOrder = juce::roundToInt(frameValues[i++]);
+        params._numVoices = juce::jlimit(1, SpectralEngineBase::kMaxVoices, juce::roundToInt(frameValues[i++]));
+        params._stereoLinkMode = static_cast<StereoLinkMode>(juce::roundToInt(frameValues[i++]));
+        params._pitchCorrection = frameValues[i++] >= 0.5f;
+    }
+
+    // Dry/Wet と Output Gain は、値が飛ばないようにスムージングする
+    auto const dryWetRate = _dryWetRate->load(std::memory_order_relaxed);
+    auto const outputGainDb = _outputGain->load(std::memory_order_relaxed);
+
+    if(_firstUpdate || dryWetRate != _lastDryWetRate) {
+        _lastDryWetRate = dryWetRate;
+        if(_firstUpdate) {
+            _wetLevelSmoother.setCurrentAndTargetValue(dryWetRate);
+        } else {
+            _wetLevelSmoother.setTargetValue(dryWetRate);
+        }
+    }
+
+    if(_firstUpdate || outputGainDb != _lastOutputGain) {
+        _lastOutputGain = outputGainDb;
+        auto const gain = juce::Decibels::decibelsToGain(outputGainDb, Defines::outputGainSilent);
+        if(_firstUpdate) {
+            _outputGainSmoother.setCurrentAndTargetValue(gain);
+        } else {
+            _outputGainSmoother.setTargetValue(gain);
+        }
+    }
+
+    _firstUpdate = false;
+
+    snapshot._wetLevel._start = _wetLevelSmoother.getCurrentValue();
+    snapshot._outputGain._start = _outputGainSmoother.getCurrentValue();
+    _wetLevelSmoother.skip(numSamples);
+    _outputGainSmoother.skip(numSamples);
+    snapshot._wetLevel._end = _wetLevelSmoother.getCurrentValue();
+    snapshot._outputGain._end = _outputGainSmoother.getCurrentValue();
+
+    snapshot._dryLevel = { 1.0f - snapshot._wetLevel._start, 1.0f - snapshot._wetLevel._end };
+
+    return snapshot;
+}
+
+NS_HWM_END
@@ -0,0 +1,78 @@
+#pragma once
+
+#include "Prefix.h"
+#include "SpectralEngine.h"
+
+NS_HWM_BEGIN
+
+//! ブロックの先頭から末尾まで線形に変化するゲイン
+struct GainRamp
+{
+    float _start = 1.0f;
+    float _end = 1.0f;
+
+    //! total サンプルのブロックのうち、[start, start + length) の範囲のランプを返す
+    GainRamp getSubRange(int start, int length, int total) const
+    {
+        auto const step = (_end - _start) / total;
+        return { _start + step * start, _start + step * (start + length) };
+    }
+};
+
+//! 1 ブロックの処理に使用するパラメータ。ブロックの処理中は変化しない
+struct ParameterSnapshot
+{
+    SpectralEngineBase::FrameParameters _frameParameters;
+    GainRamp _dryLevel;
+    GainRamp _wetLevel;
+    GainRamp _outputGain;
+};
+
+/** オーディオスレッドで毎ブロック読み込むパラメータを管理するクラス
+ *
+ *  コンストラクタでパラメータの値の atomic 変数へのポインタを取得しておき、
+ *  update() ではそれを読み込むだけにする (パラメータ ID による検索や dynamic_cast を行わない)。
+ *  前のブロックから値が変化したものだけ、ピッチの倍率などの派生値を計算し直す。
+ */
+class RealtimeParameters
+{
+public:
+    explicit RealtimeParameters(juce::AudioProcessorValueTreeState &apvts);
+
+    //! スムージングの状態を初期化する
+    void prepare(double sampleRate);
+
+    //! パラメータを読み込んで、numSamples のブロックで使用するスナップショットを作る (オーディオスレッドから呼び出す)
+    ParameterSnapshot const & update(int numSamples);
+
+private:
+    inline static constexpr double kSmoothingSeconds = 0.02;
+
+    struct VoiceParameterValues
+    {
+        std::atomic<float> *_pitch = nullptr;
+        std::atomic<float> *_formant = nullptr;
+    };
+
+    std::array<VoiceParameterValues, SpectralEngineBase::kMaxVoices> _voices;
+    std::atomic<float> *_envelopeOrder = nullptr;
+    std::atomic<float> *_numVoices = nullptr;
+    std::atomic<float> *_stereoLink = nullptr;
+    std::atomic<float> *_pitchCorrection = nullptr;
+    std::atomic<float> *_dryWetRate = nullptr;
+    std::atomic<float> *_outputGain = nullptr;
+
+    // 前回のブロックで読み込んだ値。FrameParameters に影響するものを並べて、変化があったかどうかをまとめて比較する
+    inline static constexpr int kNumFrameValues = SpectralEngineBase::kMaxVoices * 2 + 4;
+    std::array<float, kNumFrameValues> _lastFrameValues;
+    float _lastDryWetRate = 0;
+    float _lastOutputGain = 0;
+    bool _firstUpdate = true;
+
+    juce::SmoothedValue<float> _wetLevelSmoother;
+    juce::SmoothedValue<float> _outputGainSmoother;
+
+    ParameterSnapshot _snapshot;
+};
+
+NS_HWM_END
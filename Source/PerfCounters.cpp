@@ -0,0 +1,205 @@
+#include "PerfCounters.h"
+#include <atomic>
+
+#if HWM_ENABLE_PERF_COUNTERS && JUCE_LINUX
+ #include <cerrno>
+ #include <cstring>
+ #include <linux/perf_event.h>
+ #include <sys/ioctl.h>
+ #include <sys/syscall.h>
+ #include <unistd.h>
+ #define HWM_PERF_COUNTERS_SUPPORTED 1
+#else
+ #define HWM_PERF_COUNTERS_SUPPORTED 0
+#endif
+
+NS_HWM_BEGIN
+
+#if HWM_PERF_COUNTERS_SUPPORTED
+// getStatusMessage() のための記録。オーディオスレッドの read() からも更新するので、ロックを使わずに atomic で数える
+static std::atomic<int> sOpenError { 0 };                   // 最初に失敗した perf_event_open の errno
+static std::atomic<juce::int64> sNumGroupReads { 0 };
+static std::atomic<juce::int64> sNumUnscheduledReads { 0 };  // 計測していた時間が 0 だったグループの読み出しの回数
+
+//! カウンタを開くグループ。0 はサイクル数と命令数、1 はキャッシュと分岐のイベント
+static int getCounterGroup(PerfCounter counter)
+{
+    return (counter == PerfCounter::kCycles || counter == PerfCounter::kInstructions) ? 0 : 1;
+}
+
+static perf_event_attr makeEventAttribute(PerfCounter counter)
+{
+    // キャッシュのイベントは、キャッシュの種類・操作・結果を 8 ビットずつ並べて指定する
+    auto const cacheEvent = [](juce::uint64 cache, juce::uint64 op, juce::uint64 result) {
+        return cache | (op << 8) | (result << 16);
+    };
+
+    perf_event_attr attr {};
+    attr.size = sizeof(attr);
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+    switch(counter) {
+        case PerfCounter::kCycles:
+            attr.type = PERF_TYPE_HARDWARE;
+            attr.config = PERF_COUNT_HW_CPU_CYCLES;
+            break;
+        case PerfCounter::kInstructions:
+            attr.type = PERF_TYPE_HARDWARE;
+            attr.config = PERF_COUNT_HW_INSTRUCTIONS;
+            break;
+        case PerfCounter::kL1DMisses:
+            attr.type = PERF_TYPE_HW_CACHE;
+            attr.config = cacheEvent(PERF_COUNT_HW_CACHE_L1D, PERF_COUNT_HW_CACHE_OP_READ, PERF_COUNT_HW_CACHE_RESULT_MISS);
+            break;
+        case PerfCounter::kLLCAccesses:
+            attr.type = PERF_TYPE_HW_CACHE;
+            attr.config = cacheEvent(PERF_COUNT_HW_CACHE_LL, PERF_COUNT_HW_CACHE_OP_READ, PERF_COUNT_HW_CACHE_RESULT_ACCESS);
+            break;
+        case PerfCounter::kLLCMisses:
+            attr.type = PERF_TYPE_HW_CACHE;
+            attr.config = cacheEvent(PERF_COUNT_HW_CACHE_LL, PERF_COUNT_HW_CACHE_OP_READ, PERF_COUNT_HW_CACHE_RESULT_MISS);
+            break;
+        default:
+            attr.type = PERF_TYPE_HARDWARE;
+            attr.config = PERF_COUNT_HW_BRANCH_MISSES;
+            break;
+    }
+
+    return attr;
+}
+#endif
+
+PerfCounters & PerfCounters::forCurrentThread()
+{
+    thread_local PerfCounters counters;
+    return counters;
+}
+
+PerfCounters::PerfCounters()
+{
+    _leaderFds.fill(-1);
+    _fds.fill(-1);
+    _groupIndices.fill(-1);
+
+   #if HWM_PERF_COUNTERS_SUPPORTED
+    // グループごとに、最初に開けたカウンタをリーダーにする。
+    // リーダーは無効な状態で開いて、すべてのカウンタを開いてからグループ全体を有効にする
+    for(int i = 0; i < kNumCounters; ++i) {
+        auto &leaderFd = _leaderFds[(std::size_t)getCounterGroup((PerfCounter)i)];
+        auto attr = makeEventAttribute((PerfCounter)i);
+        attr.disabled = (leaderFd < 0) ? 1 : 0;
+
+        auto const fd = (int)syscall(SYS_perf_event_open, &attr, 0, -1, leaderFd, PERF_FLAG_FD_CLOEXEC);
+        if(fd < 0) {
+            int noError = 0;
+            sOpenError.compare_exchange_strong(noError, errno, std::memory_order_relaxed);
+            continue;
+        }
+
+        if(leaderFd < 0) { leaderFd = fd; }
+        _fds[i] = fd;
+        _groupIndices[i] = _numOpened[(std::size_t)getCounterGroup((PerfCounter)i)]++;
+    }
+
+    for(auto leaderFd: _leaderFds) {
+        if(leaderFd < 0) { continue; }
+
+        ioctl(leaderFd, PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+        ioctl(leaderFd, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+    }
+   #endif
+}
+
+PerfCounters::~PerfCounters()
+{
+   #if HWM_PERF_COUNTERS_SUPPORTED
+    for(auto fd: _fds) {
+        if(fd >= 0) { close(fd); }
+    }
+   #endif
+}
+
+bool PerfCounters::read(PerfCounterValues &dest) noexcept
+{
+   #if HWM_PERF_COUNTERS_SUPPORTED
+    dest._values.fill(0);
+    bool succeeded = false;
+
+    for(int group = 0; group < kNumGroups; ++group) {
+        auto const leaderFd = _leaderFds[(std::size_t)group];
+        if(leaderFd < 0) { continue; }
+
+        // PERF_FORMAT_GROUP の読み出し結果は、カウンタの数・有効だった時間・実際に計測していた時間と、開いた順の値が並ぶ
+        std::array<juce::uint64, 3 + kNumCounters> buffer {};
+        auto const numRead = ::read(leaderFd, buffer.data(), sizeof(buffer));
+        if(numRead < (ssize_t)(sizeof(juce::uint64) * (3 + _numOpened[(std::size_t)group]))) { continue; }
+
+        succeeded = true;
+        sNumGroupReads.fetch_add(1, std::memory_order_relaxed);
+
+        auto const timeEnabled = buffer[1];
+        auto const timeRunning = buffer[2];
+
+        // グループが一度も PMU に載っていないので、値を補正できない。値は 0 のままにして回数だけ記録する
+        if(timeRunning == 0) {
+            sNumUnscheduledReads.fetch_add(1, std::memory_order_relaxed);
+            continue;
+        }
+
+        for(int i = 0; i < kNumCounters; ++i) {
+            auto const index = _groupIndices[i];
+            if(index < 0 || getCounterGroup((PerfCounter)i) != group) { continue; }
+
+            auto const value = buffer[3 + (std::size_t)index];
+            dest._values[i] = (timeRunning < timeEnabled)
+            ?   (juce::uint64)((double)value * timeEnabled / timeRunning)
+            :   value;
+        }
+    }
+
+    return succeeded;
+   #else
+    juce::ignoreUnused(dest);
+    return false;
+   #endif
+}
+
+char const * PerfCounters::getCounterName(PerfCounter counter)
+{
+    switch(counter) {
+        case PerfCounter::kCycles:          return "cycles";
+        case PerfCounter::kInstructions:    return "instructions";
+        case PerfCounter::kL1DMisses:       return "l1dMisses";
+        case PerfCounter::kLLCAccesses:     return "llcAccesses";
+        case PerfCounter::kLLCMisses:       return "llcMisses";
+        case PerfCounter::kBranchMisses:    return "branchMisses";
+        default:                            return "unknown";
+    }
+}
+
+juce::String PerfCounters::getStatusMessage()
+{
+   #if HWM_PERF_COUNTERS_SUPPORTED
+    juce::StringArray messages;
+
+    if(auto const error = sOpenError.load(std::memory_order_relaxed)) {
+        messages.add("perf_event_open failed: " + juce::String(std::strerror(error))
+                     + " (check /proc/sys/kernel/perf_event_paranoid)");
+    }
+
+    if(auto const numUnscheduled = sNumUnscheduledReads.load(std::memory_order_relaxed)) {
+        messages.add(juce::String(numUnscheduled) + " of " + juce::String(sNumGroupReads.load(std::memory_order_relaxed))
+                     + " counter group reads were never scheduled on the PMU");
+    }
+
+    return messages.joinIntoString("; ");
+   #elif HWM_ENABLE_PERF_COUNTERS
+    return "hardware counters are only supported on Linux";
+   #else
+    return "built without FORMANT_AND_PITCH_ENABLE_PERF_COUNTERS";
+   #endif
+}
+
+NS_HWM_END
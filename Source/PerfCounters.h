@@ -0,0 +1,95 @@
+#pragma once
+
+#include <array>
+#include "Prefix.h"
+
+// Profiler のイベントにハードウェアのパフォーマンスカウンタの値を含めるかどうか。
+// CMake の FORMANT_AND_PITCH_ENABLE_PERF_COUNTERS で有効にする (Linux のみ。HWM_ENABLE_PROFILER も有効になる)
+#ifndef HWM_ENABLE_PERF_COUNTERS
+#define HWM_ENABLE_PERF_COUNTERS 0
+#endif
+
+NS_HWM_BEGIN
+
+//! 計測するハードウェアのイベント
+enum class PerfCounter {
+    kCycles,
+    kInstructions,
+    kL1DMisses,     //!< L1 データキャッシュの読み込みミス
+    kLLCAccesses,   //!< LLC への読み込みアクセス (L1D と L2 をミスした読み込み)
+    kLLCMisses,     //!< LLC の読み込みミス (メモリへのアクセス)
+    kBranchMisses,
+    kNumCounters,
+};
+
+//! カウンタの値。スコープの計測では開始から終了までの差分を格納する
+struct PerfCounterValues
+{
+    std::array<juce::uint64, (int)PerfCounter::kNumCounters> _values {};
+
+    juce::uint64 get(PerfCounter counter) const { return _values[(std::size_t)counter]; }
+
+    PerfCounterValues & operator+=(PerfCounterValues const &rhs)
+    {
+        for(std::size_t i = 0; i < _values.size(); ++i) { _values[i] += rhs._values[i]; }
+        return *this;
+    }
+};
+
+/** perf_event_open によるハードウェアのパフォーマンスカウンタ
+ *
+ *  呼び出したスレッドだけを計測するカウンタを、サイクル数と命令数のグループと、キャッシュと分岐のイベントのグループに分けて開く。
+ *  グループのイベントは同時に PMU に載せる必要があり、汎用カウンタの数 (NMI watchdog が 1 つ使うことも多い) を超えると
+ *  グループ全体が一度も計測されないので、1 つのグループには収めない。
+ *  グループは 1 回の read() でまとめて読み出せるので、スコープの開始と終了でそれぞれグループの数だけのシステムコールで済む。
+ *  PMU のカウンタが足りずに多重化されたときは、グループごとに有効だった時間の比で値を補正する。
+ *
+ *  Linux 以外や、perf_event_paranoid の設定などで開けなかったときは isAvailable() が false になり、read() は何もしない。
+ *  開けなかった理由や、計測されなかった読み出しがあったことは getStatusMessage() で確認できる。
+ *  カウンタは最初に forCurrentThread() を呼び出したときに開くので、オーディオスレッドでは最初のコールバックだけシステムコールが増える。
+ *  計測用のビルドでのみ使用すること。
+ */
+class PerfCounters
+{
+public:
+    inline static constexpr int kNumCounters = (int)PerfCounter::kNumCounters;
+
+    //! 現在のスレッドのカウンタ
+    static PerfCounters & forCurrentThread();
+
+    ~PerfCounters();
+
+    PerfCounters(PerfCounters const &) = delete;
+    PerfCounters & operator=(PerfCounters const &) = delete;
+
+    //! 1 つ以上のカウンタを開けたかどうか
+    bool isAvailable() const { return _leaderFds[0] >= 0 || _leaderFds[1] >= 0; }
+
+    //! 指定したカウンタを開けたかどうか。開けなかったカウンタの値は常に 0 になる
+    bool isAvailable(PerfCounter counter) const { return _groupIndices[(std::size_t)counter] >= 0; }
+
+    //! カウンタを開いてからの累積値を読み出す
+    bool read(PerfCounterValues &dest) noexcept;
+
+    static char const * getCounterName(PerfCounter counter);
+
+    /** すべてのスレッドのカウンタについて、値が欠けている理由を返す。問題がなければ空文字列
+     *
+     *  カウンタを開けなかったときは perf_event_open のエラーを、グループが一度も PMU に載らずに
+     *  値が 0 になった読み出しがあったときはその回数を返す。
+     */
+    static juce::String getStatusMessage();
+
+private:
+    PerfCounters();
+
+    //! サイクル数と命令数のグループと、キャッシュと分岐のイベントのグループ
+    inline static constexpr int kNumGroups = 2;
+
+    std::array<int, kNumGroups> _leaderFds;
+    std::array<int, kNumGroups> _numOpened {};
+    std::array<int, kNumCounters> _fds;
+    std::array<int, kNumCounters> _groupIndices;    // グループの read() で読み出す値の並びの中での位置。開けなかったカウンタは -1
+};
+
+NS_HWM_END
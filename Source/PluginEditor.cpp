@@ -117,10 +117,13 @@ Oscilloscope::Oscilloscope(PluginAudioProcessor& processor)
 {
     startTimer(30);
     _buffer.setSize(1, 1);
+    _processor.setScopeSubscribed(true);
 }
 
 Oscilloscope::~Oscilloscope()
-{}
+{
+    _processor.setScopeSubscribed(false);
+}
 
 void Oscilloscope::paint(juce::Graphics& g)
 {
@@ -134,10 +137,9 @@ void Oscilloscope::paint(juce::Graphics& g)
     auto const data = _buffer.getReadPointer(0);
     auto const N = _buffer.getNumSamples();
     for(int i = 0; i < N; ++i) {
-        if (std::isnan(data[i])) {
-            jassert(false);
-        }
-        p.lineTo((float)i / N * w, -(data[i] / 2.0f - 0.5f) * h);
+        // 異常な値はプロセッサ側で数えているので、ここでは中央に描画するだけにする
+        auto const value = std::isfinite(data[i]) ? data[i] : 0.0f;
+        p.lineTo((float)i / N * w, -(value / 2.0f - 0.5f) * h);
     }
 
     g.setColour(juce::Colours::black);
@@ -157,186 +159,181 @@ void Oscilloscope::timerCallback()
 
 //==============================================================================
 
-Spectrum::Spectrum(PluginAudioProcessor& processor)
+LoadMeter::LoadMeter(PluginAudioProcessor& processor)
 :   _processor(processor)
-,   _graphRange(0, 1.0)
 {
-    _graphRange.setSkewForCentre(0.5);
-    startTimer(30);
-
-    _graphSettings[GraphIds::kOriginalSpectrum]    = GraphSetting { juce::Colours::black, true };
-    _graphSettings[GraphIds::kShiftedSpectrum]     = GraphSetting { juce::Colours::grey, true };
-    _graphSettings[GraphIds::kSynthesisSpectrum]   = GraphSetting { juce::Colours::green, true };
-    _graphSettings[GraphIds::kOriginalCepstrum]    = GraphSetting { juce::Colours::blue, true };
-    _graphSettings[GraphIds::kEnvelope]            = GraphSetting { juce::Colours::red, true };
-    _graphSettings[GraphIds::kFineStructure]       = GraphSetting { juce::Colours::lightcyan, true };
+    startTimer(100);
 }
 
-Spectrum::~Spectrum()
-{}
+LoadMeter::~LoadMeter()
+{
+}
 
-void Spectrum::paint(juce::Graphics& g)
+void LoadMeter::paint(juce::Graphics& g)
 {
-    auto w = getWidth();
-    auto h = getHeight();
-    g.fillAll(juce::Colours::lightgreen);
+    g.fillAll(juce::Colours::white);
 
-    if(_spectrums.isEmpty()) { return; }
+    auto b = getLocalBounds().reduced(5);
+    auto barArea = b.removeFromTop(b.getHeight() / 2).reduced(0, 2).toFloat();
 
-    // 現在は 0 番目のチャンネルのデータのみ描画
-    auto const &specData = _spectrums[0];
+    // 締め切りの 2 倍までを表示する。中央の線が締め切り
+    auto const toX = [&](float ratio) {
+        return barArea.getX() + barArea.getWidth() * juce::jlimit(0.0f, 1.0f, ratio / 2.0f);
+    };
 
-    int const N = specData._originalSpectrum.size();
+    auto const ratioColour = [](float ratio) {
+        return (ratio > 1.0f) ? juce::Colours::red
+        :      (ratio > 0.7f) ? juce::Colours::orange
+        :                       juce::Colours::green;
+    };
 
-    // オリジナル spectrum の描画
-    if(auto const &gs = getGraphSetting(GraphIds::kOriginalSpectrum); gs._enabled) {
-        auto const data = specData._originalSpectrum.data();
-        float valueMax = 6.0;
-        float valueMin = -24.0;
-        float valueRange = valueMax - valueMin;
+    g.setColour(juce::Colours::lightgrey);
+    g.fillRect(barArea);
 
-        juce::Path p;
+    g.setColour(ratioColour(_statistics._p99));
+    g.fillRect(barArea.withRight(toX(_statistics._p99)));
 
-        for(int i = 0; i <= N / 2; ++i) {
-            auto v = std::clamp(std::log(std::abs(data[i])), valueMin, valueMax);
-            auto x = _graphRange.convertFrom0to1((float)i / (N / 2)) * w;
-            auto y = -((v - valueMin) / valueRange) * h + h;
-            if(i == 0) {
-                p.startNewSubPath(0, y);
-            }
+    g.setColour(ratioColour(_statistics._max));
+    g.drawVerticalLine(juce::roundToInt(toX(_statistics._max)), barArea.getY(), barArea.getBottom());
 
-            p.lineTo(x, y);
-        }
+    g.setColour(juce::Colours::black);
+    g.drawVerticalLine(juce::roundToInt(toX(1.0f)), barArea.getY(), barArea.getBottom());
 
-        g.setColour(gs._color);
-        g.strokePath(p, juce::PathStrokeType(1.0));
+    auto const percent = [](float ratio) { return juce::String(juce::roundToInt(ratio * 100.0f)) + "%"; };
+    g.setColour(juce::Colours::darkgrey);
+    g.drawText("p50 " + percent(_statistics._p50)
+               + "  p99 " + percent(_statistics._p99)
+               + "  p99.9 " + percent(_statistics._p999)
+               + "  max " + percent(_statistics._max)
+               + "  miss " + juce::String((juce::int64)_statistics._numMisses)
+               + " / " + juce::String((juce::int64)_statistics._numCallbacks),
+               b, juce::Justification::centredLeft);
+
+    // 数値の異常を検出したときだけ表示する
+    if(_health.hasIssues()) {
+        auto const count = [&](HealthIssue issue) { return juce::String((juce::int64)_health.getTotal(issue)); };
+        g.setColour(juce::Colours::red);
+        g.drawText("NaN " + count(HealthIssue::kNaN)
+                   + "  Inf " + count(HealthIssue::kInf)
+                   + "  overflow " + count(HealthIssue::kOverflow)
+                   + "  denormal " + count(HealthIssue::kDenormal)
+                   + "  reset " + juce::String((juce::int64)_health._numRecoveries),
+                   b, juce::Justification::centredRight);
     }
+}
 
-    // オリジナルのケプストラムの描画
-    if(auto const &gs = getGraphSetting(GraphIds::kOriginalCepstrum); gs._enabled) {
-        auto const data = specData._originalCepstrum.data();
-        float valueMax = 1;
-        float valueMin = 0;
-        float valueRange = valueMax - valueMin;
-
-        juce::Path p;
-
-        for(int i = 0; i <= N / 2; ++i) {
-            auto v = std::clamp(std::abs(data[i]), valueMin, valueMax);
-            auto y = -((v - valueMin) / valueRange) * h + h;
-            auto x = _graphRange.convertFrom0to1((float)i / (N / 2)) * w;
-            if(i == 0) {
-                p.startNewSubPath(0, y);
-            }
-
-            p.lineTo(x, y);
-        }
+void LoadMeter::resized()
+{
 
-        g.setColour(gs._color);
-        g.strokePath(p, juce::PathStrokeType(1.0));
-    }
+}
 
-    // スペクトル包絡の描画
-    if(auto const &gs = getGraphSetting(GraphIds::kEnvelope); gs._enabled) {
-        auto const data = specData._envelope.data();
-        float valueMax = 6.0;
-        float valueMin = -24.0;
-        float valueRange = valueMax - valueMin;
+void LoadMeter::mouseUp(juce::MouseEvent const &ev)
+{
+    juce::ignoreUnused(ev);
+    _processor.resetDeadlineStatistics();
+    _processor.resetNumericalHealth();
+}
 
-        juce::Path p;
+void LoadMeter::timerCallback()
+{
+    _statistics = _processor.getDeadlineStatisticsForUI();
+    _health = _processor.getNumericalHealthForUI();
+    repaint();
+}
 
-        for(int i = 0; i <= N / 2; ++i) {
-            auto v = std::clamp(data[i].real(), valueMin, valueMax);
-            auto y = -((v - valueMin) / valueRange) * h + h;
-            auto x = _graphRange.convertFrom0to1((float)i / (N / 2)) * w;
-            if(i == 0) {
-                p.startNewSubPath(0, y);
-            }
+//==============================================================================
 
-            p.lineTo(x, y);
-        }
+Spectrum::Spectrum(PluginAudioProcessor& processor)
+:   _processor(processor)
+{
+    startTimer(30);
 
-        g.setColour(gs._color);
-        g.strokePath(p, juce::PathStrokeType(1.0));
-    }
+    _graphSettings[GraphIds::kOriginalSpectrum]    = GraphSetting { juce::Colours::black, true };
+    _graphSettings[GraphIds::kShiftedSpectrum]     = GraphSetting { juce::Colours::grey, true };
+    _graphSettings[GraphIds::kSynthesisSpectrum]   = GraphSetting { juce::Colours::green, true };
+    _graphSettings[GraphIds::kOriginalCepstrum]    = GraphSetting { juce::Colours::blue, true };
+    _graphSettings[GraphIds::kEnvelope]            = GraphSetting { juce::Colours::red, true };
+    _graphSettings[GraphIds::kFineStructure]       = GraphSetting { juce::Colours::lightcyan, true };
 
-    // 微細構造の描画
-    if(auto const &gs = getGraphSetting(GraphIds::kFineStructure); gs._enabled) {
-        auto const data = specData._fineStructure.data();
-        float valueMax = 6.0;
-        float valueMin = -24.0;
-        float valueRange = valueMax - valueMin;
+    updateSubscription();
+}
 
-        juce::Path p;
+Spectrum::~Spectrum()
+{
+    _processor.setSpectrumSubscription({});
+}
 
-        for(int i = 0; i <= N / 2; ++i) {
-            auto v = std::clamp(data[i].real(), valueMin, valueMax);
-            auto y = -((v - valueMin) / valueRange) * h + h;
-            auto x = _graphRange.convertFrom0to1((float)i / (N / 2)) * w;
-            if(i == 0) {
-                p.startNewSubPath(0, y);
-            }
+void Spectrum::paint(juce::Graphics& g)
+{
+    auto w = getWidth();
+    auto h = getHeight();
+    g.fillAll(juce::Colours::lightgreen);
 
-            p.lineTo(x, y);
-        }
+    if(_hasDisplay == false) { return; }
 
-        g.setColour(gs._color);
-        g.strokePath(p, juce::PathStrokeType(1.0));
-    }
+    // 現在は 0 番目のチャンネルのデータのみ描画。
+    // 値はプロセッサ側で対数周波数の表示点ごとにまとめてあるので、点の番号をそのまま x 座標に対応させる
+    int const N = SpectrumDisplayData::kNumPoints;
 
-    // ピッチシフト後のスペクトルの描画
-    if(auto const &gs = getGraphSetting(GraphIds::kShiftedSpectrum); gs._enabled) {
-        auto const data = specData._shiftedSpectrum.data();
-        float valueMax = 6.0;
-        float valueMin = -24.0;
-        float valueRange = valueMax - valueMin;
+    auto const drawGraph = [&](GraphIds gid, SpectrumGraph graph, float valueMin, float valueMax) {
+        auto const &gs = getGraphSetting(gid);
+        if(gs._enabled == false || _display.hasGraph(graph) == false) { return; }
 
-        juce::Path p;
+        auto const &curve = _display.getCurve(graph);
+        auto const valueRange = valueMax - valueMin;
+        auto const toX = [&](int i) { return (float)i / (N - 1) * w; };
+        auto const toY = [&](float v) { return -((std::clamp(v, valueMin, valueMax) - valueMin) / valueRange) * h + h; };
 
-        for(int i = 0; i <= N / 2; ++i) {
-            auto v = std::clamp(std::log(std::abs(data[i])), valueMin, valueMax);
-            auto y = -((v - valueMin) / valueRange) * h + h;
-            auto x = _graphRange.convertFrom0to1((float)i / (N / 2)) * w;
-            if(i == 0) {
-                p.startNewSubPath(0, y);
-            }
+        // 表示点にまとめたビンの最小値から最大値までの範囲
+        juce::Path range;
+        range.startNewSubPath(toX(0), toY(curve._max[0]));
+        for(int i = 1; i < N; ++i) { range.lineTo(toX(i), toY(curve._max[i])); }
+        for(int i = N - 1; i >= 0; --i) { range.lineTo(toX(i), toY(curve._min[i])); }
+        range.closeSubPath();
 
-            p.lineTo(x, y);
-        }
+        juce::Path peak;
+        peak.startNewSubPath(toX(0), toY(curve._peak[0]));
+        for(int i = 1; i < N; ++i) { peak.lineTo(toX(i), toY(curve._peak[i])); }
 
+        g.setColour(gs._color.withAlpha(0.3f));
+        g.fillPath(range);
         g.setColour(gs._color);
-        g.strokePath(p, juce::PathStrokeType(1.0));
-    }
-
-    // 再合成用スペクトルの描画
-    if(auto const &gs = getGraphSetting(GraphIds::kSynthesisSpectrum); gs._enabled) {
-        auto const data = specData._synthesisSpectrum.data();
-        float valueMax = 6.0;
-        float valueMin = -24.0;
-        float valueRange = valueMax - valueMin;
-
-        juce::Path p;
-
-        for(int i = 0; i <= N / 2; ++i) {
-            auto v = std::clamp(std::log(std::abs(data[i])), valueMin, valueMax);
-            auto y = -((v - valueMin) / valueRange) * h + h;
-            auto x = _graphRange.convertFrom0to1((float)i / (N / 2)) * w;
-            if(i == 0) {
-                p.startNewSubPath(0, y);
-            }
+        g.strokePath(range, juce::PathStrokeType(1.0));
+        g.setColour(gs._color.withAlpha(0.5f));
+        g.strokePath(peak, juce::PathStrokeType(1.0));
+    };
 
-            p.lineTo(x, y);
-        }
+    // 以前の自然対数の表示範囲 (-24 .. 6) を dB に換算した範囲
+    float const spectrumMin = -208.0f;
+    float const spectrumMax = 52.0f;
 
-        g.setColour(gs._color);
-        g.strokePath(p, juce::PathStrokeType(1.0));
-    }
+    drawGraph(GraphIds::kOriginalSpectrum, SpectrumGraph::kOriginalSpectrum, spectrumMin, spectrumMax);
+    drawGraph(GraphIds::kOriginalCepstrum, SpectrumGraph::kOriginalCepstrum, 0.0f, 1.0f);
+    drawGraph(GraphIds::kEnvelope, SpectrumGraph::kEnvelope, spectrumMin, spectrumMax);
+    drawGraph(GraphIds::kFineStructure, SpectrumGraph::kFineStructure, spectrumMin, spectrumMax);
+    drawGraph(GraphIds::kShiftedSpectrum, SpectrumGraph::kShiftedSpectrum, spectrumMin, spectrumMax);
+    drawGraph(GraphIds::kSynthesisSpectrum, SpectrumGraph::kSynthesisSpectrum, spectrumMin, spectrumMax);
 
     auto b = getLocalBounds().reduced(5);
     b = b.removeFromTop(20);
 
     g.setColour(juce::Colours::darkgrey);
     g.drawText("Right click to customize graphs.", b, juce::Justification::centredRight);
+
+    // 推定した基本周波数
+    auto const f0Text = (_display._f0Confidence >= SpectralEngineBase::kVoicingThreshold)
+    ?   juce::String(_display._f0, 1) + " Hz"
+    :   juce::String("---");
+    g.drawText("f0: " + f0Text + " (confidence " + juce::String(_display._f0Confidence, 2) + ")",
+               b, juce::Justification::centredLeft);
+
+    // 実際に処理に使用している設定。CPU Governor が品質を下げているときは段階も表示する
+    auto statusText = "FFT " + juce::String(_engineStatus._fftSize) + " / Overlap " + juce::String(_engineStatus._overlapCount)
+                    + " (load " + juce::String(juce::roundToInt(_engineStatus._load * 100.0f)) + "%)";
+    if(_engineStatus._governorLevel > 0) {
+        statusText += " - CPU Governor: -" + juce::String(_engineStatus._governorLevel);
+    }
+    g.drawText(statusText, b.translated(0, 20), juce::Justification::centredLeft);
 }
 
 void Spectrum::resized()
@@ -346,8 +343,12 @@ void Spectrum::resized()
 
 void Spectrum::timerCallback()
 {
-    _processor.getSpectrumDataForUI(_spectrums);
-    repaint();
+    _engineStatus = _processor.getEngineStatusForUI();
+
+    if(_processor.getSpectrumDisplayForUI(_display)) {
+        _hasDisplay = true;
+        repaint();
+    }
 }
 
 void Spectrum::mouseUp(juce::MouseEvent const &ev)
@@ -360,8 +361,9 @@ void Spectrum::mouseUp(juce::MouseEvent const &ev)
 
     auto addItem = [&, this](auto title, auto gid) {
         auto *gs = &getGraphSetting(gid);
-        m.addItem(title, true, gs->_enabled, [gs] {
+        m.addItem(title, true, gs->_enabled, [this, gs] {
             gs->_enabled = !gs->_enabled;
+            updateSubscription();
         });
     };
 
@@ -372,6 +374,26 @@ void Spectrum::mouseUp(juce::MouseEvent const &ev)
     addItem("Envelope", GraphIds::kEnvelope);
     addItem("Fine Strucutre", GraphIds::kFineStructure);
 
+   #if HWM_ENABLE_PROFILER
+    m.addSeparator();
+    m.addItem("Dump Profile Trace", [this] {
+        // chrome://tracing や Perfetto で開ける JSON をデスクトップに書き出す
+        auto const file = juce::File::getSpecialLocation(juce::File::userDesktopDirectory)
+                          .getNonexistentChildFile("FormantAndPitch-trace", ".json");
+        auto const written = _processor.writeProfileTrace(file);
+        juce::Logger::outputDebugString((written ? "Wrote profile trace: " : "Failed to write profile trace: ")
+                                        + file.getFullPathName());
+    });
+    m.addItem("Dump Profile Summary", [this] {
+        // 段階・FFT サイズ・オーバーラップ数ごとの平均の処理時間と、ハードウェアカウンタの集計を書き出す
+        auto const file = juce::File::getSpecialLocation(juce::File::userDesktopDirectory)
+                          .getNonexistentChildFile("FormantAndPitch-summary", ".json");
+        auto const written = _processor.writeProfileSummary(file);
+        juce::Logger::outputDebugString((written ? "Wrote profile summary: " : "Failed to write profile summary: ")
+                                        + file.getFullPathName());
+    });
+   #endif
+
     auto area = juce::Rectangle<int>{}.withPosition(ev.getScreenPosition());
     auto opt = juce::PopupMenu::Options{}.withTargetComponent(this).withTargetScreenArea(area);
     m.showMenuAsync(opt);
@@ -393,6 +415,32 @@ Spectrum::GraphSetting const & Spectrum::getGraphSetting(GraphIds gid) const
     return found->second;
 }
 
+void Spectrum::updateSubscription()
+{
+    auto const toSpectrumGraph = [](GraphIds gid) {
+        switch(gid) {
+            case GraphIds::kOriginalSpectrum:  return SpectrumGraph::kOriginalSpectrum;
+            case GraphIds::kShiftedSpectrum:   return SpectrumGraph::kShiftedSpectrum;
+            case GraphIds::kSynthesisSpectrum: return SpectrumGraph::kSynthesisSpectrum;
+            case GraphIds::kOriginalCepstrum:  return SpectrumGraph::kOriginalCepstrum;
+            case GraphIds::kEnvelope:          return SpectrumGraph::kEnvelope;
+            default:                           return SpectrumGraph::kFineStructure;
+        }
+    };
+
+    SpectrumCaptureMask mask;
+    for(auto const &entry: _graphSettings) {
+        if(entry.second._enabled) {
+            mask._graphs |= SpectrumCaptureMask::getGraphBit(toSpectrumGraph(entry.first));
+        }
+    }
+
+    // 現在は 0 番目のチャンネルのデータのみ描画するので、ほかのチャンネルは取得しない
+    mask._channels = 1u << 0;
+
+    _processor.setSpectrumSubscription(mask);
+}
+
 //==============================================================================
 PluginAudioProcessorEditor::PluginAudioProcessorEditor (PluginAudioProcessor& p)
 :   AudioProcessorEditor (&p)
@@ -400,11 +448,13 @@ PluginAudioProcessorEditor::PluginAudioProcessorEditor (PluginAudioProcessor& p)
 ,   _xyPad(p)
 ,   _genericEdior(p)
 ,   _oscilloscope(p)
+,   _loadMeter(p)
 ,   _spectrum(p)
 {
     addAndMakeVisible(_genericEdior);
     addAndMakeVisible(_xyPad);
     addAndMakeVisible(_oscilloscope);
+    addAndMakeVisible(_loadMeter);
     addAndMakeVisible(_spectrum);
 
     juce::ignoreUnused (_processorRef);
@@ -438,10 +488,12 @@ void PluginAudioProcessorEditor::resized()
     auto topRight = top;
     auto bottomLeft = b.removeFromLeft(b.getWidth() / 2);
     auto bottomRight = b;
+    auto meter = bottomLeft.removeFromBottom(44);
 
     _genericEdior.setBounds(topLeft);
     _xyPad.setBounds(topRight);
     _oscilloscope.setBounds(bottomLeft);
+    _loadMeter.setBounds(meter);
     _spectrum.setBounds(bottomRight);
     // This is generally where you'll want to lay out the positions of any
     // subcomponents in your editor..
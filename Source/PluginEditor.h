@@ -54,6 +54,31 @@ private:
     PluginAudioProcessor& _processor;
 };
 
+/** processBlock の処理時間の分布と、締め切りに間に合わなかった回数を表示するメーター
+ *
+ *  バーは p99 の処理時間をブロックの長さに対する比で表し、縦線は最大値を表す。
+ *  数値の異常 (NaN / Inf など) を検出したときは、その回数も表示する。クリックすると集計をリセットする。
+ */
+class LoadMeter
+:   public juce::Component
+,   public juce::Timer
+{
+public:
+    LoadMeter(PluginAudioProcessor& processor);
+    ~LoadMeter() override;
+
+private:
+    void paint(juce::Graphics& g) override;
+    void resized() override;
+    void mouseUp(juce::MouseEvent const &ev) override;
+
+    void timerCallback() override;
+
+    DeadlineMonitor::Statistics _statistics;
+    NumericalHealth::Report _health;
+    PluginAudioProcessor& _processor;
+};
+
 class Spectrum
 :   public juce::Component
 ,   public juce::Timer
@@ -69,8 +94,9 @@ private:
 
     void timerCallback() override;
 
-    juce::NormalisableRange<float> _graphRange;
-    ReferenceableArray<PluginAudioProcessor::SpectrumData> _spectrums;
+    SpectrumDisplayData _display;
+    bool _hasDisplay = false;
+    PluginAudioProcessor::EngineStatus _engineStatus;
 
     PluginAudioProcessor& _processor;
 
@@ -94,6 +120,9 @@ private:
 
     GraphSetting & getGraphSetting(GraphIds gid);
     GraphSetting const & getGraphSetting(GraphIds gid) const;
+
+    //! 表示が有効なグラフだけを取得するように、プロセッサに設定する
+    void updateSubscription();
 };
 
 //==============================================================================
@@ -115,6 +144,7 @@ private:
     juce::GenericAudioProcessorEditor _genericEdior;
     XYPad _xyPad;
     Oscilloscope _oscilloscope;
+    LoadMeter _loadMeter;
     Spectrum _spectrum;
 
     JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR (PluginAudioProcessorEditor)
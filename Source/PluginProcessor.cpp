@@ -1,6 +1,7 @@
 #include "PluginProcessor.h"
 #include "PluginEditor.h"
 #include <cassert>
+#include <utility>
 
 NS_HWM_BEGIN
 
@@ -17,13 +18,46 @@ PluginAudioProcessor::PluginAudioProcessor()
                        )
      , _apvts(*this, nullptr, "AudioProcessorState", createParameterLayout())
 #endif
+     , _realtimeParameters(_apvts)
 {
+    // オシロスコープ用のバッファは小さいので、最大のサイズで一度だけ確保しておく。
+    // スペクトル用のバッファは、UI が要求したグラフの分だけ setSpectrumSubscription() で確保する
+    _uiRingBuffer.resize(1, Defines::scopeBufferSize);
+
+    _spectrumExchange.forEachBuffer([](SpectrumSnapshot &snapshot) {
+        snapshot._channels.resize(Defines::maxNumChannels);
+    });
+
+    // パラメータの変更通知はオーディオスレッドから届くこともあるので、ID による検索を避けるためにポインタを保持しておく
+    _reconfigureParameters = {
+        _apvts.getParameter(ParameterIds::fftSize),
+        _apvts.getParameter(ParameterIds::overlapCount),
+        _apvts.getParameter(ParameterIds::latencyMode),
+        _apvts.getParameter(ParameterIds::windowMode),
+        _apvts.getParameter(ParameterIds::multiResolution),
+        _apvts.getParameter(ParameterIds::engine),
+        _apvts.getParameter(ParameterIds::cpuGovernor),
+    };
+
+    _cpuGovernorEnabled = _apvts.getRawParameterValue(ParameterIds::cpuGovernor);
+    _fftSizeIndex = _apvts.getRawParameterValue(ParameterIds::fftSize);
+    _overlapCountIndex = _apvts.getRawParameterValue(ParameterIds::overlapCount);
+
     addListener(this);
+    _reconfigureThread.startThread();
+    _displayReductionThread.startThread(juce::Thread::Priority::low);
 }
 
 PluginAudioProcessor::~PluginAudioProcessor()
 {
     removeListener(this);
+    _reconfigureThread.stopThread(-1);
+    _displayReductionThread.stopThread(-1);
+    cancelPendingUpdate();
+
+    std::unique_lock lock(_stateMutex);
+    delete _pendingState.exchange(nullptr);
+    deleteRetiredStates();
 }
 
 //==============================================================================
@@ -96,81 +130,228 @@ void PluginAudioProcessor::changeProgramName (int index, const juce::String& new
 void PluginAudioProcessor::prepareToPlay (double sampleRate, int samplesPerBlock)
 {
     auto const totalNumInputChannels  = getTotalNumInputChannels();
-    auto const totalNumOutputChannels = getTotalNumOutputChannels();
 
     setRateAndBufferSizeDetails(sampleRate, samplesPerBlock);
 
-    auto fftParam = static_cast<juce::AudioParameterChoice * >(_apvts.getParameter(ParameterIds::fftSize));
-    auto overlapParam = static_cast<juce::AudioParameterChoice * >(_apvts.getParameter(ParameterIds::fftSize));
-    _fftOrder = fftParam->getIndex() + 8;
-    _overlapCount = 1 << (overlapParam->getIndex() + 1);
+    // prepareToPlay はオーディオスレッドが止まっている間に呼ばれるので、ここではエンジンを直接作り直す。
+    // バックグラウンドスレッドが同時にエンジンを構築しないように _stateMutex をロックしておく
+    std::unique_lock lock(_stateMutex);
+
+    delete _pendingState.exchange(nullptr);
+    _fadingState.reset();
+    deleteRetiredStates();
+    _reconfigureRequested = false;
+
+    // 内部のバッファはこのサイズで確保し、これより大きなブロックは processBlock で分割して処理する。
+    // 小さなブロックサイズで準備したあとに少し大きなブロックを渡すホストもあるので、最低でも Defines::minimumMaxBlockSize は確保しておく
+    _maxBlockSize = std::max(samplesPerBlock, Defines::minimumMaxBlockSize);
+    _hostBlockSize = samplesPerBlock;
+    _preparedSampleRate = sampleRate;
+
+    _cpuGovernor.prepare(sampleRate);
+    _deadlineMonitor.prepare(sampleRate);
+    _currentState = EngineState::create(getEngineConfig(sampleRate));
+
+    // 使用しない精度のバッファは解放しておく
+    if(isUsingDoublePrecision()) {
+        _doubleCrossfadeBuffer.setSize(totalNumInputChannels, _maxBlockSize);
+        _crossfadeBuffer.setSize(0, 0);
+    } else {
+        _crossfadeBuffer.setSize(totalNumInputChannels, _maxBlockSize);
+        _doubleCrossfadeBuffer.setSize(0, 0);
+    }
+    _crossfadeLength = std::max(1, (int)std::round(sampleRate * Defines::engineCrossfadeSeconds));
+    _crossfadePosition = 0;
+    _warmupRemaining = 0;
+
+    _realtimeParameters.prepare(sampleRate);
+
+    _prepared = true;
+
+    // オーディオスレッドは止まっているので、ホストへの報告もここで済ませる
+    publishActiveState();
+    _latencyChanged = false;
+    setLatencySamples(_activeLatency.load());
+}
+
+CpuGovernor::Settings PluginAudioProcessor::getRequestedSettings() const
+{
+    auto const fftIndex = juce::jlimit(0, (int)std::size(FFTDefines::fftSizes) - 1,
+                                       (int)_fftSizeIndex->load(std::memory_order_relaxed));
+    auto const overlapIndex = juce::jlimit(0, (int)std::size(FFTDefines::overlapCounts) - 1,
+                                           (int)_overlapCountIndex->load(std::memory_order_relaxed));
+
+    CpuGovernor::Settings settings;
+    settings._fftSize = FFTDefines::fftSizes[fftIndex];
+    settings._overlapCount = FFTDefines::overlapCounts[overlapIndex];
+    return settings;
+}
+
+EngineState::Config PluginAudioProcessor::getEngineConfig(double sampleRate)
+{
+    // CPU Governor が有効なときは、負荷に応じて下げた設定でエンジンを構築する
+    auto const governorLevel = (_cpuGovernorEnabled->load() >= 0.5f) ? _cpuGovernor.getLevel() : 0;
+    auto const settings = CpuGovernor::apply(getRequestedSettings(), governorLevel);
+
+    EngineState::Config config;
+    config._sampleRate = sampleRate;
+    config._numChannels = getTotalNumInputChannels();
+    config._maxBlockSize = _maxBlockSize;
+    config._hostBlockSize = _hostBlockSize;
+    config._fftSize = settings._fftSize;
+    config._overlapCount = settings._overlapCount;
+    config._latencyMode = getLatencyMode();
+    config._windowMode = getWindowMode();
+    config._multiResolution = isMultiResolutionEnabled();
+    config._engineType = getEngineType();
+    config._doublePrecision = isUsingDoublePrecision();
+    config._profiler = getProfiler();
+    config._health = &_numericalHealth;
+    return config;
+}
+
+void PluginAudioProcessor::acceptPendingState()
+{
+    // クロスフェード中は差し替えない。その間に届いた設定は、バックグラウンドスレッドが最新のものだけを残しておく
+    if(_fadingState != nullptr || _pendingState.load(std::memory_order_relaxed) == nullptr) {
+        return;
+    }
 
-    int const fftSize = getFFTSize();
-    int const overlapSize = getOverlapSize();
+    std::unique_ptr<EngineState> newState(_pendingState.exchange(nullptr, std::memory_order_acquire));
+    if(newState == nullptr) {
+        return;
+    }
 
-    _fft = std::make_unique<juce::dsp::FFT>(_fftOrder);
-    _signalBuffer.resize(fftSize);
-    _frequencyBuffer.resize(fftSize);
-    _cepstrumBuffer.resize(fftSize);
+    _fadingState = std::move(_currentState);
+    _currentState = std::move(newState);
+    _crossfadePosition = 0;
 
-    _window.resize(fftSize);
-    for(int i = 0; i < fftSize; ++i) {
-        _window[i] = float(0.5f * (1.0 - cos(2.0 * M_PI * i / (double)fftSize)));
+    // 新しいエンジンの出力が聞こえ始めるのは、レイテンシーの分の入力を処理し終えてからになる
+    _warmupRemaining = _currentState->getLatencySamples();
+    if(_warmupRemaining == 0) {
+        publishActiveState();
     }
+}
 
-    std::fill(_signalBuffer.begin(), _signalBuffer.end(), ComplexType{});
-    std::fill(_frequencyBuffer.begin(), _frequencyBuffer.end(), ComplexType{});
-    std::fill(_cepstrumBuffer.begin(), _cepstrumBuffer.end(), ComplexType{});
+void PluginAudioProcessor::publishActiveState()
+{
+    auto const &config = _currentState->getConfig();
+    _effectiveFFTSize.store(config._fftSize, std::memory_order_relaxed);
+    _effectiveOverlapCount.store(config._overlapCount, std::memory_order_relaxed);
 
-    _inputRingBuffer.resize(totalNumInputChannels, fftSize);
-    _inputRingBuffer.discardAll();
-    _inputRingBuffer.fill(fftSize - overlapSize);
-    _bufferInfoList.resize(totalNumInputChannels);
+    _activeLatency.store(_currentState->getLatencySamples(), std::memory_order_relaxed);
+    _latencyChanged.store(true, std::memory_order_release);
+}
 
-    _outputRingBuffer.resize(totalNumInputChannels, fftSize + samplesPerBlock);
-    _outputRingBuffer.discardAll();
-    _outputRingBuffer.fill(fftSize + samplesPerBlock - overlapSize);
+void PluginAudioProcessor::handleAsyncUpdate()
+{
+    setLatencySamples(_activeLatency.load(std::memory_order_relaxed));
+}
 
-    _tmpBuffer.setSize(totalNumInputChannels, fftSize);
-    _wetBuffer.setSize(totalNumInputChannels, samplesPerBlock);
+void PluginAudioProcessor::retireState(std::unique_ptr<EngineState> state)
+{
+    if(state == nullptr) { return; }
 
-    _tmpFFTBuffer.resize(fftSize);
-    _tmpFFTBuffer2.resize(fftSize);
-    _tmpPhaseBuffer.resize(fftSize);
-    _prevInputPhases.setSize(totalNumInputChannels, fftSize);
-    _prevOutputPhases.setSize(totalNumInputChannels, fftSize);
-    _analysisMagnitude.resize(fftSize);
-    _synthesizeMagnitude.resize(fftSize);
-    _analysisFrequencies.resize(fftSize);
-    _synthesizeFrequencies.resize(fftSize);
+    // 差し替えはクロスフェードが終わるまで行わないので、解放待ちのエンジンがキューから溢れることはない
+    auto scope = _retiredStatesFifo.write(1);
+    jassert(scope.blockSize1 == 1);
+    if(scope.blockSize1 == 1) {
+        _retiredStates[scope.startIndex1] = state.release();
+    }
+}
 
-    {
-        std::unique_lock lock(_mtxUIData);
-        _uiRingBuffer.resize(totalNumInputChannels, samplesPerBlock);
-        _uiRingBuffer.discardAll();
-        
-        _spectrums.resize(totalNumInputChannels);
-        for(auto &s: _spectrums) {
-            s.resize(fftSize);
-            s.clear();
-        }
+void PluginAudioProcessor::deleteRetiredStates()
+{
+    auto const numReady = _retiredStatesFifo.getNumReady();
+    auto scope = _retiredStatesFifo.read(numReady);
+    for(int i = 0; i < scope.blockSize1; ++i) {
+        delete std::exchange(_retiredStates[scope.startIndex1 + i], nullptr);
+    }
+    for(int i = 0; i < scope.blockSize2; ++i) {
+        delete std::exchange(_retiredStates[scope.startIndex2 + i], nullptr);
     }
+}
 
-    {
-        _tmpSpectrums.resize(totalNumInputChannels);
-        for(auto &s: _tmpSpectrums) {
-            s.resize(fftSize);
-            s.clear();
+void PluginAudioProcessor::rebuildState()
+{
+    std::unique_lock lock(_stateMutex);
+    if(_prepared == false) {
+        return;
+    }
+
+    auto newState = EngineState::create(getEngineConfig(_preparedSampleRate));
+
+    // オーディオスレッドがまだ受け取っていない古い設定のエンジンがあれば、ここで捨てる。
+    // ホストに報告するレイテンシーは、オーディオスレッドが差し替えたときに更新する
+    delete _pendingState.exchange(newState.release(), std::memory_order_acq_rel);
+}
+
+void PluginAudioProcessor::ReconfigureThread::run()
+{
+    // パラメータの変更はオーディオスレッドから通知されることもあるので、notify() は使わずにフラグをポーリングする
+    while(threadShouldExit() == false) {
+        if(_owner._reconfigureRequested.exchange(false)) {
+            _owner.rebuildState();
+        }
+
+        // オーディオスレッドがエンジンを差し替えたら、メッセージスレッドでレイテンシーをホストに報告する
+        if(_owner._latencyChanged.exchange(false, std::memory_order_acquire)) {
+            _owner.triggerAsyncUpdate();
         }
+
+        {
+            std::unique_lock lock(_owner._stateMutex);
+            _owner.deleteRetiredStates();
+        }
+
+        _owner.logNumericalHealth();
+
+        wait(10);
     }
+}
 
-    _smoothedGain.reset(10);
+void PluginAudioProcessor::DisplayReductionThread::run()
+{
+    auto lastTime = juce::Time::getMillisecondCounterHiRes();
+
+    while(threadShouldExit() == false) {
+        if(_owner._spectrumExchange.acquire()) {
+            auto const now = juce::Time::getMillisecondCounterHiRes();
+            auto const &snapshot = _owner._spectrumExchange.getReadBuffer();
+
+            // Spectrum コンポーネントは 0 番目のチャンネルだけを描画する
+            if(snapshot._capture.hasChannel(0)) {
+                _owner._displayReducer.reduce(snapshot._channels[0],
+                                              snapshot._capture._graphs,
+                                              snapshot._fftSize,
+                                              snapshot._sampleRate,
+                                              (now - lastTime) / 1000.0,
+                                              _owner._displayExchange.getWriteBuffer());
+                _owner._displayExchange.publish();
+            }
+
+            lastTime = now;
+        }
+
+        wait(15);
+    }
 }
 
 void PluginAudioProcessor::releaseResources()
 {
     // When playback stops, you can use this as an opportunity to free up any
     // spare memory, etc.
+
+   #if HWM_ENABLE_REALTIME_CHECKER
+    // 再生中にオーディオスレッドで検出した違反をログに書き出す
+    if(RealtimeChecker::getNumViolations() > 0) {
+        juce::Logger::writeToLog("RealtimeChecker: " + juce::String(RealtimeChecker::getNumViolations()) + " violation(s) on the audio thread");
+        for(auto const &report: RealtimeChecker::getViolationReports()) {
+            juce::Logger::writeToLog(report);
+        }
+        RealtimeChecker::clearViolations();
+    }
+   #endif
 }
 
 #ifndef JucePlugin_PreferredChannelConfigurations
@@ -207,96 +388,191 @@ bool PluginAudioProcessor::isBusesLayoutSupported (const BusesLayout& layouts) c
 
 void PluginAudioProcessor::processBlock (juce::AudioBuffer<float>& buffer, juce::MidiBuffer& midiMessages)
 {
-    // TODO: フェードアウトを実装したい
-    std::unique_lock lock(_processLock, std::try_to_lock);
-    if(lock.owns_lock() == false) {
-        return;
-    }
+    juce::ignoreUnused(midiMessages);
+    processBlockImpl(buffer);
+}
 
+void PluginAudioProcessor::processBlock (juce::AudioBuffer<double>& buffer, juce::MidiBuffer& midiMessages)
+{
     juce::ignoreUnused(midiMessages);
+    processBlockImpl(buffer);
+}
 
-    juce::ScopedNoDenormals noDenormals;
-    auto totalNumInputChannels  = getTotalNumInputChannels();
-    auto totalNumOutputChannels = getTotalNumOutputChannels();
-    auto const bufferSize = std::min<int>(getBlockSize(), buffer.getNumSamples());
+template<class SampleType>
+void PluginAudioProcessor::processBlockImpl(juce::AudioBuffer<SampleType> &buffer)
+{
+    HWM_REALTIME_SECTION();
+    HWM_PROFILE_SCOPE(getProfiler(),
+                      ProfileStage::kProcessBlock,
+                      _effectiveFFTSize.load(std::memory_order_relaxed),
+                      _effectiveOverlapCount.load(std::memory_order_relaxed));
 
-    auto const wetLevel = dynamic_cast<juce::AudioParameterFloat*>(_apvts.getParameter(ParameterIds::dryWetRate))->get();
-    auto const dryLevel = 1.0f - wetLevel;
+    juce::ScopedNoDenormals noDenormals;
+    auto const startTicks = juce::Time::getHighResolutionTicks();
+    auto const totalNumInputChannels  = getTotalNumInputChannels();
+    auto const totalNumOutputChannels = getTotalNumOutputChannels();
+    auto const numSamples = buffer.getNumSamples();
 
     for (auto i = totalNumInputChannels; i < totalNumOutputChannels; ++i)
     {
-        buffer.clear (i, 0, bufferSize);
+        buffer.clear (i, 0, numSamples);
     }
 
-#if 1
+    if(_currentState == nullptr) {
+        buffer.clear();
+        return;
+    }
 
-    int const fftSize = getFFTSize();
-    int const overlapSize = getOverlapSize();
-    int bufferConsumed = 0;
+    acceptPendingState();
 
-    for( ; ; ) {
-        if(bufferConsumed == bufferSize) { break; }
+    auto const &snapshot = _realtimeParameters.update(numSamples);
 
-        auto const numWritable = _inputRingBuffer.getNumWritable();
+    // UI が表示していないグラフは、エンジンの中でも書き込まない
+    auto frameParameters = snapshot._frameParameters;
+    frameParameters._capture = SpectrumCaptureMask::unpack(_spectrumSubscription.load(std::memory_order_acquire));
 
-        assert(numWritable != 0);
+    // prepareToPlay で準備したサイズより大きなブロックは、分割して処理する
+    for(int start = 0; start < numSamples; start += _maxBlockSize) {
+        auto const length = std::min(_maxBlockSize, numSamples - start);
+        auto subBuffer = getSubBufferOf(buffer, buffer.getNumChannels(), start, length);
+        processSubBlock(subBuffer,
+                        frameParameters,
+                        snapshot._dryLevel.getSubRange(start, length, numSamples),
+                        snapshot._wetLevel.getSubRange(start, length, numSamples));
+    }
 
-        auto const numToWrite = std::min(numWritable, (bufferSize - bufferConsumed));
+    // モノラルで入力された場合は出力を広げる
+    if (totalNumInputChannels == 1) {
+        for (int channel = 1; channel < totalNumOutputChannels; ++channel) {
+            buffer.copyFrom(channel, 0, buffer, 0, 0, numSamples);
+        }
+    }
 
-        _inputRingBuffer.write(getSubBufferOf(buffer, totalNumInputChannels, bufferConsumed, numToWrite));
+    for (int channel = 0; channel < totalNumOutputChannels; ++channel)
+    {
+        buffer.applyGainRamp(channel, 0, numSamples, snapshot._outputGain._start, snapshot._outputGain._end);
+        auto data = buffer.getWritePointer(channel);
+        FVO::clip(data, data, -1.5, 1.5, numSamples);
+    }
 
-        if(_inputRingBuffer.isFull()) {
-            processAudioBlock();
+    // オシロスコープ用のデータ。
+    // 読み込み位置は UI スレッドだけが動かすので、リングバッファに空きがないときは書き込める分だけ書き込む
+    if(_scopeSubscribed.load(std::memory_order_relaxed)) {
+        auto const uiSize = std::min(numSamples, _uiRingBuffer.getNumWritable());
+        auto const uiStart = numSamples - uiSize;
+
+        if(uiSize > 0) {
+            // double で処理しているときは、書き込むときに float に変換する
+            auto const writeResult = _uiRingBuffer.write(juce::AudioBuffer<SampleType>(buffer.getArrayOfWritePointers(), 1, uiStart, uiSize));
+            jassert(writeResult);
+            juce::ignoreUnused(writeResult);
         }
+    }
+
+    auto const elapsedTicks = juce::Time::getHighResolutionTicks() - startTicks;
+    _deadlineMonitor.record(juce::Time::highResolutionTicksToSeconds(elapsedTicks), numSamples);
+    updateCpuGovernor(elapsedTicks, numSamples);
+}
 
-        auto const readResult = _outputRingBuffer.read(getSubBufferOf(_wetBuffer, totalNumInputChannels, bufferConsumed, numToWrite));
-        jassert(readResult);
+void PluginAudioProcessor::updateCpuGovernor(juce::int64 elapsedTicks, int numSamples)
+{
+    if(_cpuGovernorEnabled->load(std::memory_order_relaxed) < 0.5f) {
+        // 無効にしたときは、下げていた設定を元に戻す
+        if(_cpuGovernor.reset()) {
+            _reconfigureRequested = true;
+        }
+        return;
+    }
 
-        _outputRingBuffer.discard(numToWrite);
+    // エンジンの差し替えが終わるまでは、処理時間を判定に使用しない
+    auto const canMeasure = _fadingState == nullptr
+                         && _pendingState.load(std::memory_order_relaxed) == nullptr
+                         && _reconfigureRequested.load(std::memory_order_relaxed) == false;
 
-        bufferConsumed += numToWrite;
+    auto const elapsedSeconds = juce::Time::highResolutionTicksToSeconds(elapsedTicks);
+    if(_cpuGovernor.update(elapsedSeconds, numSamples, canMeasure, getRequestedSettings())) {
+        _reconfigureRequested = true;
     }
+}
 
-    buffer.applyGain(dryLevel);
+template<class SampleType>
+void PluginAudioProcessor::processSubBlock(juce::AudioBuffer<SampleType> &buffer,
+                                           SpectralEngineBase::FrameParameters const &params,
+                                           GainRamp dryLevel,
+                                           GainRamp wetLevel)
+{
+    auto const totalNumInputChannels = getTotalNumInputChannels();
+    auto const bufferSize = buffer.getNumSamples();
+    jassert(bufferSize <= _maxBlockSize);
 
+    if(_fadingState == nullptr) {
+        auto const processed = _currentState->process(buffer, params, dryLevel, wetLevel);
+        if(processed) { publishSpectrums(params._capture); }
+        return;
+    }
+
+    // 古いエンジンと新しいエンジンの両方で処理する。
+    // 新しいエンジンがレイテンシーの分の入力を処理し終えるまでは古いエンジンの出力だけを使い、そのあとで線形にクロスフェードする
+    auto fadingBuffer = getSubBufferOf(getCrossfadeBuffer<SampleType>(), totalNumInputChannels, bufferSize);
     for(int ch = 0; ch < totalNumInputChannels; ++ch) {
-        buffer.addFrom(ch, 0, _wetBuffer.getReadPointer(ch), bufferSize, wetLevel);
+        fadingBuffer.copyFrom(ch, 0, buffer, ch, 0, bufferSize);
     }
 
-    auto *outputGainParam = dynamic_cast<juce::AudioParameterFloat *>(_apvts.getParameter(ParameterIds::outputGain));
-    auto outputGain = juce::Decibels::decibelsToGain(outputGainParam->get(), Defines::outputGainSilent);
+    _fadingState->process(fadingBuffer, params, dryLevel, wetLevel);
+    auto const processed = _currentState->process(buffer, params, dryLevel, wetLevel);
 
-    // モノラルで入力された場合は出力を広げる
-    if (totalNumInputChannels == 1) {
-        for (int channel = 1; channel < totalNumOutputChannels; ++channel) {
-            buffer.copyFrom(channel, 0, buffer, 0, 0, bufferSize);
+    auto const warmupLength = std::min(bufferSize, _warmupRemaining);
+    if(warmupLength > 0) {
+        for(int ch = 0; ch < totalNumInputChannels; ++ch) {
+            buffer.copyFrom(ch, 0, fadingBuffer, ch, 0, warmupLength);
         }
-    }
 
-    for (int channel = 0; channel < totalNumOutputChannels; ++channel)
-    {
-        auto data = buffer.getWritePointer(channel);
-        FVO::multiply(data, outputGain, buffer.getNumSamples());
-        FVO::clip(data, data, -1.5, 1.5, buffer.getNumSamples());
+        _warmupRemaining -= warmupLength;
+        if(_warmupRemaining == 0) {
+            publishActiveState();
+        }
     }
-#endif
 
-    {
-        std::unique_lock lock(_mtxUIData);
-        if(_uiRingBuffer.getNumWritable() < buffer.getNumSamples()) {
-            _uiRingBuffer.discard(buffer.getNumSamples() - _uiRingBuffer.getNumWritable());
+    auto const fadeLength = std::min(bufferSize - warmupLength, _crossfadeLength - _crossfadePosition);
+    auto const gainStep = (SampleType)1 / _crossfadeLength;
+    auto const startGain = _crossfadePosition * gainStep;
+
+    for(int ch = 0; ch < totalNumInputChannels; ++ch) {
+        auto *dest = buffer.getWritePointer(ch, warmupLength);
+        auto const *src = fadingBuffer.getReadPointer(ch, warmupLength);
+        for(int i = 0; i < fadeLength; ++i) {
+            auto const gain = startGain + i * gainStep;
+            dest[i] = src[i] + (dest[i] - src[i]) * gain;
         }
+    }
+
+    _crossfadePosition += fadeLength;
+    if(_crossfadePosition >= _crossfadeLength) {
+        retireState(std::move(_fadingState));
+    }
+
+    if(processed) { publishSpectrums(params._capture); }
+}
 
-//        for (int ch = 0; ch < buffer.getNumChannels(); ++ch) {
-//            auto const chData = buffer.getReadPointer(ch);
-//            for(int smp = 0; smp < buffer.getNumSamples(); ++smp) {
-//                if (isnan(chData[smp]) || isinf(chData[smp])) {
-//                    jassert(false);
-//                }
-//            }
-//        }
-        _uiRingBuffer.write(juce::AudioSampleBuffer(buffer.getArrayOfWritePointers(), 1, bufferSize));
+void PluginAudioProcessor::publishSpectrums(SpectrumCaptureMask capture)
+{
+    // エディタを閉じているときは何もコピーしない
+    if(capture.isEmpty()) { return; }
+
+    auto const *engine = _currentState->getDisplayEngine();
+    if(engine == nullptr) { return; }
+
+    auto const &engineSpectrums = engine->getSpectrums();
+    auto &snapshot = _spectrumExchange.getWriteBuffer();
+    snapshot._fftSize = engine->getFFTSize();
+    snapshot._sampleRate = _currentState->getConfig()._sampleRate;
+    snapshot._capture = capture;
+    for(int i = 0, end = std::min(engineSpectrums.size(), snapshot._channels.size()); i < end; ++i) {
+        if(capture.hasChannel(i)) {
+            snapshot._channels[i].copyFrom(engineSpectrums[i], engine->getNumBins(), capture._graphs);
+        }
     }
+    _spectrumExchange.publish();
 }
 
 //==============================================================================
@@ -315,6 +591,8 @@ void PluginAudioProcessor::getStateInformation (juce::MemoryBlock& destData)
 {
     std::unique_ptr<juce::XmlElement> xmlState(new juce::XmlElement("PluginState"));
     xmlState->setAttribute("Plugin_Version", JucePlugin_VersionString);
+    // FFT サイズの値がどの選択肢の並びのインデックスかを、読み込むときに判別できるようにする
+    xmlState->setAttribute("FFT_Size_Choices", (int)std::size(FFTDefines::fftSizes));
     {
         juce::MemoryOutputStream mem(2048);
         std::unique_ptr<juce::XmlElement> xmlElm(this->_apvts.copyState().createXml());
@@ -342,461 +620,224 @@ void PluginAudioProcessor::setStateInformation (const void* data, int sizeInByte
         }
     }
 
+    // FFT_Size_Choices がない状態は、2 の累乗だけの選択肢のときに保存されたもの
+    auto const numFFTSizeChoices = xmlState->getIntAttribute("FFT_Size_Choices", (int)std::size(FFTDefines::legacyFFTSizes));
+
     auto processorStateXml = xmlState->getStringAttribute("ProcessorState");
     if(processorStateXml.isNotEmpty())
     {
         if(auto xml = juce::parseXML(processorStateXml))
         {
+            if(numFFTSizeChoices == (int)std::size(FFTDefines::legacyFFTSizes)) {
+                migrateLegacyFFTSize(*xml);
+            }
             this->_apvts.replaceState(juce::ValueTree::fromXml(*xml));
         }
     }
 }
 
-void PluginAudioProcessor::getBufferDataForUI(juce::AudioSampleBuffer &buf)
+void PluginAudioProcessor::migrateLegacyFFTSize(juce::XmlElement &state)
 {
-    if(buf.getNumChannels() != getTotalNumInputChannels() ||
-       buf.getNumSamples() != getBlockSize()
-       )
-    {
-        buf.setSize(getTotalNumInputChannels(), getBlockSize());
-    }
+    // 保存されている値は 2 の累乗だけの選択肢のインデックスなので、同じサイズの新しい選択肢のインデックスに読み替える
+    auto *param = state.getChildByAttribute("id", ParameterIds::fftSize);
+    if(param == nullptr) { return; }
 
-    for( ; ; ) {
-        juce::Thread::sleep(1);
-        std::unique_lock lock(_mtxUIData);
-        _uiRingBuffer.read(buf);
-        break;
-    }
+    auto const legacyIndex = juce::jlimit(0, (int)std::size(FFTDefines::legacyFFTSizes) - 1,
+                                          juce::roundToInt(param->getDoubleAttribute("value")));
+    param->setAttribute("value", FFTDefines::getIndexOfLegacyFFTSize(legacyIndex));
 }
 
-void PluginAudioProcessor::getSpectrumDataForUI(ReferenceableArray<SpectrumData> &dest)
+void PluginAudioProcessor::getBufferDataForUI(juce::AudioSampleBuffer &buf)
 {
-    if(dest.size() != getTotalNumInputChannels()) {
-        dest.resize(getTotalNumInputChannels());
+    auto const length = std::min(getBlockSize(), _uiRingBuffer.getCapacity());
+    if(buf.getNumChannels() != 1 || buf.getNumSamples() != length) {
+        buf.setSize(1, length);
+        buf.clear();
     }
 
-    auto fftSize = getFFTSize();
-    for(auto &data: dest) {
-        data.resize(fftSize);
-        data.clear();
+    // 最新の length サンプルだけを読み込む。足りないときは前回のデータのままにする
+    auto const numReadable = _uiRingBuffer.getNumReadable();
+    if(numReadable < length) {
+        return;
     }
 
-
-    std::unique_lock lock(_mtxUIData);
-
-    for(int i = 0; i < dest.size(); ++i) {
-        auto const & src = _spectrums[i];
-        auto & d = dest[i];
-        d.copyFrom(src);
-    }
+    _uiRingBuffer.discard(numReadable - length);
+    auto const readResult = _uiRingBuffer.read(buf);
+    jassert(readResult);
+    juce::ignoreUnused(readResult);
+    _uiRingBuffer.discard(length);
 }
 
-juce::AudioParameterFloat * PluginAudioProcessor::getFormantParameter()
+void PluginAudioProcessor::setScopeSubscribed(bool subscribed)
 {
-    return dynamic_cast<juce::AudioParameterFloat*>(_apvts.getParameter(ParameterIds::formant));
+    _scopeSubscribed.store(subscribed, std::memory_order_relaxed);
 }
 
-juce::AudioParameterFloat * PluginAudioProcessor::getPitchParameter()
+void PluginAudioProcessor::setSpectrumSubscription(SpectrumCaptureMask mask)
 {
-    return dynamic_cast<juce::AudioParameterFloat*>(_apvts.getParameter(ParameterIds::pitch));
+    // まだ確保していないグラフの配列を確保してから、オーディオスレッドにマスクを公開する
+    if(auto const newGraphs = mask._graphs & ~_allocatedSnapshotGraphs; newGraphs != 0 && mask.isEmpty() == false) {
+        auto const maxFFTSize = *std::max_element(std::begin(FFTDefines::fftSizes), std::end(FFTDefines::fftSizes));
+        _spectrumExchange.forEachBuffer([&](SpectrumSnapshot &snapshot) {
+            for(auto &data: snapshot._channels) {
+                data.resize(SpectrumData::getNumBins(maxFFTSize), newGraphs);
+            }
+        });
+        _allocatedSnapshotGraphs |= newGraphs;
+    }
+
+    _spectrumSubscription.store(mask.pack(), std::memory_order_release);
 }
 
-// Helper function to wrap the phase between -pi and pi
-float wrapPhase(float phaseIn)
+bool PluginAudioProcessor::getSpectrumDisplayForUI(SpectrumDisplayData &dest)
 {
-    if (phaseIn >= 0) {
-        return (float)(fmod(phaseIn + M_PI, 2.0 * M_PI) - M_PI);
-    } else {
-        return (float)(fmod(phaseIn - M_PI, -2.0 * M_PI) + M_PI);
+    // 新しいデータがないときは前回のデータのままにする
+    if(_displayExchange.acquire() == false) {
+        return false;
     }
-}
 
-#define CEPSTRUM_FFT_FLAG true
+    dest = _displayExchange.getReadBuffer();
+    return true;
+}
 
-void PluginAudioProcessor::processAudioBlock()
+PluginAudioProcessor::EngineStatus PluginAudioProcessor::getEngineStatusForUI() const
 {
-    auto const fftSize = getFFTSize();
-    auto const overlapSize = getOverlapSize();
-    auto const numChannels = _inputRingBuffer.getNumChannels();
-
-    auto const validate_array = [](ReferenceableArray<ComplexType> const &arr) {
-        return std::none_of(arr.begin(), arr.end(), [](ComplexType c) {
-            auto n = std::norm(c);
-            auto r = std::isnan(n) || std::isinf(n);
-            assert(r == false);
-            return r;
-        });
-    };
-
-    auto const formant = dynamic_cast<juce::AudioParameterFloat*>(_apvts.getParameter(ParameterIds::formant))->get();
-    auto const formantExpandAmount = std::pow(2.0, formant / 100.0);
-    auto const pitch = dynamic_cast<juce::AudioParameterFloat*>(_apvts.getParameter(ParameterIds::pitch))->get();
-    auto const pitchChangeAmount = std::pow(2.0, pitch / 100.0);
-    auto const envelopOrder = dynamic_cast<juce::AudioParameterInt*>(_apvts.getParameter(ParameterIds::envelopeOrder))->get();
-    auto const envelopAmount = 1.0;
-    auto const fineStructureAmount = 1.0;
-
-    jassert(_signalBuffer.size() == fftSize);
-    jassert(_frequencyBuffer.size() == fftSize);
-    jassert(_cepstrumBuffer.size() == fftSize);
-
-    _inputRingBuffer.readWithoutCopy([&, this](int ch, auto const &bi) {
-        _bufferInfoList[ch] = bi;
-        assert(bi._len1 + bi._len2 >= fftSize);
-    });
-
-    _tmpBuffer.clear();
-    for(int ch = 0; ch < numChannels; ++ch) {
-        std::fill(_frequencyBuffer.begin(), _frequencyBuffer.end(), ComplexType{});
-        std::fill(_cepstrumBuffer.begin(), _cepstrumBuffer.end(), ComplexType{});
-        auto & specData = _tmpSpectrums[ch];
-        auto &bi = _bufferInfoList[ch];
-
-        double originalPower = 0;
-
-        jassert(_overlapCount >= 1);
-        for(int i = 0, end = std::min(fftSize, bi._len1); i < end; ++i) {
-            auto const smp = bi._buf1[i] / _overlapCount;
-            originalPower += smp * smp;
-            _signalBuffer[i] = ComplexType { smp * _window[i], 0 };
-        }
-
-        for(int i = bi._len1, end = fftSize; i < end; ++i) {
-            auto const smp = bi._buf2[i - bi._len1] / _overlapCount;
-            originalPower += smp * smp;
-            _signalBuffer[i] = ComplexType { smp * _window[i], 0 };
-        }
-
-#if 1
-        // スペクトルに変換
-        _fft->perform(_signalBuffer.data(), _frequencyBuffer.data(), false);
-
-        for(int i = 0; i < fftSize; ++i) {
-            specData._originalSpectrum[i] = _frequencyBuffer[i];
-        }
-
-#if 1 // フォルマントシフト
-        // ピッチシフト前のスペクトルからスペクトル包絡を計算
-        {
-            for(int i = 0; i < fftSize; ++i) {
-                auto amp = std::abs(_frequencyBuffer[i]);
-                if(amp == 0) {
-                    amp += std::numeric_limits<float>::min();
-                }
-
-                auto r = std::log(amp);
-                _tmpFFTBuffer[i] = ComplexType { r, 0.0 };
-            }
-
-            _fft->perform(_tmpFFTBuffer.data(), _cepstrumBuffer.data(), CEPSTRUM_FFT_FLAG);
-
-            // assert(validate_array(_cepstrumBuffer));
-
-            for(int i = 0; i < fftSize; ++i) {
-                specData._originalCepstrum[i] = _cepstrumBuffer[i];
-            }
-
-            // ケプストラムを liftering してスペクトル包絡を取得
-
-            // envelope
-            _tmpFFTBuffer[0] = _cepstrumBuffer[0];
-            for(int i = 1; i <= fftSize / 2; ++i) {
-                if(i < envelopOrder) {
-                    _tmpFFTBuffer[i] = _cepstrumBuffer[i];
-                    _tmpFFTBuffer[fftSize - i] = _cepstrumBuffer[i];
-                } else {
-                    _tmpFFTBuffer[i] = _tmpFFTBuffer[fftSize - i] = ComplexType { 0, 0 };
-                }
-            }
-
-            _fft->perform(_tmpFFTBuffer.data(), _tmpFFTBuffer2.data(), !CEPSTRUM_FFT_FLAG);
-
-            // assert(validate_array(_tmpFFTBuffer2));
-
-            for(int i = 0; i < fftSize; ++i) {
-                specData._envelope[i] = _tmpFFTBuffer2[i];
-            }
-        }
-
-        // フォルマントシフト
-        {
-            std::copy(specData._envelope.begin(), specData._envelope.end(), _tmpFFTBuffer.begin());
-
-            for(int i = 0; i <= fftSize / 2; ++i) {
-                double shiftedPos = i / formantExpandAmount;
-                int leftIndex = (int)std::floor(shiftedPos);
-                int rightIndex = (int)std::ceil(shiftedPos);
-                double diff = shiftedPos - leftIndex;
-
-                double leftValue = -1000.0;
-                double rightValue = -1000.0;
-
-                if(leftIndex <= fftSize / 2) {
-                    leftValue = _tmpFFTBuffer[leftIndex].real();
-                }
-
-                if(rightIndex <= fftSize / 2) {
-                    rightValue = _tmpFFTBuffer[rightIndex].real();
-                }
-
-                double newValue = (1.0 - diff) * leftValue + diff * rightValue;
-                specData._envelope[i].real((float)newValue);
-            }
-
-            for(int i = 1; i <= fftSize / 2; ++i) {
-                specData._envelope[fftSize - i].real(specData._envelope[i].real());
-            }
-        }
-#endif
-
-#if 1
-        // ピッチシフト
-        {
-            double hopSize = overlapSize;
-
-            std::fill_n(_analysisMagnitude.begin(), fftSize, 0.0);
-            std::fill_n(_analysisFrequencies.begin(), fftSize, 0.0);
-            // 瞬時周波数からbin内の正確な周波数を解析
-            for(int i = 0; i <= fftSize / 2; ++i) {
-                auto magnitude = std::abs(_frequencyBuffer[i]);
-                auto phase = std::arg(_frequencyBuffer[i]);
-                double binCenterFrequency = 2.0 * M_PI * i / fftSize;
-
-                double phaseDiff = phase - _prevInputPhases.getReadPointer(ch)[i]; // 前回フレームからの位相の進んだ量
-                _prevInputPhases.getWritePointer(ch)[i] = phase;
-
-                phaseDiff = wrapPhase(phaseDiff - binCenterFrequency * hopSize); // 中心周波数が hopSize によって進む量との差分を検出
-                double binDeviation = phaseDiff * fftSize / (hopSize * 2 * M_PI); // それを周波数ビン1つ分の周波数幅 * hopSize で割る => 周波数ビン1つのなかでの相対位置を 0.0..1.0 で算出する。
-
-                _analysisMagnitude[i] = magnitude;
-                _analysisFrequencies[i] = (float)(i + binDeviation);
-                assert(isnan(_analysisFrequencies[i]) == false && isinf( _analysisFrequencies[i]) == false);
-            }
-
-            // 周波数変更
-            std::fill_n(_synthesizeMagnitude.begin(), fftSize, 0.0);
-            std::fill_n(_synthesizeFrequencies.begin(), fftSize, 0.0);
-            for(int i = 0; i <= fftSize / 2; ++i) {
-                int shiftedBin = std::floor(i / pitchChangeAmount + 0.5);
-                if(shiftedBin > fftSize / 2) { break; }
-
-                // magnitude 
-                _synthesizeMagnitude[i] += _analysisMagnitude[shiftedBin];
-                _synthesizeFrequencies[i] = _analysisFrequencies[shiftedBin] * pitchChangeAmount;
-                assert(isnan(_synthesizeFrequencies[i]) == false && isinf(_synthesizeFrequencies[i]) == false);
-            }
-
-            for(int i = 0; i <= fftSize / 2; ++i) {
-                double binDeviation = _synthesizeFrequencies[i] - i;
-                double phaseDiff = binDeviation * 2.0 * M_PI * hopSize / fftSize;
-                double binCenterFrequency = 2.0 * M_PI * i / fftSize;
-                phaseDiff += binCenterFrequency * hopSize;
-
-                auto phase = wrapPhase(_prevOutputPhases.getReadPointer(ch)[i] + phaseDiff);
-                // assert(isnan(phase) == false && isinf(phase) == false);
-
-                _frequencyBuffer[i] = ComplexType {
-                    (float)(_synthesizeMagnitude[i] * std::cos(phase)),
-                    (float)(_synthesizeMagnitude[i] * std::sin(phase))
-                };
-
-                _prevOutputPhases.getWritePointer(ch)[i] = phase;
-            }
-
-            for(int i = 1; i < fftSize / 2; ++i) {
-                _frequencyBuffer[fftSize - i] = std::conj(_frequencyBuffer[i]);
-            }
-
-            assert(validate_array(_frequencyBuffer));
-        }
-#endif
-        for(int i = 0; i < fftSize; ++i) {
-            _tmpPhaseBuffer[i] = std::arg(_frequencyBuffer[i]);
-        }
-
-        // ピッチシフト後のスペクトル
-        for(int i = 0; i < fftSize; ++i) {
-            specData._shiftedSpectrum[i] = _frequencyBuffer[i];
-        }
-
-        // ピッチが低い方にシフトされたとき、
-        // シフト後のスペクトルはナイキスト周波数のシフトされた位置で急激に値が下がるため、スペクトルを波形として捉えたときにその波形が不連続になる。
-        // このとき Envelope の次数が小さいと、不連続な部分での値の変動に追従できないため、その差分が FineStructure の方に現れてしまう。
-        // これによって FineStructure がナイキスト周波数のシフトされた位置付近で値が大きくなってしまい、高域のノイズになる。
-        // これを防ぐため、ナイキスト周波数のシフトされた位置の対数振幅スペクトルは、それ以下の振幅スペクトルのミラーとして計算するようにする。
-        if(pitchChangeAmount < 1.0) {
-            auto newNyquistPos = (int)std::round(fftSize * 0.5 * pitchChangeAmount);
-            for(int i = 0; i < fftSize / 2; ++i) {
-                if(newNyquistPos + i >= fftSize / 2) { break; }
-                if(newNyquistPos - i < 0) { break; }
-
-                _frequencyBuffer[newNyquistPos + i] = _frequencyBuffer[newNyquistPos - i];
-            }
-
-            for(int i = 1; i < fftSize / 2; ++i) {
-                _frequencyBuffer[fftSize - i] = _frequencyBuffer[i];
-            }
-        }
-
-#if 1
-        // ピッチシフト後の波形からケプストラムを計算し、微細構造だけを取り出す
-        {
-            // 対数振幅スペクトルを FFT してケプストラムを計算
-            for(int i = 0; i < fftSize; ++i) {
-                auto amp = std::abs(_frequencyBuffer[i]);
-                auto r = log(amp + std::numeric_limits<float>::epsilon());
-                _tmpFFTBuffer[i] = ComplexType { r, 0.0 };
-            }
-
-            _fft->perform(_tmpFFTBuffer.data(), _cepstrumBuffer.data(), CEPSTRUM_FFT_FLAG);
-
-            assert(validate_array(_cepstrumBuffer));
-
-            // fine structure
-            _tmpFFTBuffer[0] = ComplexType { 0, 0 };
-            for(int i = 1; i <= fftSize / 2; ++i) {
-                if(i >= envelopOrder) {
-                    _tmpFFTBuffer[i] = _cepstrumBuffer[i];
-                    _tmpFFTBuffer[fftSize - i] = _cepstrumBuffer[i];
-                } else {
-                    _tmpFFTBuffer[i] = _tmpFFTBuffer[fftSize - i] = ComplexType { 0, 0 };
-                }
-            }
-
-            _fft->perform(_tmpFFTBuffer.data(), _tmpFFTBuffer2.data(), !CEPSTRUM_FFT_FLAG);
-
-            assert(validate_array(_tmpFFTBuffer2));
-
-            // ミラーした領域の微細構造は無視する
-            if(pitchChangeAmount < 1.0) {
-                auto newNyquistPos = (int)std::round(fftSize * 0.5 * pitchChangeAmount);
-
-                for(int i = newNyquistPos; i < fftSize / 2; ++i) {
-                    _tmpFFTBuffer2[i] = ComplexType{};
-                }
-
-                for(int i = 1; i < fftSize / 2; ++i) {
-                    _tmpFFTBuffer2[fftSize - i] = _tmpFFTBuffer2[i];
-                }
-            }
-
-            for(int i = 0; i < fftSize; ++i) {
-                specData._fineStructure[i] = _tmpFFTBuffer2[i];
-            }
-
-#if 0
-            // use pitch shifted envelope
-            _tmpFFTBuffer[0] = _cepstrumBuffer[0];
-            for(int i = 1; i <= fftSize / 2; ++i) {
-                if(i < envelopOrder) {
-                    _tmpFFTBuffer[i] = _cepstrumBuffer[i];
-                    _tmpFFTBuffer[fftSize - i] = _cepstrumBuffer[i];
-                } else {
-                    _tmpFFTBuffer[i] = _tmpFFTBuffer[fftSize - i] = ComplexType { 0, 0 };
-                }
-            }
+    EngineStatus status;
+    status._fftSize = _effectiveFFTSize.load();
+    status._overlapCount = _effectiveOverlapCount.load();
+    status._governorLevel = _cpuGovernor.getLevel();
+    status._load = _cpuGovernor.getLoad();
+    return status;
+}
 
-            // assert(validate_array(_tmpFFTBuffer));
+DeadlineMonitor::Statistics PluginAudioProcessor::getDeadlineStatisticsForUI() const
+{
+    return _deadlineMonitor.getStatistics();
+}
 
-            _fft->perform(_tmpFFTBuffer.data(), _tmpFFTBuffer2.data(), !CEPSTRUM_FFT_FLAG);
+void PluginAudioProcessor::resetDeadlineStatistics()
+{
+    _deadlineMonitor.requestReset();
+}
 
-            // assert(validate_array(_tmpFFTBuffer2));
+NumericalHealth::Report PluginAudioProcessor::getNumericalHealthForUI() const
+{
+    return _numericalHealth.getReport();
+}
 
-            for(int i = 0; i < fftSize; ++i) {
-                specData._envelope[i] = _tmpFFTBuffer2[i];
-            }
-#endif
-        }
+void PluginAudioProcessor::resetNumericalHealth()
+{
+    _numericalHealth.reset();
+    _loggedHealthEvents = 0;
+}
 
-        // フォルマントシフトしたスペクトル包絡とピッチシフト後の微細構造からスペクトルを再構築
+void PluginAudioProcessor::logNumericalHealth()
+{
+    // 出力を壊すおそれがある異常が新しく増えたときだけ、累計をホストのログに書き出す。
+    // 異常が続いてもログが溢れないように、書き出す間隔を空ける
+    auto const report = _numericalHealth.getReport();
+    auto const numEvents = report.getNumSeriousEvents();
+    if(numEvents == _loggedHealthEvents) { return; }
 
-        for(int i = 0; i <= fftSize / 2; ++i) {
-            auto const amp = exp(specData._envelope[i].real() * envelopAmount + specData._fineStructure[i].real() * fineStructureAmount);
-            // assert(std::isinf(amp) == false);
+    auto const now = juce::Time::getMillisecondCounter();
+    if(_lastHealthLogTime != 0 && now - _lastHealthLogTime < kHealthLogIntervalMs) { return; }
 
-            _frequencyBuffer[i] = ComplexType {
-                (float)(amp * std::cos(_tmpPhaseBuffer[i])),
-                (float)(amp * std::sin(_tmpPhaseBuffer[i]))
-            };
+    _loggedHealthEvents = numEvents;
+    _lastHealthLogTime = now;
 
-            // assert(std::isinf(std::norm(_frequencyBuffer[i])) == false);
-        }
+    juce::Logger::writeToLog(juce::String(JucePlugin_Name) + ": numerical issues detected (" + report.toString() + ")");
+}
 
-        for(int i = 1; i < fftSize / 2; ++i) {
-            _frequencyBuffer[fftSize - i] = std::conj(_frequencyBuffer[i]);
-        }
+Profiler * PluginAudioProcessor::getProfiler()
+{
+   #if HWM_ENABLE_PROFILER
+    return &_profiler;
+   #else
+    return nullptr;
+   #endif
+}
 
-        assert(validate_array(_frequencyBuffer));
+bool PluginAudioProcessor::writeProfileTrace(juce::File const &file) const
+{
+   #if HWM_ENABLE_PROFILER
+    return _profiler.writeChromeTrace(file);
+   #else
+    juce::ignoreUnused(file);
+    return false;
+   #endif
+}
 
-        // 再合成されたスペクトル
-        for(int i = 0; i < fftSize; ++i) {
-            specData._synthesisSpectrum[i] = _frequencyBuffer[i];
-        }
-#endif
+bool PluginAudioProcessor::writeProfileSummary(juce::File const &file) const
+{
+   #if HWM_ENABLE_PROFILER
+    return _profiler.writeSummary(file);
+   #else
+    juce::ignoreUnused(file);
+    return false;
+   #endif
+}
 
-        _fft->perform(_frequencyBuffer.data(), _signalBuffer.data(), true);
-#endif
+juce::AudioParameterFloat * PluginAudioProcessor::getFormantParameter()
+{
+    return dynamic_cast<juce::AudioParameterFloat*>(_apvts.getParameter(ParameterIds::formant));
+}
 
-        for(int i = 0; i < fftSize; ++i) {
-            _signalBuffer[i] *= _window[i];
-        }
+juce::AudioParameterFloat * PluginAudioProcessor::getPitchParameter()
+{
+    return dynamic_cast<juce::AudioParameterFloat*>(_apvts.getParameter(ParameterIds::pitch));
+}
 
-        std::transform(_signalBuffer.begin(),
-                       _signalBuffer.end(),
-                       _tmpBuffer.getWritePointer(ch),
-                       [](auto x) { return x.real(); }
-                       );
-
-        double const synthesizedPower = std::reduce(_tmpBuffer.getReadPointer(ch),
-                                                    _tmpBuffer.getReadPointer(ch) + fftSize,
-                                                    0.0f,
-                                                    [](double sum, double x) { return sum + (x * x); }
-                                                    );
-
-        float const expectedGainAmount = (float)std::sqrt((synthesizedPower == 0) ? 1.0 : originalPower / synthesizedPower);
-        _smoothedGain.setTargetValue(expectedGainAmount);
-        for(int i = 0; i < fftSize; ++i) {
-            _tmpBuffer.getWritePointer(ch)[i] *=_smoothedGain.getNextValue();
-        }
+bool PluginAudioProcessor::isMultiResolutionEnabled()
+{
+    return dynamic_cast<juce::AudioParameterBool*>(_apvts.getParameter(ParameterIds::multiResolution))->get();
+}
 
-//        for(int i = 0; i < fftSize; ++i) {
-//            auto x = _tmpBuffer.getReadPointer(ch)[i];
-//            assert(std::isnan(x) == false && std::isinf(x) == false);
-//        }
-    }
+EngineType PluginAudioProcessor::getEngineType()
+{
+    auto const param = dynamic_cast<juce::AudioParameterChoice*>(_apvts.getParameter(ParameterIds::engine));
+    return static_cast<EngineType>(param->getIndex());
+}
 
-    if(_outputRingBuffer.overlapAdd(_tmpBuffer, fftSize - overlapSize) == false) {
-        assert("should never fail" && false);
-    }
-    
-    _inputRingBuffer.discard(overlapSize);
+LatencyMode PluginAudioProcessor::getLatencyMode()
+{
+    auto const param = dynamic_cast<juce::AudioParameterChoice*>(_apvts.getParameter(ParameterIds::latencyMode));
+    return static_cast<LatencyMode>(param->getIndex());
+}
 
-    {
-        std::unique_lock lock(_mtxUIData);
-        for(int i = 0; i < _spectrums.size(); ++i) {
-            _spectrums[i].copyFrom(_tmpSpectrums[i]);
-        }
-    }
+WindowMode PluginAudioProcessor::getWindowMode()
+{
+    auto const param = dynamic_cast<juce::AudioParameterChoice*>(_apvts.getParameter(ParameterIds::windowMode));
+    return static_cast<WindowMode>(param->getIndex());
 }
 
 juce::AudioProcessorValueTreeState::ParameterLayout PluginAudioProcessor::createParameterLayout()
 {
     auto group = std::make_unique<juce::AudioProcessorParameterGroup>("Group", "Global", "|");
 
+    juce::StringArray fftSizeNames;
+    for(auto size: FFTDefines::fftSizes) {
+        fftSizeNames.add(juce::String(size));
+    }
+
+    juce::StringArray overlapCountNames;
+    for(auto count: FFTDefines::overlapCounts) {
+        overlapCountNames.add(juce::String(count));
+    }
+
     group->addChild(
         std::make_unique<juce::AudioParameterChoice>(
             juce::ParameterID { ParameterIds::fftSize, 1 },
             ParameterIds::fftSize,
-            juce::StringArray{"256", "512", "1024", "2048", "4096", "8192", "16384"},
-            2
+            fftSizeNames,
+            FFTDefines::fftSizeDefaultIndex
             ));
 
     group->addChild(
         std::make_unique<juce::AudioParameterChoice>(
             juce::ParameterID { ParameterIds::overlapCount, 1 },
             ParameterIds::overlapCount,
-            juce::StringArray{"2", "4", "8", "16", "32", "64"},
-            2
+            overlapCountNames,
+            FFTDefines::overlapCountDefaultIndex
             ));
 
     group->addChild(
@@ -857,17 +898,106 @@ juce::AudioProcessorValueTreeState::ParameterLayout PluginAudioProcessor::create
             },
             nullptr));
 
+    group->addChild(
+        std::make_unique<juce::AudioParameterChoice>(
+            juce::ParameterID { ParameterIds::stereoLink, 1 },
+            ParameterIds::stereoLink,
+            juce::StringArray{"Off", "Mid", "Max Energy"},
+            0
+            ));
+
+    group->addChild(
+        std::make_unique<juce::AudioParameterChoice>(
+            juce::ParameterID { ParameterIds::latencyMode, 1 },
+            ParameterIds::latencyMode,
+            juce::StringArray{"Standard", "Minimum"},
+            0
+            ));
+
+    group->addChild(
+        std::make_unique<juce::AudioParameterChoice>(
+            juce::ParameterID { ParameterIds::windowMode, 1 },
+            ParameterIds::windowMode,
+            juce::StringArray{"Symmetric", "Low Latency"},
+            0
+            ));
+
+    group->addChild(
+        std::make_unique<juce::AudioParameterBool>(
+            juce::ParameterID { ParameterIds::multiResolution, 1 },
+            ParameterIds::multiResolution,
+            false));
+
+    group->addChild(
+        std::make_unique<juce::AudioParameterChoice>(
+            juce::ParameterID { ParameterIds::engine, 1 },
+            ParameterIds::engine,
+            juce::StringArray{"Phase Vocoder", "PSOLA"},
+            0
+            ));
+
+    // ハーモナイザー。Phase Vocoder のときだけ有効で、1 回の解析から複数のボイスを合成する
+    group->addChild(
+        std::make_unique<juce::AudioParameterInt>(
+            juce::ParameterID { ParameterIds::numVoices, 1 },
+            ParameterIds::numVoices,
+            1, SpectralEngineBase::kMaxVoices, 1, ""));
+
+    // 推定した基本周波数を平均律の音高に補正する。Pitch と各ボイスのピッチは補正後の音高に対して適用される
+    group->addChild(
+        std::make_unique<juce::AudioParameterBool>(
+            juce::ParameterID { ParameterIds::pitchCorrection, 1 },
+            ParameterIds::pitchCorrection,
+            false));
+
+    // 処理が間に合わないときに、オーバーラップ数と FFT サイズを一時的に下げる
+    group->addChild(
+        std::make_unique<juce::AudioParameterBool>(
+            juce::ParameterID { ParameterIds::cpuGovernor, 1 },
+            ParameterIds::cpuGovernor,
+            false));
+
+    // デフォルトでは長三度・完全五度・オクターブ上に設定しておく
+    float const harmonyPitchDefaults[] = { 400.0f / 12.0f, 700.0f / 12.0f, 100.0f };
+    for(int v = 0; v < SpectralEngineBase::kMaxVoices - 1; ++v) {
+        group->addChild(
+            std::make_unique<juce::AudioParameterFloat>(
+                juce::ParameterID { ParameterIds::harmonyPitches[v], 1 },
+                ParameterIds::harmonyPitches[v],
+                juce::NormalisableRange<float>{-100.0f, 100.0f},
+                harmonyPitchDefaults[v],
+                "%",
+                juce::AudioProcessorParameter::genericParameter,
+                [](float value, int /*maxLength*/) {
+                    return juce::String(value, 0);
+                },
+                nullptr));
+
+        group->addChild(
+            std::make_unique<juce::AudioParameterFloat>(
+                juce::ParameterID { ParameterIds::harmonyFormants[v], 1 },
+                ParameterIds::harmonyFormants[v],
+                juce::NormalisableRange<float>{-100.0f, 100.0f},
+                0.0f,
+                "%",
+                juce::AudioProcessorParameter::genericParameter,
+                [](float value, int /*maxLength*/) {
+                    return juce::String(value, 2);
+                },
+                nullptr));
+    }
+
     return juce::AudioProcessorValueTreeState::ParameterLayout(std::move(group));
 }
 
 void PluginAudioProcessor::audioProcessorParameterChanged(juce::AudioProcessor *processor, int parameterIndex, float newValue)
 {
     auto const changedParam = getParameters()[parameterIndex];
-    auto const fftParamChanged = changedParam == _apvts.getParameter(ParameterIds::fftSize);
-    auto const overlapParamChanged = changedParam == _apvts.getParameter(ParameterIds::overlapCount);
-    if(fftParamChanged || overlapParamChanged) {
-        std::unique_lock lock(_processLock);
-        prepareToPlay(getSampleRate(), getBlockSize());
+    auto const needsReconfigure = std::find(_reconfigureParameters.begin(), _reconfigureParameters.end(), changedParam) != _reconfigureParameters.end();
+    if(needsReconfigure) {
+        // この関数はオートメーションによってオーディオスレッドから呼ばれることもあるので、ここではエンジンを作り直さない。
+        // フラグを立てるだけにして、バックグラウンドスレッドで新しいエンジンを構築する
+        _reconfigureRequested = true;
     }
 }
 
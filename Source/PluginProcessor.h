@@ -1,10 +1,22 @@
 #pragma once
 
 #include "Prefix.h"
+#include "FFTDefines.h"
 #include "RingBuffer.h"
 #include "AudioBufferUtil.h"
 #include "ReferenceableArray.h"
+#include "SpectralEngine.h"
+#include "SpectrumDisplay.h"
+#include "EngineState.h"
+#include "ParameterSnapshot.h"
+#include "CpuGovernor.h"
+#include "DeadlineMonitor.h"
+#include "NumericalHealth.h"
+#include "TripleBuffer.h"
+#include "Profiler.h"
+#include "RealtimeChecker.h"
 #include <cassert>
+#include <type_traits>
 
 NS_HWM_BEGIN
 
@@ -13,10 +25,32 @@ struct Defines {
     inline static constexpr float outputGainMax = 6.0f;
     inline static constexpr float outputGainDefault = 0.0f;
     inline static constexpr float outputGainSilent = -47.9f;
+
+    //! 内部バッファを確保するときのブロックサイズの下限
+    inline static constexpr int minimumMaxBlockSize = 512;
+
+    //! UI に渡すデータの最大サイズ。UI 用のバッファはコンストラクタで一度だけ確保し、以降は確保し直さない
+    inline static constexpr int maxNumChannels = 2;
+    inline static constexpr int scopeBufferSize = 8192;
+
+    /** 設定を変更したときに、古いエンジンから新しいエンジンへクロスフェードする時間
+     *
+     *  新しいエンジンは、構築した直後の自身のレイテンシーの間は無音を出力する。
+     *  そのため、差し替えたあとはまず新しいエンジンにレイテンシーの分だけ入力を処理させ、その間は古いエンジンの出力だけを使う。
+     *  クロスフェードはそのあとに始め、同時に新しいエンジンのレイテンシーをホストに報告する。
+     *
+     *  新旧のエンジンのレイテンシーが異なるときも、遅延を揃えずにそのままクロスフェードする。
+     *  そのため、クロスフェードの間はレイテンシーの差の分だけずれた信号が重なり、櫛形フィルタのような音色の変化が短く聞こえる。
+     */
+    inline static constexpr double engineCrossfadeSeconds = 0.03;
 };
 
 struct ParameterIds
 {
+    /** FFT サイズの選択肢を増やしたあとも、ホストのオートメーションやコントローラーの割り当てを保つために ID は変えていない。
+     *  選択肢の並びは FFTDefines::fftSizes を参照。
+     *  2 の累乗だけの選択肢のときに保存された状態は、setStateInformation() で新しい選択肢のインデックスに読み替える
+     */
     inline static const juce::String fftSize = "FFT Size";
     inline static const juce::String overlapCount = "Overlap Count";
     inline static const juce::String formant = "Formant";
@@ -24,11 +58,28 @@ struct ParameterIds
     inline static const juce::String envelopeOrder = "Envelope Order";
     inline static const juce::String dryWetRate = "Dry/Wet";
     inline static const juce::String outputGain = "Output Gain";
+    inline static const juce::String stereoLink = "Stereo Link";
+    inline static const juce::String latencyMode = "Latency Mode";
+    inline static const juce::String windowMode = "Window Mode";
+    inline static const juce::String multiResolution = "Multi Resolution";
+    inline static const juce::String engine = "Engine";
+    inline static const juce::String numVoices = "Voices";
+    inline static const juce::String pitchCorrection = "Pitch Correction";
+    inline static const juce::String cpuGovernor = "CPU Governor";
+
+    //! ハーモナイザーの 2 つ目以降のボイスのパラメータ。1 つ目のボイスには pitch / formant を使用する
+    inline static const std::array<juce::String, SpectralEngineBase::kMaxVoices - 1> harmonyPitches {
+        "Voice 2 Pitch", "Voice 3 Pitch", "Voice 4 Pitch"
+    };
+    inline static const std::array<juce::String, SpectralEngineBase::kMaxVoices - 1> harmonyFormants {
+        "Voice 2 Formant", "Voice 3 Formant", "Voice 4 Formant"
+    };
 };
 
 class PluginAudioProcessor
 :   public juce::AudioProcessor
 ,   public juce::AudioProcessorListener
+,   private juce::AsyncUpdater
 {
 public:
     //==============================================================================
@@ -44,6 +95,15 @@ public:
    #endif
 
     void processBlock (juce::AudioBuffer<float>&, juce::MidiBuffer&) override;
+    void processBlock (juce::AudioBuffer<double>&, juce::MidiBuffer&) override;
+
+    /** ホストの double のバッファを float に変換せずに受け取れる。どちらの精度を使うかは prepareToPlay の時点の isUsingDoublePrecision() で決まる
+     *
+     *  double で処理するのは入出力のリングバッファ・窓掛け・ゲインの補正・オーバーラップ加算・帯域分割・Dry/Wet とクロスフェードで、
+     *  FFT・スペクトル包絡の推定・Phase Vocoder は double のときも float で処理する。
+     *  そのため、double にしてもピッチシフトとフォルマントシフトの精度は float のときと変わらない
+     */
+    bool supportsDoublePrecisionProcessing() const override { return true; }
 
     //==============================================================================
     juce::AudioProcessorEditor* createEditor() override;
@@ -70,132 +130,275 @@ public:
 
     void getBufferDataForUI(juce::AudioSampleBuffer &buf);
 
-    struct SpectrumData
+    /** オシロスコープ用のデータを取得するかどうかを設定する (メッセージスレッドから呼び出す)
+     *
+     *  false のときは、オーディオスレッドはオシロスコープ用のリングバッファに書き込まない。
+     */
+    void setScopeSubscribed(bool subscribed);
+
+    using SpectrumData = hwm::SpectrumData;
+
+    /** UI に表示するスペクトルのグラフとチャンネルを設定する (メッセージスレッドから呼び出す)
+     *
+     *  空のマスクを渡すと、オーディオスレッドはスペクトル表示用のデータを一切コピーしない。
+     *  エディタを開いているときだけ、表示しているグラフを指定すること。
+     */
+    void setSpectrumSubscription(SpectrumCaptureMask mask);
+
+    /** 表示用に間引いたスペクトルを取得する (メッセージスレッドから呼び出す)
+     *
+     *  setSpectrumSubscription() で指定したグラフのうち、0 番目のチャンネルのデータを返す。
+     *  @return 前回から新しいデータを取得したかどうか。false のときは buf を変更しない
+     */
+    bool getSpectrumDisplayForUI(SpectrumDisplayData &buf);
+
+    //! 実際に処理に使用している設定 (UI 表示用)
+    struct EngineStatus
     {
-        // オリジナルの対数振幅スペクトル
-        ReferenceableArray<ComplexType> _originalSpectrum;
-        // ピッチシフト後のスペクトル
-        ReferenceableArray<ComplexType> _shiftedSpectrum;
-        // 合成用のスペクトル
-        ReferenceableArray<ComplexType> _synthesisSpectrum;
-
-        // オリジナルのケプストラム
-        ReferenceableArray<ComplexType> _originalCepstrum;
-        // スペクトル包絡
-        ReferenceableArray<ComplexType> _envelope;
-        // 微細構造
-        ReferenceableArray<ComplexType> _fineStructure;
-
-        void resize(int n)
-        {
-            _originalSpectrum.resize(n);
-            _shiftedSpectrum.resize(n);
-            _synthesisSpectrum.resize(n);
-            _originalCepstrum.resize(n);
-            _envelope.resize(n);
-            _fineStructure.resize(n);
-        }
+        int _fftSize = 0;
+        int _overlapCount = 0;
+        int _governorLevel = 0;     //!< CPU Governor が品質を下げている段階。0 のときはユーザーが選択した設定のまま
+        float _load = 0;            //!< 処理時間とブロックの長さの比
+    };
 
-        void clear()
-        {
-            _originalSpectrum.fill(ComplexType{});
-            _shiftedSpectrum.fill(ComplexType{});
-            _synthesisSpectrum.fill(ComplexType{});
-            _originalCepstrum.fill(ComplexType{});
-            _envelope.fill(ComplexType{});
-            _fineStructure.fill(ComplexType{});
-        }
+    EngineStatus getEngineStatusForUI() const;
 
-        void copyFrom(SpectrumData const &src)
-        {
-            auto const copyImpl = [](auto & destArray, auto const & srcArray) {
-                assert(destArray.size() == srcArray.size());
-                std::copy_n(srcArray.data(), srcArray.size(), destArray.data());
-            };
-
-            copyImpl(_originalSpectrum, src._originalSpectrum);
-            copyImpl(_shiftedSpectrum, src._shiftedSpectrum);
-            copyImpl(_synthesisSpectrum, src._synthesisSpectrum);
-            copyImpl(_originalCepstrum, src._originalCepstrum);
-            copyImpl(_envelope, src._envelope);
-            copyImpl(_fineStructure, src._fineStructure);
-        }
-    };
+    //! processBlock の処理時間とブロックの長さの比の集計 (UI 表示用)
+    DeadlineMonitor::Statistics getDeadlineStatisticsForUI() const;
+
+    //! 処理時間の集計をリセットする (メッセージスレッドから呼び出す)
+    void resetDeadlineStatistics();
+
+    //! 段階ごとの NaN / Inf / 非正規化数 / 上限を超える値の検出回数と、状態をリセットした回数 (UI 表示用)
+    NumericalHealth::Report getNumericalHealthForUI() const;
+
+    //! 数値の異常の集計をリセットする (メッセージスレッドから呼び出す)
+    void resetNumericalHealth();
 
-    void getSpectrumDataForUI(ReferenceableArray<SpectrumData> &buf);
+    /** 処理の段階ごとの計測結果の記録先
+     *
+     *  HWM_ENABLE_PROFILER が 0 のときは計測を行わないので、nullptr を返す。
+     */
+    Profiler * getProfiler();
+
+    /** 記録済みの計測結果を Chrome の Trace Event Format の JSON として file に書き出す (メッセージスレッドから呼び出す)
+     *
+     *  @return 書き出したかどうか。計測が無効のときは false
+     */
+    bool writeProfileTrace(juce::File const &file) const;
+
+    /** 記録済みの計測結果を、段階・FFT サイズ・オーバーラップ数ごとに集計した JSON として file に書き出す (メッセージスレッドから呼び出す)
+     *
+     *  HWM_ENABLE_PERF_COUNTERS が有効なときは、ハードウェアカウンタの集計も含める。
+     *  @return 書き出したかどうか。計測が無効のときは false
+     */
+    bool writeProfileSummary(juce::File const &file) const;
 
     juce::AudioParameterFloat * getFormantParameter();
     juce::AudioParameterFloat * getPitchParameter();
 
 private:
     juce::AudioProcessorValueTreeState _apvts;
+    RealtimeParameters _realtimeParameters;
 
     using RingBufferType = RingBuffer<float>;
 
-    int _fftOrder = 0;
-    int _overlapCount = 0;
-    int getFFTSize() const { return 1 << _fftOrder; }
-    int getOverlapSize() const { return getFFTSize() / _overlapCount; }
-
-    ReferenceableArray<ComplexType> _signalBuffer;
-    ReferenceableArray<ComplexType> _frequencyBuffer;
-    ReferenceableArray<ComplexType> _cepstrumBuffer;
-    ReferenceableArray<ComplexType> _tmpFFTBuffer;
-    ReferenceableArray<ComplexType> _tmpFFTBuffer2;
-    ReferenceableArray<float> _tmpPhaseBuffer;
-    std::unique_ptr<juce::dsp::FFT> _fft;
-    ReferenceableArray<float> _window;
-    juce::AudioSampleBuffer _prevInputPhases;
-    juce::AudioSampleBuffer _prevOutputPhases;
-    ReferenceableArray<double> _analysisMagnitude;
-    ReferenceableArray<double> _synthesizeMagnitude;
-    ReferenceableArray<double> _analysisFrequencies;
-    ReferenceableArray<double> _synthesizeFrequencies;
-
-    RingBufferType _inputRingBuffer;
-    ReferenceableArray<RingBufferType::ConstBufferInfo> _bufferInfoList;
-    RingBufferType _outputRingBuffer;
-
-    juce::AudioSampleBuffer _tmpBuffer;
-    juce::AudioSampleBuffer _wetBuffer;
-
-    std::mutex _mtxUIData;
-    RingBufferType _uiRingBuffer;
+    int _maxBlockSize = 0; // 内部バッファを確保したブロックサイズ。processBlock はこのサイズ以下に分割して処理する
+    int _hostBlockSize = 0; // ホストが prepareToPlay で指定したブロックサイズ。Standard モードのレイテンシーはこのサイズで決まる
+
+    /*  エンジンの差し替え
+     *
+     *  _currentState と _fadingState はオーディオスレッドだけが (prepareToPlay の中ではメッセージスレッドが) 触る。
+     *  バックグラウンドスレッドは新しい EngineState を構築して _pendingState に置き、
+     *  オーディオスレッドはそれを受け取って、新しいエンジンがレイテンシーの分の入力を処理し終えてから
+     *  _fadingState (古いエンジン) からクロスフェードする。
+     *  クロスフェードを終えた古いエンジンは _retiredStates に入れて、バックグラウンドスレッドで解放する。
+     */
+    std::unique_ptr<EngineState> _currentState;
+    std::unique_ptr<EngineState> _fadingState;
+    std::atomic<EngineState *> _pendingState { nullptr };
+
+    inline static constexpr int kMaxRetiredStates = 8;
+    std::array<EngineState *, kMaxRetiredStates> _retiredStates {};
+    juce::AbstractFifo _retiredStatesFifo { kMaxRetiredStates };
+
+   #if HWM_ENABLE_PROFILER
+    Profiler _profiler;
+   #endif
 
-    ReferenceableArray<SpectrumData> _spectrums;
-    ReferenceableArray<SpectrumData> _tmpSpectrums; // DSP 中に mutex をロックしないでデータを書き込んでおくためのバッファ
+    // 常に有効な処理時間の集計。プロファイラと違って、段階ごとではなくコールバック全体だけを計測する
+    DeadlineMonitor _deadlineMonitor;
+
+    // 常に有効な数値の異常の集計。SpectralEngine が書き込み、ReconfigureThread が新しい異常をホストのログに書き出す
+    NumericalHealth _numericalHealth;
+    std::atomic<juce::uint64> _loggedHealthEvents { 0 };
+    juce::uint32 _lastHealthLogTime = 0;    // ReconfigureThread だけが触る
+    inline static constexpr juce::uint32 kHealthLogIntervalMs = 1000;
+
+    // クロスフェード中に古いエンジンで処理するためのバッファ。ホストの処理精度に合わせて一方だけを確保する
+    juce::AudioBuffer<float> _crossfadeBuffer;
+    juce::AudioBuffer<double> _doubleCrossfadeBuffer;
+    int _crossfadeLength = 0;
+    int _crossfadePosition = 0;
+    int _warmupRemaining = 0;   // 新しいエンジンがレイテンシーの分の入力を処理し終えて、クロスフェードを始めるまでの残りのサンプル数
+
+    // バックグラウンドスレッドでエンジンを構築するときの設定。_stateMutex で保護する
+    std::mutex _stateMutex;
+    double _preparedSampleRate = 0;
+    bool _prepared = false;
+    std::atomic<bool> _reconfigureRequested { false };
+
+    // 変更されたときにエンジンを作り直す必要があるパラメータ
+    std::array<juce::AudioProcessorParameter *, 7> _reconfigureParameters {};
+
+    /*  CPU Governor
+     *
+     *  オーディオスレッドがコールバックの処理時間を測って段階を決め、変更があれば _reconfigureRequested を立てる。
+     *  バックグラウンドスレッドは getEngineConfig() で段階を適用した設定のエンジンを構築し、通常の設定変更と同じくクロスフェードで差し替える。
+     */
+    CpuGovernor _cpuGovernor;
+    std::atomic<float> *_cpuGovernorEnabled = nullptr;
+    std::atomic<float> *_fftSizeIndex = nullptr;
+    std::atomic<float> *_overlapCountIndex = nullptr;
+
+    // 動作中のエンジンの設定 (UI 表示とプロファイラ用)。オーディオスレッドがエンジンを差し替えたときに更新する
+    std::atomic<int> _effectiveFFTSize { 0 };
+    std::atomic<int> _effectiveOverlapCount { 0 };
+
+    /*  ホストに報告するレイテンシー
+     *
+     *  オーディオスレッドが差し替えた新しいエンジンからクロスフェードを始めるときに、
+     *  そのエンジンのレイテンシーを _activeLatency に書き込んで _latencyChanged を立てる。
+     *  オーディオスレッドからはメッセージを送れないので、ReconfigureThread がフラグを見て triggerAsyncUpdate() を呼び出し、
+     *  メッセージスレッドの handleAsyncUpdate() で setLatencySamples() を呼び出す。
+     */
+    std::atomic<int> _activeLatency { 0 };
+    std::atomic<bool> _latencyChanged { false };
+
+    //! ユーザーが選択した FFT サイズとオーバーラップ数 (オーディオスレッドからも呼び出せる)
+    CpuGovernor::Settings getRequestedSettings() const;
+
+    struct ReconfigureThread : public juce::Thread
+    {
+        explicit ReconfigureThread(PluginAudioProcessor &owner)
+        :   juce::Thread("Reconfigure Thread")
+        ,   _owner(owner)
+        {}
 
-    void processAudioBlock();
-    static juce::AudioProcessorValueTreeState::ParameterLayout createParameterLayout();
+        void run() override;
 
-    struct ProcessLock {
-        void lock() {
-            for( ; ; ) {
-                if(try_lock()) {
-                    return;
-                }
-            }
-        }
+    private:
+        PluginAudioProcessor &_owner;
+    };
 
-        bool try_lock() {
-            bool expected = false;
-            return _lock.compare_exchange_strong(expected, true);
-        }
+    ReconfigureThread _reconfigureThread { *this };
 
-        void unlock()
-        {
-            _lock.exchange(false);
-        }
+    //! 現在のパラメータから EngineState の設定を作る
+    EngineState::Config getEngineConfig(double sampleRate);
+
+    //! オーディオスレッドから呼び出して、構築済みの新しいエンジンがあれば差し替える
+    void acceptPendingState();
+
+    //! 動作中のエンジン (_currentState) の設定とレイテンシーを公開する
+    void publishActiveState();
+
+    //! オーディオスレッドが差し替えたエンジンのレイテンシーをホストに報告する
+    void handleAsyncUpdate() override;
+
+    //! 使い終わったエンジンを解放待ちのキューに入れる (オーディオスレッドから呼び出す)
+    void retireState(std::unique_ptr<EngineState> state);
+
+    //! 解放待ちのエンジンを解放する。_stateMutex をロックした状態で呼び出す
+    void deleteRetiredStates();
+
+    //! バックグラウンドスレッドで新しいエンジンを構築して、オーディオスレッドに渡す
+    void rebuildState();
+
+    // オシロスコープ用のデータ。オーディオスレッドが書き込み、メッセージスレッドが読み込む SPSC のリングバッファとして使用する
+    RingBufferType _uiRingBuffer;
+    std::atomic<bool> _scopeSubscribed { false };
+
+    // スペクトル表示用のデータ。オーディオスレッドが書き込んだ最新のスナップショットを、ロックを取らずに UI に渡す
+    struct SpectrumSnapshot
+    {
+        int _fftSize = 0;
+        double _sampleRate = 0;
+        SpectrumCaptureMask _capture; //!< このスナップショットに書き込んだグラフとチャンネル
+        ReferenceableArray<SpectrumData> _channels;
+    };
+    TripleBuffer<SpectrumSnapshot> _spectrumExchange;
+
+    /*  UI が表示しているグラフとチャンネル (SpectrumCaptureMask::pack() した値)
+     *
+     *  スナップショットの配列は、初めて要求されたグラフの分だけメッセージスレッドで確保してから、このマスクを公開する。
+     *  オーディオスレッドはマスクに含まれるグラフにしかアクセスしないので、確保と書き込みが競合することはない。
+     *  確保した配列は、動作中は解放しない。
+     */
+    std::atomic<juce::uint64> _spectrumSubscription { 0 };
+    juce::uint32 _allocatedSnapshotGraphs = 0; // メッセージスレッドだけが触る
+
+    /*  スペクトルの表示用の間引き
+     *
+     *  _spectrumExchange の読み込み側は低優先度の DisplayReductionThread で、
+     *  受け取ったスナップショットを対数周波数の表示点にまとめてから、_displayExchange で UI に渡す。
+     */
+    TripleBuffer<SpectrumDisplayData> _displayExchange;
+    SpectrumDisplayReducer _displayReducer; // DisplayReductionThread だけが触る
+
+    struct DisplayReductionThread : public juce::Thread
+    {
+        explicit DisplayReductionThread(PluginAudioProcessor &owner)
+        :   juce::Thread("Display Reduction Thread")
+        ,   _owner(owner)
+        {}
+
+        void run() override;
 
     private:
-        std::atomic<bool> _lock = false;
+        PluginAudioProcessor &_owner;
     };
 
-    ProcessLock _processLock;
+    DisplayReductionThread _displayReductionThread { *this };
+
+    //! float と double の processBlock の共通の処理
+    template<class SampleType>
+    void processBlockImpl(juce::AudioBuffer<SampleType> &buffer);
+
+    //! _maxBlockSize 以下のブロックを処理する
+    template<class SampleType>
+    void processSubBlock(juce::AudioBuffer<SampleType> &buffer,
+                         SpectralEngineBase::FrameParameters const &params,
+                         GainRamp dryLevel,
+                         GainRamp wetLevel);
+
+    template<class SampleType>
+    juce::AudioBuffer<SampleType> & getCrossfadeBuffer()
+    {
+        if constexpr(std::is_same_v<SampleType, double>) {
+            return _doubleCrossfadeBuffer;
+        } else {
+            return _crossfadeBuffer;
+        }
+    }
+
+    //! コールバックの処理時間を CPU Governor に渡して、段階が変わったらエンジンの再構築を要求する
+    void updateCpuGovernor(juce::int64 elapsedTicks, int numSamples);
+
+    //! 前回から出力を壊すおそれがある数値の異常が増えていれば、集計をログに書き出す (ReconfigureThread から呼び出す)
+    void logNumericalHealth();
+
+    //! 表示用のエンジンのスペクトルのうち、capture に含まれるものを UI に渡す
+    void publishSpectrums(SpectrumCaptureMask capture);
+
+    LatencyMode getLatencyMode();
+    WindowMode getWindowMode();
+    bool isMultiResolutionEnabled();
+    EngineType getEngineType();
+
+    static juce::AudioProcessorValueTreeState::ParameterLayout createParameterLayout();
 
-    // 変換した信号の音量が変わってしまうのを補正するための係数。
-    // 毎回の解析でこれをやると音量の変化が大きくなりすぎることがあるのでスムーズに変換するようにしている。
-    juce::SmoothedValue<float, juce::ValueSmoothingTypes::Linear> _smoothedGain;
+    //! 2 の累乗だけの選択肢のときに保存された FFT サイズのインデックスを、新しい選択肢のインデックスに書き換える
+    static void migrateLegacyFFTSize(juce::XmlElement &state);
 
     void audioProcessorParameterChanged(juce::AudioProcessor *processor, int parameterIndex, float newValue) override;
     void audioProcessorChanged(juce::AudioProcessor *processor, const juce::AudioProcessor::ChangeDetails &details) override;
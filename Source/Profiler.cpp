@@ -0,0 +1,207 @@
+#include "Profiler.h"
+#include <algorithm>
+#include <map>
+#include <tuple>
+
+NS_HWM_BEGIN
+
+#if HWM_ENABLE_PERF_COUNTERS
+//! ハードウェアカウンタの値を、JSON のオブジェクトのメンバーとして書き出す
+static void writeCounters(juce::OutputStream &stream, PerfCounterValues const &counters, double scale)
+{
+    for(int i = 0; i < PerfCounters::kNumCounters; ++i) {
+        stream << ",\"" << PerfCounters::getCounterName((PerfCounter)i) << "\":" << counters._values[(std::size_t)i] * scale;
+    }
+}
+#endif
+
+void Profiler::copyEvents(std::vector<Event> &dest) const
+{
+    dest.clear();
+
+    auto const end = _writeCount.load(std::memory_order_acquire);
+    auto const begin = std::max<juce::int64>(0, end - kCapacity);
+
+    dest.reserve((std::size_t)(end - begin));
+    for(auto i = begin; i < end; ++i) {
+        dest.push_back(_events[(std::size_t)(i % kCapacity)]);
+    }
+
+    // コピーしている間にオーディオスレッドが上書きした可能性がある、先頭のイベントを捨てる。
+    // 書き込み中のイベント (インデックスが _writeCount のもの) は、_writeCount を更新する前に
+    // インデックスが _writeCount - kCapacity の位置を上書きしているので、その 1 つも捨てる
+    auto const overwrittenEnd = _writeCount.load(std::memory_order_acquire) - kCapacity + 1;
+    if(overwrittenEnd > begin) {
+        auto const numOverwritten = (std::size_t)std::min<juce::int64>(overwrittenEnd - begin, (juce::int64)dest.size());
+        dest.erase(dest.begin(), dest.begin() + (std::ptrdiff_t)numOverwritten);
+    }
+}
+
+bool Profiler::writeChromeTrace(juce::OutputStream &stream) const
+{
+    std::vector<Event> events;
+    copyEvents(events);
+
+    // chrome://tracing や Perfetto で開ける形式。時刻はマイクロ秒で、最も早く始まったイベントを 0 にする。
+    // イベントはスコープを抜けたときに記録されるので、先頭のイベントは内側の段階で、外側の段階より後に始まっている
+    auto const origin = events.empty() ? 0 : std::min_element(events.begin(), events.end(), [](Event const &a, Event const &b) {
+        return a._startTicks < b._startTicks;
+    })->_startTicks;
+    auto const toMicroseconds = [](juce::int64 ticks) {
+        return juce::Time::highResolutionTicksToSeconds(ticks) * 1.0e6;
+    };
+
+    stream << "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[";
+
+    for(std::size_t i = 0; i < events.size(); ++i) {
+        auto const &e = events[i];
+        if(i != 0) { stream << ","; }
+
+        stream << "\n{\"name\":\"" << getStageName(e._stage) << "\""
+               << ",\"cat\":\"dsp\",\"ph\":\"X\",\"pid\":1,\"tid\":1"
+               << ",\"ts\":" << toMicroseconds(e._startTicks - origin)
+               << ",\"dur\":" << toMicroseconds(e._endTicks - e._startTicks)
+               << ",\"args\":{\"fftSize\":" << e._fftSize
+               << ",\"overlapCount\":" << e._overlapCount;
+       #if HWM_ENABLE_PERF_COUNTERS
+        writeCounters(stream, e._counters, 1.0);
+       #endif
+        stream << "}}";
+    }
+
+    stream << "\n]}\n";
+    stream.flush();
+    return true;
+}
+
+bool Profiler::writeChromeTrace(juce::File const &file) const
+{
+    auto stream = file.createOutputStream();
+    if(stream == nullptr || stream->openedOk() == false) {
+        return false;
+    }
+
+    stream->setPosition(0);
+    stream->truncate();
+    return writeChromeTrace(*stream);
+}
+
+void Profiler::summarize(std::vector<StageSummary> &dest) const
+{
+    std::vector<Event> events;
+    copyEvents(events);
+
+    // 段階・FFT サイズ・オーバーラップ数の順に並べる
+    std::map<std::tuple<int, int, int>, StageSummary> summaries;
+    for(auto const &e: events) {
+        auto &s = summaries[std::make_tuple((int)e._stage, e._fftSize, e._overlapCount)];
+        s._stage = e._stage;
+        s._fftSize = e._fftSize;
+        s._overlapCount = e._overlapCount;
+
+        auto const seconds = juce::Time::highResolutionTicksToSeconds(e._endTicks - e._startTicks);
+        s._numEvents += 1;
+        s._totalSeconds += seconds;
+        s._maxSeconds = std::max(s._maxSeconds, seconds);
+        s._counters += e._counters;
+    }
+
+    dest.clear();
+    dest.reserve(summaries.size());
+    for(auto const &entry: summaries) {
+        dest.push_back(entry.second);
+    }
+}
+
+bool Profiler::writeSummary(juce::OutputStream &stream) const
+{
+    std::vector<StageSummary> summaries;
+    summarize(summaries);
+
+    // カウンタを開けなかったときは値がすべて 0 になるので、読み出せたかどうかを値から判断する
+    auto const hasCounters = std::any_of(summaries.begin(), summaries.end(), [](StageSummary const &s) {
+        return s._counters.get(PerfCounter::kCycles) != 0 || s._counters.get(PerfCounter::kInstructions) != 0;
+    });
+
+    // カウンタの値が欠けているときは、その理由も書き出す
+    auto counterStatus = PerfCounters::getStatusMessage();
+    if(hasCounters == false && counterStatus.isEmpty()) {
+        counterStatus = "no profiled events were recorded";
+    }
+
+    stream << "{\"hardwareCounters\":" << (hasCounters ? "true" : "false");
+    if(counterStatus.isNotEmpty()) {
+        stream << ",\"hardwareCountersStatus\":\"" << counterStatus << "\"";
+        juce::Logger::writeToLog("Profiler: " + counterStatus);
+    }
+
+    stream << ",\"stages\":[";
+
+    for(std::size_t i = 0; i < summaries.size(); ++i) {
+        auto const &s = summaries[i];
+        if(i != 0) { stream << ","; }
+
+        stream << "\n{\"name\":\"" << getStageName(s._stage) << "\""
+               << ",\"fftSize\":" << s._fftSize
+               << ",\"overlapCount\":" << s._overlapCount
+               << ",\"count\":" << s._numEvents
+               << ",\"meanMicroseconds\":" << s._totalSeconds * 1.0e6 / s._numEvents
+               << ",\"maxMicroseconds\":" << s._maxSeconds * 1.0e6;
+
+       #if HWM_ENABLE_PERF_COUNTERS
+        // カウンタはイベントあたりの平均にする
+        writeCounters(stream, s._counters, 1.0 / s._numEvents);
+
+        auto const cycles = (double)s._counters.get(PerfCounter::kCycles);
+        auto const instructions = (double)s._counters.get(PerfCounter::kInstructions);
+        auto const perKiloInstructions = [&](PerfCounter counter) {
+            return (instructions > 0) ? s._counters.get(counter) * 1000.0 / instructions : 0.0;
+        };
+
+        stream << ",\"ipc\":" << ((cycles > 0) ? instructions / cycles : 0.0)
+               << ",\"l1dMpki\":" << perKiloInstructions(PerfCounter::kL1DMisses)
+               << ",\"llcAccessPki\":" << perKiloInstructions(PerfCounter::kLLCAccesses)
+               << ",\"llcMpki\":" << perKiloInstructions(PerfCounter::kLLCMisses)
+               << ",\"branchMpki\":" << perKiloInstructions(PerfCounter::kBranchMisses);
+       #endif
+
+        stream << "}";
+    }
+
+    stream << "\n]}\n";
+    stream.flush();
+    return true;
+}
+
+bool Profiler::writeSummary(juce::File const &file) const
+{
+    auto stream = file.createOutputStream();
+    if(stream == nullptr || stream->openedOk() == false) {
+        return false;
+    }
+
+    stream->setPosition(0);
+    stream->truncate();
+    return writeSummary(*stream);
+}
+
+char const * Profiler::getStageName(ProfileStage stage)
+{
+    switch(stage) {
+        case ProfileStage::kProcessBlock:   return "processBlock";
+        case ProfileStage::kFrame:          return "frame";
+        case ProfileStage::kFraming:        return "framing";
+        case ProfileStage::kForwardFFT:     return "forwardFFT";
+        case ProfileStage::kEnvelope:       return "envelopeCepstrum";
+        case ProfileStage::kFormantShift:   return "formantShift";
+        case ProfileStage::kAnalysis:       return "vocoderAnalysis";
+        case ProfileStage::kSynthesis:      return "vocoderSynthesis";
+        case ProfileStage::kFineStructure:  return "fineStructureCepstrum";
+        case ProfileStage::kRecombine:      return "recombine";
+        case ProfileStage::kInverseFFT:     return "inverseFFT";
+        case ProfileStage::kOverlapAdd:     return "overlapAdd";
+        default:                            return "unknown";
+    }
+}
+
+NS_HWM_END
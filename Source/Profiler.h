@@ -0,0 +1,165 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <vector>
+#include "Prefix.h"
+#include "PerfCounters.h"
+
+// 処理の段階ごとの時間を計測するかどうか。CMake の FORMANT_AND_PITCH_ENABLE_PROFILER で有効にする
+#ifndef HWM_ENABLE_PROFILER
+#define HWM_ENABLE_PROFILER 0
+#endif
+
+NS_HWM_BEGIN
+
+//! 計測する処理の段階
+enum class ProfileStage {
+    kProcessBlock,      //!< PluginAudioProcessor::processBlock 全体
+    kFrame,             //!< SpectralEngine の 1 フレーム (全チャンネル) の処理
+    kFraming,           //!< 入力リングバッファからの読み込みと窓掛け
+    kForwardFFT,
+    kEnvelope,          //!< ケプストラムによるスペクトル包絡の計算
+    kFormantShift,
+    kAnalysis,          //!< Phase Vocoder の振幅と瞬時周波数の解析
+    kSynthesis,         //!< Phase Vocoder のピッチシフトした位相の合成
+    kFineStructure,     //!< ケプストラムによる微細構造の抽出
+    kRecombine,         //!< スペクトル包絡と微細構造の再結合
+    kInverseFFT,
+    kOverlapAdd,
+    kNumStages,
+};
+
+/** 処理の段階ごとの計測結果を保持するバッファ
+ *
+ *  プラグインのインスタンスごとに 1 つ持ち、オーディオスレッドだけが record() で書き込む。
+ *  固定長のリングバッファで、古いイベントから上書きする。書き込みはロックもメモリの確保も行わない。
+ *  読み込み側 (copyEvents) は書き込み位置を前後 2 回読んで、コピーしている間に上書きされた可能性があるイベントを捨てる。
+ */
+class Profiler
+{
+public:
+    //! 保持するイベントの数。96kHz・64 サンプルのブロックでも、数秒分のイベントを残せる大きさにする
+    inline static constexpr int kCapacity = 1 << 16;
+
+    struct Event
+    {
+        juce::int64 _startTicks = 0;    //!< juce::Time::getHighResolutionTicks() の値
+        juce::int64 _endTicks = 0;
+        ProfileStage _stage = ProfileStage::kProcessBlock;
+        int _fftSize = 0;
+        int _overlapCount = 0;
+        PerfCounterValues _counters;    //!< スコープの間のハードウェアカウンタの増分。HWM_ENABLE_PERF_COUNTERS が 0 のときは常に 0
+    };
+
+    //! 段階・FFT サイズ・オーバーラップ数の組み合わせごとに、記録済みのイベントを集計したもの
+    struct StageSummary
+    {
+        ProfileStage _stage = ProfileStage::kProcessBlock;
+        int _fftSize = 0;
+        int _overlapCount = 0;
+        juce::int64 _numEvents = 0;
+        double _totalSeconds = 0;
+        double _maxSeconds = 0;
+        PerfCounterValues _counters;    //!< イベントのカウンタの増分の合計
+    };
+
+    //! オーディオスレッドから呼び出す
+    void record(Event const &event) noexcept
+    {
+        auto const index = _writeCount.load(std::memory_order_relaxed);
+        _events[(std::size_t)(index % kCapacity)] = event;
+        _writeCount.store(index + 1, std::memory_order_release);
+    }
+
+    //! 記録済みのイベントを古い順に dest にコピーする (オーディオスレッド以外から呼び出す)
+    void copyEvents(std::vector<Event> &dest) const;
+
+    //! 記録済みのイベントを Chrome の Trace Event Format の JSON として書き出す
+    bool writeChromeTrace(juce::OutputStream &stream) const;
+    bool writeChromeTrace(juce::File const &file) const;
+
+    //! 記録済みのイベントを、段階・FFT サイズ・オーバーラップ数の組み合わせごとに集計する (オーディオスレッド以外から呼び出す)
+    void summarize(std::vector<StageSummary> &dest) const;
+
+    /** summarize() の結果を JSON として書き出す
+     *
+     *  ハードウェアカウンタが有効なときは、イベントあたりの平均値と、IPC・1000 命令あたりのミスの数も書き出す。
+     *  処理時間だけでは分からない、計算とメモリアクセスのどちらが律速しているかの判断に使用する。
+     */
+    bool writeSummary(juce::OutputStream &stream) const;
+    bool writeSummary(juce::File const &file) const;
+
+    static char const * getStageName(ProfileStage stage);
+
+private:
+    std::array<Event, kCapacity> _events {};
+    std::atomic<juce::int64> _writeCount { 0 };
+};
+
+/** スコープの開始から終了までの時間を Profiler に記録する
+ *
+ *  profiler が nullptr のときは何もしない。通常は HWM_PROFILE_SCOPE マクロを通して使用する。
+ */
+class ScopedProfile
+{
+public:
+    ScopedProfile(Profiler *profiler, ProfileStage stage, int fftSize, int overlapCount) noexcept
+    :   _profiler(profiler)
+    {
+        if(_profiler == nullptr) { return; }
+
+        _event._stage = stage;
+        _event._fftSize = fftSize;
+        _event._overlapCount = overlapCount;
+
+       #if HWM_ENABLE_PERF_COUNTERS
+        _perfCounters = &PerfCounters::forCurrentThread();
+        _perfCounters->read(_startCounters);
+       #endif
+
+        _event._startTicks = juce::Time::getHighResolutionTicks();
+    }
+
+    ~ScopedProfile()
+    {
+        if(_profiler == nullptr) { return; }
+
+        _event._endTicks = juce::Time::getHighResolutionTicks();
+
+       #if HWM_ENABLE_PERF_COUNTERS
+        PerfCounterValues endCounters;
+        if(_perfCounters->read(endCounters)) {
+            // 多重化の補正で累積値が戻ることがあるので、負の増分は 0 にする
+            for(std::size_t i = 0; i < endCounters._values.size(); ++i) {
+                auto const start = _startCounters._values[i];
+                auto const end = endCounters._values[i];
+                _event._counters._values[i] = (end > start) ? end - start : 0;
+            }
+        }
+       #endif
+
+        _profiler->record(_event);
+    }
+
+    ScopedProfile(ScopedProfile const &) = delete;
+    ScopedProfile & operator=(ScopedProfile const &) = delete;
+
+private:
+    Profiler *_profiler = nullptr;
+    Profiler::Event _event;
+
+   #if HWM_ENABLE_PERF_COUNTERS
+    PerfCounters *_perfCounters = nullptr;
+    PerfCounterValues _startCounters;
+   #endif
+};
+
+#if HWM_ENABLE_PROFILER
+#define HWM_PROFILE_SCOPE(profiler, stage, fftSize, overlapCount) \
+    ::hwm::ScopedProfile JUCE_JOIN_MACRO(hwmProfileScope_, __LINE__) { (profiler), (stage), (fftSize), (overlapCount) }
+#else
+#define HWM_PROFILE_SCOPE(profiler, stage, fftSize, overlapCount)
+#endif
+
+NS_HWM_END
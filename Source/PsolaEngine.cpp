@@ -0,0 +1,345 @@
+#include "PsolaEngine.h"
+
+NS_HWM_BEGIN
+
+template<class SampleType>
+void PsolaEngine<SampleType>::prepare(Config const &config)
+{
+    _config = config;
+
+    auto const sampleRate = config._sampleRate;
+    auto const numChannels = config._numChannels;
+
+    _minPeriod = std::max(2, (int)std::floor(sampleRate / config._maxFrequency));
+    _maxPeriod = (int)std::ceil(sampleRate / config._minFrequency);
+    _unvoicedPeriod = (int)std::round(sampleRate * 0.005);
+    _latencySamples = (int)std::round(sampleRate * config._latencySeconds);
+
+    // ピッチを下げるとき (合成の周期が解析の周期より長いとき) は、隙間ができないようにグレインを広げる。
+    // ピッチの変更倍率の下限は 0.5 なので、グレインの半径は最大で 2 周期分になる。
+    _maxGrainRadius = _maxPeriod * 2;
+
+    // フォルマントの変更倍率の上限は 2.0 なので、グレインの切り出しには半径の 2 倍の範囲の入力が必要になる。
+    // 選択されたエポックが合成位置より古くなる分も含めて、十分な長さの履歴を保持する。
+    _historyLength = config._maxBlockSize + _latencySamples + _maxGrainRadius * 8;
+    _inputPosition = 0;
+
+    _minLag = std::max(1, _minPeriod / kDecimationFactor);
+    _maxLag = (_maxPeriod + kDecimationFactor - 1) / kDecimationFactor;
+    _pitchWindowLength = _maxLag * 2;
+    _decimatedPosition = 0;
+    _decimationSum = 0;
+    _decimationCount = 0;
+    _pitchUpdateInterval = std::max(1, (int)std::round(sampleRate * 0.005));
+    _samplesUntilPitchUpdate = _pitchUpdateInterval;
+
+    _period = (float)_unvoicedPeriod;
+    _voiced = false;
+
+    _numEpochs = 0;
+    _lastEpochPosition = 0;
+
+    _olaLength = config._maxBlockSize + _maxGrainRadius * 4;
+    _nextMark = 0;
+    _outputPosition = -_latencySamples;
+
+    // 作業用のバッファは 1 つのメモリ領域から切り出す。Arena が確保したメモリは 0 で初期化されている
+    _arena.build([&](Arena &arena) {
+        // 末尾のチャンネルは解析用のモノラル信号
+        arena.bind(_history, numChannels + 1, _historyLength);
+        arena.bind(_decimated, _pitchWindowLength + _maxLag);
+        arena.bind(_pitchFrame, _pitchWindowLength + _maxLag);
+        arena.bind(_epochs, kMaxEpochs);
+        arena.bind(_olaBuffer, numChannels, _olaLength);
+        arena.bind(_olaWeights, _olaLength);
+    });
+}
+
+template<class SampleType>
+void PsolaEngine<SampleType>::process(AudioBufferType &input,
+                                      AudioBufferType &output,
+                                      double pitchChangeAmount,
+                                      double formantExpandAmount)
+{
+    auto const numChannels = getNumChannels();
+    auto const bufferSize = input.getNumSamples();
+
+    jassert(input.getNumChannels() >= numChannels && output.getNumChannels() >= numChannels);
+    jassert(output.getNumSamples() == bufferSize);
+    jassert(bufferSize <= _config._maxBlockSize);
+
+    pitchChangeAmount = juce::jlimit(0.5, 2.0, pitchChangeAmount);
+    formantExpandAmount = juce::jlimit(0.5, 2.0, formantExpandAmount);
+
+    auto const monoChannel = numChannels;
+    auto const monoScale = (SampleType)1 / numChannels;
+
+    for(int i = 0; i < bufferSize; ++i) {
+        auto const index = (int)(_inputPosition % _historyLength);
+
+        SampleType mono = 0;
+        for(int ch = 0; ch < numChannels; ++ch) {
+            auto const x = input.getSample(ch, i);
+            _history.setSample(ch, index, x);
+            mono += x;
+        }
+        mono *= monoScale;
+        _history.setSample(monoChannel, index, mono);
+        ++_inputPosition;
+
+        pushDecimatedSample((float)mono);
+
+        if(--_samplesUntilPitchUpdate == 0) {
+            _samplesUntilPitchUpdate = _pitchUpdateInterval;
+            updatePitch();
+            detectEpochs(_inputPosition);
+        }
+    }
+
+    detectEpochs(_inputPosition);
+
+    // 出力する範囲に掛かるグレインをすべて重ね合わせる
+    auto const outputEnd = _outputPosition + bufferSize;
+    for( ; ; ) {
+        auto const epoch = findEpoch(_nextMark, _inputPosition, pitchChangeAmount, formantExpandAmount);
+        if(epoch == nullptr) {
+            // 無音の区間などで使用できるエポックがないときは、合成位置だけ進める
+            if(_nextMark >= outputEnd) { break; }
+            _nextMark += _unvoicedPeriod;
+            continue;
+        }
+
+        auto const radius = getGrainRadius(*epoch, pitchChangeAmount);
+        if(_nextMark - radius >= outputEnd) { break; }
+
+        addGrain(*epoch, _nextMark, radius, formantExpandAmount);
+        _nextMark += epoch->_period / pitchChangeAmount;
+    }
+
+    for(int i = 0; i < bufferSize; ++i) {
+        auto const pos = _outputPosition + i;
+        if(pos < 0) {
+            for(int ch = 0; ch < numChannels; ++ch) {
+                output.setSample(ch, i, 0);
+            }
+            continue;
+        }
+
+        auto const index = (int)(pos % _olaLength);
+        auto const gain = (SampleType)1 / std::max(_olaWeights[index], kMinimumWeight);
+        for(int ch = 0; ch < numChannels; ++ch) {
+            output.setSample(ch, i, _olaBuffer.getSample(ch, index) * gain);
+            _olaBuffer.setSample(ch, index, 0);
+        }
+        _olaWeights.setUnchecked(index, 0.0f);
+    }
+
+    _outputPosition = outputEnd;
+}
+
+template<class SampleType>
+SampleType PsolaEngine<SampleType>::getInterpolatedSample(int ch, double pos) const
+{
+    auto const left = (juce::int64)std::floor(pos);
+    auto const frac = (SampleType)(pos - left);
+
+    if(left < 0 || left + 1 >= _inputPosition) {
+        return 0;
+    }
+
+    auto const a = getHistorySample(ch, left);
+    auto const b = getHistorySample(ch, left + 1);
+    return a + (b - a) * frac;
+}
+
+template<class SampleType>
+void PsolaEngine<SampleType>::pushDecimatedSample(float x)
+{
+    // 単純な平均で間引く。ピッチ検出にしか使用しないので、この程度の帯域制限で十分
+    _decimationSum += x;
+    if(++_decimationCount < kDecimationFactor) { return; }
+
+    _decimated.setUnchecked((int)(_decimatedPosition % _decimated.size()), _decimationSum / kDecimationFactor);
+    ++_decimatedPosition;
+    _decimationSum = 0;
+    _decimationCount = 0;
+}
+
+template<class SampleType>
+void PsolaEngine<SampleType>::updatePitch()
+{
+    auto const frameLength = _pitchFrame.size();
+    if(_decimatedPosition < frameLength) {
+        return;
+    }
+
+    // 間引いた信号の直近の区間を時間順に並べ直す
+    for(int i = 0; i < frameLength; ++i) {
+        auto const pos = _decimatedPosition - frameLength + i;
+        _pitchFrame.setUnchecked(i, _decimated[(int)(pos % _decimated.size())]);
+    }
+
+    auto const *x = _pitchFrame.data();
+    auto const W = _pitchWindowLength;
+
+    double e0 = 0;
+    for(int i = 0; i < W; ++i) {
+        e0 += x[i] * x[i];
+    }
+
+    // 無音に近い区間は無声として扱う
+    if(e0 / W < 1e-7) {
+        _voiced = false;
+        return;
+    }
+
+    // 正規化自己相関の最大値を探す
+    double eLag = 0;
+    for(int i = _minLag; i < _minLag + W; ++i) {
+        eLag += x[i] * x[i];
+    }
+
+    int bestLag = -1;
+    double bestValue = 0;
+    double prev = 0;
+    double prevPrev = 0;
+
+    for(int lag = _minLag; lag <= _maxLag; ++lag) {
+        double r = 0;
+        for(int i = 0; i < W; ++i) {
+            r += x[i] * x[i + lag];
+        }
+
+        auto const value = r / std::sqrt(e0 * eLag + 1e-20);
+
+        // 極大値のうち、しきい値を超えた最初のものを採用する (オクターブ誤りを避けるため)
+        if(lag >= _minLag + 2 && prev > prevPrev && prev >= value && prev > kVoicingThreshold) {
+            bestLag = lag - 1;
+            bestValue = prev;
+
+            // 放物線補間で周期を細かく求める
+            auto const denom = prevPrev - 2.0 * prev + value;
+            auto const delta = (std::abs(denom) > 1e-12) ? 0.5 * (prevPrev - value) / denom : 0.0;
+            _period = (float)((bestLag + juce::jlimit(-0.5, 0.5, delta)) * kDecimationFactor);
+            break;
+        }
+
+        prevPrev = prev;
+        prev = value;
+
+        if(lag + W < _pitchFrame.size()) {
+            eLag += x[lag + W] * x[lag + W] - x[lag] * x[lag];
+        }
+    }
+
+    _voiced = (bestLag > 0 && bestValue > kVoicingThreshold);
+}
+
+template<class SampleType>
+void PsolaEngine<SampleType>::detectEpochs(juce::int64 available)
+{
+    auto const monoChannel = getNumChannels();
+
+    for( ; ; ) {
+        auto const period = _voiced ? _period : (float)_unvoicedPeriod;
+        Epoch epoch;
+        epoch._period = period;
+
+        if(_voiced) {
+            // 前回のエポックから 1 周期前後の範囲で、信号のピークを探す
+            auto const begin = _lastEpochPosition + (juce::int64)(period * 0.7f);
+            auto const end = _lastEpochPosition + (juce::int64)(period * 1.3f);
+            if(end >= available) { return; }
+
+            auto peakPos = begin;
+            auto peakValue = getHistorySample(monoChannel, begin);
+            for(auto pos = begin + 1; pos <= end; ++pos) {
+                auto const v = getHistorySample(monoChannel, pos);
+                if(v > peakValue) {
+                    peakValue = v;
+                    peakPos = pos;
+                }
+            }
+
+            epoch._position = peakPos;
+        } else {
+            epoch._position = _lastEpochPosition + (juce::int64)period;
+            if(epoch._position >= available) { return; }
+        }
+
+        _epochs.setUnchecked((int)(_numEpochs % kMaxEpochs), epoch);
+        ++_numEpochs;
+        _lastEpochPosition = epoch._position;
+    }
+}
+
+template<class SampleType>
+float PsolaEngine<SampleType>::getGrainRadius(Epoch const &epoch, double pitchChangeAmount) const
+{
+    auto const synthesisPeriod = epoch._period / pitchChangeAmount;
+    return (float)std::min<double>(std::max<double>(epoch._period, synthesisPeriod), _maxGrainRadius);
+}
+
+template<class SampleType>
+typename PsolaEngine<SampleType>::Epoch const * PsolaEngine<SampleType>::findEpoch(double mark,
+                                                                                  juce::int64 available,
+                                                                                  double pitchChangeAmount,
+                                                                                  double formantExpandAmount) const
+{
+    // 出力上の時刻 mark と同じ時刻の入力信号に最も近いエポックを選ぶ。
+    // ただし、グレインを切り出す範囲の入力がすべて揃っていて、履歴から消えていないものに限る。
+    Epoch const *found = nullptr;
+    double bestDistance = 0;
+
+    auto const numStored = (int)std::min<juce::int64>(_numEpochs, kMaxEpochs);
+    for(int i = 0; i < numStored; ++i) {
+        auto const &epoch = _epochs.getReference((int)((_numEpochs - 1 - i) % kMaxEpochs));
+
+        auto const reach = getGrainRadius(epoch, pitchChangeAmount) * formantExpandAmount;
+        if(epoch._position + reach + 1 >= available) { continue; }
+        if(epoch._position - reach < available - _historyLength) { break; }
+
+        auto const distance = std::abs(epoch._position - mark);
+        if(found == nullptr || distance < bestDistance) {
+            found = &epoch;
+            bestDistance = distance;
+        } else {
+            // エポックは新しい順に並んでいるので、距離が離れ始めたら打ち切る
+            break;
+        }
+    }
+
+    return found;
+}
+
+template<class SampleType>
+void PsolaEngine<SampleType>::addGrain(Epoch const &epoch, double mark, float radius, double formantExpandAmount)
+{
+    auto const numChannels = getNumChannels();
+    auto const center = (juce::int64)std::round(mark);
+    auto const r = (int)std::ceil(radius);
+
+    for(int k = -r; k <= r; ++k) {
+        auto const pos = center + k;
+        // 出力済みの位置と、入力の開始より前の位置には書き込まない
+        if(pos < _outputPosition || pos < 0) { continue; }
+
+        auto const x = std::abs(k) / radius;
+        if(x >= 1.0f) { continue; }
+
+        auto const w = 0.5f + 0.5f * std::cos(juce::MathConstants<float>::pi * x);
+        auto const srcPos = epoch._position + k * formantExpandAmount;
+        auto const index = (int)(pos % _olaLength);
+
+        for(int ch = 0; ch < numChannels; ++ch) {
+            _olaBuffer.addSample(ch, index, (SampleType)w * getInterpolatedSample(ch, srcPos));
+        }
+        _olaWeights.setUnchecked(index, _olaWeights[index] + w);
+    }
+}
+
+//==============================================================================
+template class PsolaEngine<float>;
+template class PsolaEngine<double>;
+
+NS_HWM_END
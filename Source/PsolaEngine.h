@@ -0,0 +1,136 @@
+#pragma once
+
+#include "Prefix.h"
+#include "Arena.h"
+
+NS_HWM_BEGIN
+
+/** 時間領域の PSOLA (Pitch Synchronous Overlap-Add) によって、ピッチシフトとフォルマントシフトを行うエンジン
+ *
+ *  入力信号の自己相関からピッチ周期を求め、周期ごとのピーク位置 (エポック) を検出する。
+ *  出力側では変更後のピッチ周期の間隔で合成位置を置き、最も近いエポックを中心とした 2 周期分のグレインを切り出して重ね合わせる。
+ *  フォルマントシフトはグレインを切り出すときにリサンプリングすることで行う。
+ *
+ *  FFT を使用しないので、SpectralEngine に比べて処理負荷とレイテンシーが小さい。
+ *  その代わり、単一の基本周波数を持つ信号 (主に音声) を前提としている。
+ *
+ *  グレインを切り出すにはエポックの後ろ 1 周期分以上の入力が必要になる。
+ *  レイテンシーを Config::_latencySeconds に固定しているため、それより長い周期の低い声では
+ *  その分だけ古いエポックが使用され、ウェット信号の実質的な遅れが大きくなる。
+ *  ステレオ入力ではチャンネルを足し合わせた信号で解析し、全チャンネルで同じエポックと合成位置を使用する。
+ *
+ *  入力の履歴とオーバーラップ加算は SampleType で行い、ピッチ検出用に間引いた信号だけを float で扱う。
+ *  float と double の両方を PsolaEngine.cpp で明示的にインスタンス化している。
+ */
+template<class SampleType>
+class PsolaEngine
+{
+public:
+    using AudioBufferType = juce::AudioBuffer<SampleType>;
+
+    struct Config
+    {
+        double _sampleRate = 44100.0;
+        int _numChannels = 1;
+        int _maxBlockSize = 512;
+        double _minFrequency = 70.0;    //!< 検出するピッチの下限 (Hz)
+        double _maxFrequency = 800.0;   //!< 検出するピッチの上限 (Hz)
+        double _latencySeconds = 0.008; //!< 入力から出力までの遅延
+    };
+
+    void prepare(Config const &config);
+
+    int getNumChannels() const { return _config._numChannels; }
+
+    //! 入力された信号が出力されるまでの遅延量
+    int getLatencySamples() const { return _latencySamples; }
+
+    /** 入力信号を処理して、同じ長さの出力信号を書き込む
+     *
+     *  @param pitchChangeAmount ピッチの変更倍率
+     *  @param formantExpandAmount フォルマントの変更倍率 (1.0 より大きいとフォルマントが高くなる)
+     *  @pre input.getNumSamples() == output.getNumSamples() && input.getNumSamples() <= Config::_maxBlockSize
+     */
+    void process(AudioBufferType &input,
+                 AudioBufferType &output,
+                 double pitchChangeAmount,
+                 double formantExpandAmount);
+
+private:
+    struct Epoch
+    {
+        juce::int64 _position = 0;
+        float _period = 0;
+    };
+
+    inline static constexpr int kDecimationFactor = 4;
+    inline static constexpr int kMaxEpochs = 64;
+    inline static constexpr float kVoicingThreshold = 0.6f;
+    inline static constexpr float kMinimumWeight = 0.5f;
+
+    Config _config;
+    int _latencySamples = 0;
+
+    // 作業用のバッファは prepare() で _arena からまとめて切り出す
+    Arena _arena;
+
+    int _minPeriod = 0;
+    int _maxPeriod = 0;
+    int _unvoicedPeriod = 0;
+    int _maxGrainRadius = 0;
+
+    // 入力信号の履歴。末尾のチャンネルは解析用のモノラル信号
+    AudioBufferType _history;
+    int _historyLength = 0;
+    juce::int64 _inputPosition = 0;
+
+    // ピッチ検出用に間引いたモノラル信号
+    ArenaArray<float> _decimated;
+    ArenaArray<float> _pitchFrame;
+    juce::int64 _decimatedPosition = 0;
+    float _decimationSum = 0;
+    int _decimationCount = 0;
+    int _pitchWindowLength = 0;
+    int _minLag = 0;
+    int _maxLag = 0;
+    int _samplesUntilPitchUpdate = 0;
+    int _pitchUpdateInterval = 0;
+
+    float _period = 0;
+    bool _voiced = false;
+
+    ArenaArray<Epoch> _epochs;
+    juce::int64 _numEpochs = 0;
+    juce::int64 _lastEpochPosition = 0;
+
+    // 出力のオーバーラップ加算用のバッファと、窓関数の重みの合計
+    AudioBufferType _olaBuffer;
+    ArenaArray<float> _olaWeights;
+    int _olaLength = 0;
+    double _nextMark = 0;
+    juce::int64 _outputPosition = 0;
+
+    SampleType getHistorySample(int ch, juce::int64 pos) const
+    {
+        return _history.getSample(ch, (int)(pos % _historyLength));
+    }
+
+    //! 履歴の信号を線形補間して読み出す
+    SampleType getInterpolatedSample(int ch, double pos) const;
+
+    void pushDecimatedSample(float x);
+    void updatePitch();
+
+    //! 指定した位置までの入力から、エポックを検出する
+    void detectEpochs(juce::int64 available);
+
+    //! 合成位置 mark に最も近く、グレインを切り出せるエポックを探す
+    //! @return 見つからなかったときは nullptr
+    Epoch const * findEpoch(double mark, juce::int64 available, double pitchChangeAmount, double formantExpandAmount) const;
+
+    float getGrainRadius(Epoch const &epoch, double pitchChangeAmount) const;
+
+    void addGrain(Epoch const &epoch, double mark, float radius, double formantExpandAmount);
+};
+
+NS_HWM_END
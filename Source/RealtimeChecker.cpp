@@ -0,0 +1,450 @@
+#include "RealtimeChecker.h"
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+#include <type_traits>
+
+#if HWM_ENABLE_REALTIME_CHECKER
+ #if JUCE_LINUX || JUCE_MAC
+  #include <execinfo.h>
+  #define HWM_REALTIME_CHECKER_HAS_BACKTRACE 1
+ #endif
+
+ #if JUCE_LINUX && defined(__GLIBC__)
+  #include <cerrno>
+  #include <dlfcn.h>
+  #include <pthread.h>
+  #include <sched.h>
+  #include <time.h>
+  #include <unistd.h>
+  #define HWM_REALTIME_CHECKER_HOOKS_LIBC 1
+ #endif
+#endif
+
+#ifndef HWM_REALTIME_CHECKER_HAS_BACKTRACE
+#define HWM_REALTIME_CHECKER_HAS_BACKTRACE 0
+#endif
+
+#ifndef HWM_REALTIME_CHECKER_HOOKS_LIBC
+#define HWM_REALTIME_CHECKER_HOOKS_LIBC 0
+#endif
+
+// 横取りした malloc の中から参照するので、アクセスしてもメモリを確保しない initial-exec モデルの TLS に置く
+#if defined(__GNUC__)
+#define HWM_INITIAL_EXEC_TLS __attribute__((tls_model("initial-exec")))
+#else
+#define HWM_INITIAL_EXEC_TLS
+#endif
+
+NS_HWM_BEGIN
+
+static thread_local int sRealtimeDepth HWM_INITIAL_EXEC_TLS = 0;
+static thread_local int sSuspendCount HWM_INITIAL_EXEC_TLS = 0;
+
+static std::array<RealtimeChecker::Violation, RealtimeChecker::kMaxRecordedViolations> sViolations;
+static std::array<std::atomic<bool>, RealtimeChecker::kMaxRecordedViolations> sViolationRecorded {};
+static std::atomic<juce::int64> sNumViolations { 0 };
+static std::atomic<bool> sAbortOnViolation { false };
+
+#if HWM_REALTIME_CHECKER_HAS_BACKTRACE
+// backtrace() は最初の呼び出しで libgcc を読み込む (メモリを確保する) ので、オーディオスレッドで呼び出す前に 1 回呼び出しておく
+[[maybe_unused]] static int const sBacktracePrimed = [] {
+    void *frames[1];
+    return backtrace(frames, 1);
+}();
+#endif
+
+static int captureStackTrace(std::array<void *, RealtimeChecker::kMaxStackFrames> &frames) noexcept
+{
+   #if HWM_REALTIME_CHECKER_HAS_BACKTRACE
+    return backtrace(frames.data(), (int)frames.size());
+   #else
+    juce::ignoreUnused(frames);
+    return 0;
+   #endif
+}
+
+bool RealtimeChecker::isInRealtimeSection() noexcept
+{
+    return sRealtimeDepth > 0 && sSuspendCount == 0;
+}
+
+void RealtimeChecker::enterRealtimeSection() noexcept
+{
+   #if HWM_ENABLE_REALTIME_CHECKER
+    ++sRealtimeDepth;
+   #endif
+}
+
+void RealtimeChecker::leaveRealtimeSection() noexcept
+{
+   #if HWM_ENABLE_REALTIME_CHECKER
+    jassert(sRealtimeDepth > 0);
+    --sRealtimeDepth;
+   #endif
+}
+
+void RealtimeChecker::suspend() noexcept
+{
+    ++sSuspendCount;
+}
+
+void RealtimeChecker::resume() noexcept
+{
+    jassert(sSuspendCount > 0);
+    --sSuspendCount;
+}
+
+void RealtimeChecker::check(ViolationType type, char const *function) noexcept
+{
+    if(isInRealtimeSection() == false) { return; }
+
+    // 記録の途中で呼び出す関数を、違反として検出しないようにする
+    ScopedRealtimeCheckSuspender suspender;
+
+    Violation violation;
+    violation._type = type;
+    violation._function = function;
+    violation._numFrames = captureStackTrace(violation._frames);
+
+    auto const index = sNumViolations.fetch_add(1, std::memory_order_relaxed);
+    if(index < kMaxRecordedViolations) {
+        sViolations[(std::size_t)index] = violation;
+        sViolationRecorded[(std::size_t)index].store(true, std::memory_order_release);
+    }
+
+    if(sAbortOnViolation.load(std::memory_order_relaxed)) {
+        std::fprintf(stderr, "Realtime safety violation: %s (%s)\n", getTypeName(type), function);
+       #if HWM_REALTIME_CHECKER_HAS_BACKTRACE
+        backtrace_symbols_fd(violation._frames.data(), violation._numFrames, 2);
+       #endif
+        std::abort();
+    }
+}
+
+void RealtimeChecker::setAbortOnViolation(bool shouldAbort) noexcept
+{
+    sAbortOnViolation.store(shouldAbort, std::memory_order_relaxed);
+}
+
+juce::int64 RealtimeChecker::getNumViolations() noexcept
+{
+    return sNumViolations.load(std::memory_order_relaxed);
+}
+
+juce::StringArray RealtimeChecker::getViolationReports()
+{
+    juce::StringArray reports;
+
+    auto const numRecorded = std::min<juce::int64>(getNumViolations(), kMaxRecordedViolations);
+    for(int i = 0; i < (int)numRecorded; ++i) {
+        if(sViolationRecorded[(std::size_t)i].load(std::memory_order_acquire) == false) { continue; }
+
+        auto const &v = sViolations[(std::size_t)i];
+        juce::String report;
+        report << getTypeName(v._type) << ": " << v._function << "\n";
+
+       #if HWM_REALTIME_CHECKER_HAS_BACKTRACE
+        if(auto *symbols = backtrace_symbols(v._frames.data(), v._numFrames)) {
+            for(int f = 0; f < v._numFrames; ++f) {
+                report << "    " << symbols[f] << "\n";
+            }
+            std::free(symbols);
+        }
+       #endif
+
+        reports.add(report);
+    }
+
+    auto const numDropped = getNumViolations() - numRecorded;
+    if(numDropped > 0) {
+        reports.add(juce::String(numDropped) + " more violations were not recorded.");
+    }
+
+    return reports;
+}
+
+void RealtimeChecker::clearViolations() noexcept
+{
+    for(auto &recorded: sViolationRecorded) {
+        recorded.store(false, std::memory_order_relaxed);
+    }
+
+    sNumViolations.store(0, std::memory_order_relaxed);
+}
+
+char const * RealtimeChecker::getTypeName(ViolationType type)
+{
+    switch(type) {
+        case ViolationType::kAllocation:    return "allocation";
+        case ViolationType::kDeallocation:  return "deallocation";
+        case ViolationType::kLock:          return "lock";
+        case ViolationType::kBlockingCall:  return "blocking call";
+        default:                            return "unknown";
+    }
+}
+
+NS_HWM_END
+
+#if HWM_ENABLE_REALTIME_CHECKER
+//==============================================================================
+// 横取りした関数から、本来のメモリ確保の関数を呼び出す。
+// glibc では malloc 自体も横取りしているので、二重に検出しないように __libc_* を直接呼び出す
+
+#if HWM_REALTIME_CHECKER_HOOKS_LIBC
+extern "C" {
+void * __libc_malloc(size_t size) noexcept;
+void * __libc_calloc(size_t count, size_t size) noexcept;
+void * __libc_realloc(void *ptr, size_t size) noexcept;
+void * __libc_memalign(size_t alignment, size_t size) noexcept;
+void __libc_free(void *ptr) noexcept;
+}
+#endif
+
+static void * allocateUnchecked(std::size_t size) noexcept
+{
+   #if HWM_REALTIME_CHECKER_HOOKS_LIBC
+    return __libc_malloc(size == 0 ? 1 : size);
+   #else
+    return std::malloc(size == 0 ? 1 : size);
+   #endif
+}
+
+static void * allocateAlignedUnchecked(std::size_t size, std::size_t alignment) noexcept
+{
+    alignment = std::max(alignment, sizeof(void *));
+
+   #if HWM_REALTIME_CHECKER_HOOKS_LIBC
+    return __libc_memalign(alignment, size == 0 ? 1 : size);
+   #else
+    void *p = nullptr;
+    return (posix_memalign(&p, alignment, size == 0 ? 1 : size) == 0) ? p : nullptr;
+   #endif
+}
+
+static void freeUnchecked(void *ptr) noexcept
+{
+   #if HWM_REALTIME_CHECKER_HOOKS_LIBC
+    __libc_free(ptr);
+   #else
+    std::free(ptr);
+   #endif
+}
+
+using hwm::RealtimeChecker;
+
+static void * checkedNew(std::size_t size, char const *function)
+{
+    RealtimeChecker::check(RealtimeChecker::ViolationType::kAllocation, function);
+    if(auto *p = allocateUnchecked(size)) { return p; }
+    throw std::bad_alloc();
+}
+
+static void * checkedNew(std::size_t size, std::align_val_t alignment, char const *function)
+{
+    RealtimeChecker::check(RealtimeChecker::ViolationType::kAllocation, function);
+    if(auto *p = allocateAlignedUnchecked(size, (std::size_t)alignment)) { return p; }
+    throw std::bad_alloc();
+}
+
+static void checkedDelete(void *ptr, char const *function) noexcept
+{
+    if(ptr == nullptr) { return; }
+
+    RealtimeChecker::check(RealtimeChecker::ViolationType::kDeallocation, function);
+    freeUnchecked(ptr);
+}
+
+//==============================================================================
+void * operator new(std::size_t size) { return checkedNew(size, "operator new"); }
+void * operator new[](std::size_t size) { return checkedNew(size, "operator new[]"); }
+void * operator new(std::size_t size, std::align_val_t alignment) { return checkedNew(size, alignment, "operator new"); }
+void * operator new[](std::size_t size, std::align_val_t alignment) { return checkedNew(size, alignment, "operator new[]"); }
+
+void * operator new(std::size_t size, std::nothrow_t const &) noexcept
+{
+    RealtimeChecker::check(RealtimeChecker::ViolationType::kAllocation, "operator new");
+    return allocateUnchecked(size);
+}
+
+void * operator new[](std::size_t size, std::nothrow_t const &) noexcept
+{
+    RealtimeChecker::check(RealtimeChecker::ViolationType::kAllocation, "operator new[]");
+    return allocateUnchecked(size);
+}
+
+void * operator new(std::size_t size, std::align_val_t alignment, std::nothrow_t const &) noexcept
+{
+    RealtimeChecker::check(RealtimeChecker::ViolationType::kAllocation, "operator new");
+    return allocateAlignedUnchecked(size, (std::size_t)alignment);
+}
+
+void * operator new[](std::size_t size, std::align_val_t alignment, std::nothrow_t const &) noexcept
+{
+    RealtimeChecker::check(RealtimeChecker::ViolationType::kAllocation, "operator new[]");
+    return allocateAlignedUnchecked(size, (std::size_t)alignment);
+}
+
+void operator delete(void *ptr) noexcept { checkedDelete(ptr, "operator delete"); }
+void operator delete[](void *ptr) noexcept { checkedDelete(ptr, "operator delete[]"); }
+void operator delete(void *ptr, std::size_t) noexcept { checkedDelete(ptr, "operator delete"); }
+void operator delete[](void *ptr, std::size_t) noexcept { checkedDelete(ptr, "operator delete[]"); }
+void operator delete(void *ptr, std::nothrow_t const &) noexcept { checkedDelete(ptr, "operator delete"); }
+void operator delete[](void *ptr, std::nothrow_t const &) noexcept { checkedDelete(ptr, "operator delete[]"); }
+void operator delete(void *ptr, std::align_val_t) noexcept { checkedDelete(ptr, "operator delete"); }
+void operator delete[](void *ptr, std::align_val_t) noexcept { checkedDelete(ptr, "operator delete[]"); }
+void operator delete(void *ptr, std::size_t, std::align_val_t) noexcept { checkedDelete(ptr, "operator delete"); }
+void operator delete[](void *ptr, std::size_t, std::align_val_t) noexcept { checkedDelete(ptr, "operator delete[]"); }
+void operator delete(void *ptr, std::align_val_t, std::nothrow_t const &) noexcept { checkedDelete(ptr, "operator delete"); }
+void operator delete[](void *ptr, std::align_val_t, std::nothrow_t const &) noexcept { checkedDelete(ptr, "operator delete[]"); }
+
+#if HWM_REALTIME_CHECKER_HOOKS_LIBC
+//==============================================================================
+// C のメモリ確保・ロック・待機の関数を横取りする。
+// ロックと待機の関数は、dlsym(RTLD_NEXT) で glibc の本来の関数を探して呼び出す
+
+// 横取りして本来の関数を呼び出す関数の一覧。X(Signature, function) の形で並べる。
+// Signature は関数の型。glibc の宣言に付いている属性を持ち込まないように、decltype は使わずに明示する
+#define HWM_FOR_EACH_NEXT_FUNCTION(X) \
+    X(int(pthread_mutex_t *), pthread_mutex_lock) \
+    X(int(pthread_rwlock_t *), pthread_rwlock_rdlock) \
+    X(int(pthread_rwlock_t *), pthread_rwlock_wrlock) \
+    X(int(timespec const *, timespec *), nanosleep) \
+    X(int(clockid_t, int, timespec const *, timespec *), clock_nanosleep) \
+    X(int(useconds_t), usleep) \
+    X(unsigned int(unsigned int), sleep) \
+    X(int(), sched_yield)
+
+#define HWM_DECLARE_NEXT_FUNCTION(Signature, function) \
+    static std::atomic<std::add_pointer_t<Signature>> sNext_##function { nullptr };
+HWM_FOR_EACH_NEXT_FUNCTION(HWM_DECLARE_NEXT_FUNCTION)
+#undef HWM_DECLARE_NEXT_FUNCTION
+
+template<class F>
+static F resolveNext(std::atomic<F> &cache, char const *name) noexcept
+{
+    auto f = cache.load(std::memory_order_relaxed);
+    if(f == nullptr) {
+        f = reinterpret_cast<F>(dlsym(RTLD_NEXT, name));
+        cache.store(f, std::memory_order_relaxed);
+    }
+    return f;
+}
+
+// dlsym() は最初の呼び出しでメモリを確保することがある。オーディオスレッドで初めて呼び出されたときに探すと、
+// check() が記録を終えたあとなので、その確保がプラグインの違反として報告されてしまう。
+// そのため静的初期化の時点ですべて探しておく。これより前の静的初期化から呼び出されたときのために、resolveNext() は呼び出し時にも探す
+[[maybe_unused]] static int const sNextFunctionsResolved = [] {
+   #define HWM_RESOLVE_NEXT_FUNCTION(Signature, function) resolveNext(sNext_##function, #function);
+    HWM_FOR_EACH_NEXT_FUNCTION(HWM_RESOLVE_NEXT_FUNCTION)
+   #undef HWM_RESOLVE_NEXT_FUNCTION
+    return 0;
+}();
+
+#define HWM_CALL_NEXT(function, ...) resolveNext(sNext_##function, #function)(__VA_ARGS__)
+
+extern "C" {
+
+void * malloc(size_t size) noexcept
+{
+    RealtimeChecker::check(RealtimeChecker::ViolationType::kAllocation, "malloc");
+    return __libc_malloc(size);
+}
+
+void * calloc(size_t count, size_t size) noexcept
+{
+    RealtimeChecker::check(RealtimeChecker::ViolationType::kAllocation, "calloc");
+    return __libc_calloc(count, size);
+}
+
+void * realloc(void *ptr, size_t size) noexcept
+{
+    RealtimeChecker::check(RealtimeChecker::ViolationType::kAllocation, "realloc");
+    return __libc_realloc(ptr, size);
+}
+
+void * aligned_alloc(size_t alignment, size_t size) noexcept
+{
+    RealtimeChecker::check(RealtimeChecker::ViolationType::kAllocation, "aligned_alloc");
+    return __libc_memalign(alignment, size);
+}
+
+int posix_memalign(void **ptr, size_t alignment, size_t size) noexcept
+{
+    RealtimeChecker::check(RealtimeChecker::ViolationType::kAllocation, "posix_memalign");
+
+    if(alignment < sizeof(void *) || (alignment & (alignment - 1)) != 0) {
+        return EINVAL;
+    }
+
+    auto *p = __libc_memalign(alignment, size);
+    if(p == nullptr) { return ENOMEM; }
+
+    *ptr = p;
+    return 0;
+}
+
+void free(void *ptr) noexcept
+{
+    if(ptr == nullptr) { return; }
+
+    RealtimeChecker::check(RealtimeChecker::ViolationType::kDeallocation, "free");
+    __libc_free(ptr);
+}
+
+int pthread_mutex_lock(pthread_mutex_t *mutex) noexcept
+{
+    RealtimeChecker::check(RealtimeChecker::ViolationType::kLock, "pthread_mutex_lock");
+    return HWM_CALL_NEXT(pthread_mutex_lock, mutex);
+}
+
+int pthread_rwlock_rdlock(pthread_rwlock_t *lock) noexcept
+{
+    RealtimeChecker::check(RealtimeChecker::ViolationType::kLock, "pthread_rwlock_rdlock");
+    return HWM_CALL_NEXT(pthread_rwlock_rdlock, lock);
+}
+
+int pthread_rwlock_wrlock(pthread_rwlock_t *lock) noexcept
+{
+    RealtimeChecker::check(RealtimeChecker::ViolationType::kLock, "pthread_rwlock_wrlock");
+    return HWM_CALL_NEXT(pthread_rwlock_wrlock, lock);
+}
+
+int nanosleep(timespec const *request, timespec *remaining)
+{
+    RealtimeChecker::check(RealtimeChecker::ViolationType::kBlockingCall, "nanosleep");
+    return HWM_CALL_NEXT(nanosleep, request, remaining);
+}
+
+int clock_nanosleep(clockid_t clock, int flags, timespec const *request, timespec *remaining)
+{
+    RealtimeChecker::check(RealtimeChecker::ViolationType::kBlockingCall, "clock_nanosleep");
+    return HWM_CALL_NEXT(clock_nanosleep, clock, flags, request, remaining);
+}
+
+int usleep(useconds_t microseconds)
+{
+    RealtimeChecker::check(RealtimeChecker::ViolationType::kBlockingCall, "usleep");
+    return HWM_CALL_NEXT(usleep, microseconds);
+}
+
+unsigned int sleep(unsigned int seconds)
+{
+    RealtimeChecker::check(RealtimeChecker::ViolationType::kBlockingCall, "sleep");
+    return HWM_CALL_NEXT(sleep, seconds);
+}
+
+int sched_yield() noexcept
+{
+    RealtimeChecker::check(RealtimeChecker::ViolationType::kBlockingCall, "sched_yield");
+    return HWM_CALL_NEXT(sched_yield);
+}
+
+} // extern "C"
+
+#undef HWM_CALL_NEXT
+#undef HWM_FOR_EACH_NEXT_FUNCTION
+#endif // HWM_REALTIME_CHECKER_HOOKS_LIBC
+
+#endif // HWM_ENABLE_REALTIME_CHECKER
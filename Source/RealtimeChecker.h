@@ -0,0 +1,113 @@
+#pragma once
+
+#include <array>
+#include "Prefix.h"
+
+// オーディオスレッドでのメモリ確保・ロック・待機を検出するかどうか。CMake の FORMANT_AND_PITCH_ENABLE_REALTIME_CHECKER で有効にする
+#ifndef HWM_ENABLE_REALTIME_CHECKER
+#define HWM_ENABLE_REALTIME_CHECKER 0
+#endif
+
+NS_HWM_BEGIN
+
+/** リアルタイム処理の区間で、実行時間が保証されない関数が呼び出されたことを検出するデバッグ・CI 用の仕組み
+ *
+ *  ScopedRealtimeSection で囲まれた区間 (processBlock) を実行しているスレッドで、次の関数が呼び出されると違反として記録する。
+ *
+ *  - operator new / operator delete (すべてのプラットフォーム)
+ *  - malloc / calloc / realloc / aligned_alloc / posix_memalign / free (Linux のみ)
+ *  - pthread_mutex_lock / pthread_rwlock_rdlock / pthread_rwlock_wrlock (Linux のみ)
+ *  - nanosleep / usleep / sleep / sched_yield (Linux のみ。juce::SpinLock のスピンも sched_yield で検出できる)
+ *
+ *  C の関数は、同じ名前の関数をこのプラグインのバイナリの中で定義して横取りし、glibc の本来の関数に処理を渡す。
+ *  違反ごとに呼び出し元のスタックトレースを、確保済みの固定長の領域に記録する。関数名の解決は getViolationReports() で行う。
+ *
+ *  HWM_ENABLE_REALTIME_CHECKER が 0 のときは関数の横取りを行わず、ScopedRealtimeSection も何もしない。
+ */
+class RealtimeChecker
+{
+public:
+    enum class ViolationType {
+        kAllocation,
+        kDeallocation,
+        kLock,
+        kBlockingCall,
+    };
+
+    inline static constexpr int kMaxStackFrames = 32;
+
+    //! スタックトレースを記録する違反の数。これを超えた分は数だけを数える
+    inline static constexpr int kMaxRecordedViolations = 64;
+
+    struct Violation
+    {
+        ViolationType _type = ViolationType::kAllocation;
+        char const *_function = "";     //!< 呼び出された関数の名前 (文字列リテラル)
+        std::array<void *, kMaxStackFrames> _frames {};
+        int _numFrames = 0;
+    };
+
+    //! チェックが有効なビルドかどうか
+    static bool isEnabled() { return HWM_ENABLE_REALTIME_CHECKER != 0; }
+
+    //! 現在のスレッドがリアルタイム処理の区間にいて、違反を検出する状態かどうか
+    static bool isInRealtimeSection() noexcept;
+
+    static void enterRealtimeSection() noexcept;
+    static void leaveRealtimeSection() noexcept;
+
+    //! 現在のスレッドで違反の検出を一時的に止める (意図的に許容する処理のため)
+    static void suspend() noexcept;
+    static void resume() noexcept;
+
+    /** 現在のスレッドがリアルタイム処理の区間にいれば、違反として記録する
+     *
+     *  横取りした関数から呼び出す。この関数自体はメモリの確保もロックも行わない。
+     */
+    static void check(ViolationType type, char const *function) noexcept;
+
+    //! true のときは、違反を検出した時点でスタックトレースを標準エラー出力に書き出して abort() する (CI 用)
+    static void setAbortOnViolation(bool shouldAbort) noexcept;
+
+    //! これまでに検出した違反の数
+    static juce::int64 getNumViolations() noexcept;
+
+    //! 記録した違反を、関数名を解決したスタックトレース付きの文字列にする (オーディオスレッド以外から呼び出す)
+    static juce::StringArray getViolationReports();
+
+    //! 記録した違反を消去する (オーディオスレッドが止まっているときに呼び出す)
+    static void clearViolations() noexcept;
+
+    static char const * getTypeName(ViolationType type);
+};
+
+//! スコープの間、現在のスレッドをリアルタイム処理の区間にする
+class ScopedRealtimeSection
+{
+public:
+    ScopedRealtimeSection() noexcept { RealtimeChecker::enterRealtimeSection(); }
+    ~ScopedRealtimeSection() { RealtimeChecker::leaveRealtimeSection(); }
+
+    ScopedRealtimeSection(ScopedRealtimeSection const &) = delete;
+    ScopedRealtimeSection & operator=(ScopedRealtimeSection const &) = delete;
+};
+
+//! スコープの間、現在のスレッドで違反の検出を止める
+class ScopedRealtimeCheckSuspender
+{
+public:
+    ScopedRealtimeCheckSuspender() noexcept { RealtimeChecker::suspend(); }
+    ~ScopedRealtimeCheckSuspender() { RealtimeChecker::resume(); }
+
+    ScopedRealtimeCheckSuspender(ScopedRealtimeCheckSuspender const &) = delete;
+    ScopedRealtimeCheckSuspender & operator=(ScopedRealtimeCheckSuspender const &) = delete;
+};
+
+#if HWM_ENABLE_REALTIME_CHECKER
+#define HWM_REALTIME_SECTION() \
+    ::hwm::ScopedRealtimeSection JUCE_JOIN_MACRO(hwmRealtimeSection_, __LINE__)
+#else
+#define HWM_REALTIME_SECTION()
+#endif
+
+NS_HWM_END
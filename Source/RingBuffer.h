@@ -1,6 +1,8 @@
 #pragma once
 
+#include <algorithm>
 #include <atomic>
+#include <type_traits>
 #include <vector>
 #include "Prefix.h"
 
@@ -13,7 +15,7 @@ struct RingBuffer
     static void add_n(Iter1 src, int n, Iter2 dest)
     {
         for(int i = 0; i < n; ++i) {
-            *dest++ += *src++;
+            *dest++ += static_cast<std::remove_reference_t<decltype(*dest)>>(*src++);
         }
     }
 
@@ -127,10 +129,13 @@ struct RingBuffer
      *  buffer.getNumSamples() > getNumWritable() のときは、
      *  何もせずに false を返す。
      *
+     *  sourceBuffer のサンプルの型が T と異なるときは、T に変換して書き込む。
+     *
      *  @pre buffer.getNumChannels() == this->getNumChannels();
      *  @return データを書き込んだかどうかを bool 型の値で返す。
      */
-    [[nodiscard]] bool write(const juce::AudioBuffer<T> &sourceBuffer, int sourceStartIndex = 0)
+    template<class SourceType>
+    [[nodiscard]] bool write(const juce::AudioBuffer<SourceType> &sourceBuffer, int sourceStartIndex = 0)
     {
         jassert(sourceBuffer.getNumChannels() == _numChannels);
         jassert(sourceBuffer.getNumSamples() > sourceStartIndex);
@@ -149,7 +154,7 @@ struct RingBuffer
         {
             auto const * src = sourceBuffer.getReadPointer(ch) + sourceStartIndex;
             auto * dest = getBuffer()[ch] + w;
-            std::copy_n(src, numToCopy1, dest);
+            std::transform(src, src + numToCopy1, dest, [](SourceType x) { return static_cast<T>(x); });
         }
 
         const int numToCopy2 = std::max<int>(length, numToCopy1) - numToCopy1;
@@ -164,8 +169,7 @@ struct RingBuffer
             {
                 auto const * src = sourceBuffer.getReadPointer(ch) + sourceStartIndex + numToCopy1;
                 auto * dest = getBuffer()[ch];
-                std::copy_n(src, numToCopy2, dest);
-
+                std::transform(src, src + numToCopy2, dest, [](SourceType x) { return static_cast<T>(x); });
             }
             _writePos.store(numToCopy2);
             jassert(getNumReadable() >= 0);
@@ -179,13 +183,16 @@ struct RingBuffer
      *  buffer.getNumSamples() > getNumWritable() のときは、
      *  何もせずに false を返す。
      *
+     *  sourceBuffer のサンプルの型が T と異なるときは、T に変換して足し合わせる。
+     *
      *  @pre buffer.getNumChannels() == this->getNumChannels();
      *  @return データを書き込んだかどうかを bool 型の値で返す。
      *
      *  @note この関数は read() 関数の呼び出しに対してスレッドセーフではない。
      *  したがって、 read() 関数と overlapAdd() 関数の呼び出しはお互いに排他制御する必要がある。
      */
-    [[nodiscard]] bool overlapAdd(const juce::AudioBuffer<T> &sourceBuffer, int overlapLength, int sourceStartIndex = 0)
+    template<class SourceType>
+    [[nodiscard]] bool overlapAdd(const juce::AudioBuffer<SourceType> &sourceBuffer, int overlapLength, int sourceStartIndex = 0)
     {
         jassert(sourceBuffer.getNumChannels() == _numChannels);
         jassert(sourceBuffer.getNumSamples() > sourceStartIndex);
@@ -0,0 +1,899 @@
+#include "SpectralEngine.h"
+#include <cassert>
+
+NS_HWM_BEGIN
+
+// このエンジンの FFT サイズとオーバーラップ数を付けて、スコープの処理時間を Config::_profiler に記録する
+#define HWM_ENGINE_PROFILE_SCOPE(stage) \
+    HWM_PROFILE_SCOPE(_config._profiler, ProfileStage::stage, _config._fftSize, _config._overlapCount)
+
+// 数値の異常として数える、段階ごとの値の上限
+static constexpr float kMaxSpectrumValue = 1.0e30f;     // 線形のスペクトル。逆 FFT で足し合わせても float が溢れない程度
+static constexpr float kMaxLogAmplitude = 1.0e4f;       // 対数振幅。シフトで範囲外になったビンの -1000 を含めても超えない
+static constexpr double kMaxSampleValue = 1000.0;       // 時間領域の信号 (+60dBFS)
+
+// ステレオリンクで、各チャンネルに適用する代表のスペクトルとの振幅の比の上限
+static constexpr float kMaxLinkedMagnitudeRatio = 4.0f;
+
+// Mid のステレオリンクで、ミッド信号が打ち消し合っているとみなす、各チャンネルの振幅の平均に対する比 (-60dB)
+static constexpr float kMinMidMagnitudeRatio = 1.0e-3f;
+
+//==============================================================================
+template<class SampleType>
+void SpectralEngine<SampleType>::prepare(Config const &config)
+{
+    _config = config;
+
+    auto const numChannels = config._numChannels;
+    int const fftSize = getFFTSize();
+    int const overlapSize = getOverlapSize();
+    int const numBins = getNumBins();
+
+    jassert(FFTBackend::isSupportedSize(fftSize));
+
+    // 窓関数などのテーブルは、同じ設定のエンジンと共有する
+    _tables = _tableCache->getTables(fftSize, config._overlapCount, config._windowMode);
+    _synthesisLength = _tables->_synthesisLength;
+    _fft = std::make_unique<FFTBackend>(fftSize, _tables->_mixedRadixPlan);
+
+    _channelSpectrums.resize(numChannels);
+
+    // 作業用のバッファは 1 つのメモリ領域から、processAudioBlock でアクセスする順に切り出す。
+    // FFT の入出力に使うバッファ以外は、実信号のスペクトルの片側 (numBins 個) だけを確保する。
+    // Arena が確保したメモリは 0 で初期化されている
+    _arena.build([&](Arena &arena) {
+        arena.bind(_signalBuffer, fftSize);
+        arena.bind(_frequencyBuffer, fftSize);
+        arena.bind(_tmpFFTBuffer, fftSize);
+        arena.bind(_tmpFFTBuffer2, fftSize);
+        arena.bind(_cepstrumBuffer, fftSize);
+        arena.bind(_originalEnvelope, numBins);
+        arena.bind(_correctionRatios, numChannels + 1);
+        arena.bind(_channelPowers, numChannels);
+        for(auto &s: _channelSpectrums) {
+            arena.bind(s, fftSize);
+        }
+        arena.bind(_channelRatios, numBins);
+        // 末尾のチャンネルはステレオリンク時の解析用
+        arena.bind(_prevInputPhases, numChannels + 1, numBins);
+        arena.bind(_tmpPhaseBuffer, numBins);
+        arena.bind(_analysisMagnitude, numBins);
+        arena.bind(_analysisFrequencies, numBins);
+        arena.bind(_synthesizeMagnitude, numBins);
+        arena.bind(_synthesizeFrequencies, numBins);
+        arena.bind(_sourceBins, numBins);
+        for(int v = 0; v < kMaxVoices; ++v) {
+            arena.bind(_voiceSpectrums[v], numBins);
+            arena.bind(_voiceSourceBins[v], numBins);
+        }
+        arena.bind(_prevOutputPhases, (numChannels + 1) * kMaxVoices, numBins);
+        arena.bind(_tmpBuffer, numChannels, fftSize);
+    });
+
+    _inputRingBuffer.resize(numChannels, fftSize);
+    _inputRingBuffer.discardAll();
+    _inputRingBuffer.fill(fftSize - overlapSize);
+    _bufferInfoList.resize(numChannels);
+
+    // 出力リングバッファにあらかじめ詰めておくサンプル数の余裕。
+    // オーバーラップ加算が完了していないサンプルを読み出さないようにするには、少なくとも overlapSize - 1 サンプル必要になる。
+    // Standard モードでは、さらにホストのブロックサイズ分の余裕を持たせる。
+    // バッファを確保するための _maxBlockSize は切り上げられていることがあるので、レイテンシーには使用しない
+    int const outputMargin = (config._latencyMode == LatencyMode::kMinimum)
+    ?   overlapSize - 1
+    :   std::max(config._hostBlockSize, overlapSize - 1);
+
+    // 合成窓の先頭の 0 の領域は出力されないので、レイテンシーは合成窓の長さで決まる
+    _latencySamples = _synthesisLength - overlapSize + outputMargin;
+
+    _outputRingBuffer.resize(numChannels, _synthesisLength + outputMargin);
+    _outputRingBuffer.discardAll();
+    _outputRingBuffer.fill(_synthesisLength + outputMargin - overlapSize);
+
+    _voiceSpectrumData.resize(numBins);
+
+    _linkedReferenceChannel = 0;
+    _prevStereoLinkMode = StereoLinkMode::kOff;
+
+    _correctionRatios.fill(1.0);
+
+    _tmpSpectrums.resize(numChannels);
+    for(auto &s: _tmpSpectrums) {
+        s.resize(numBins);
+        s.clear();
+    }
+
+    _smoothedGain.reset(10);
+}
+
+template<class SampleType>
+bool SpectralEngine<SampleType>::process(AudioBufferType &input, AudioBufferType &output, FrameParameters const &params)
+{
+    auto const numChannels = getNumChannels();
+    auto const bufferSize = input.getNumSamples();
+
+    jassert(input.getNumChannels() >= numChannels && output.getNumChannels() >= numChannels);
+    jassert(output.getNumSamples() == bufferSize);
+
+    bool processed = false;
+    int bufferConsumed = 0;
+
+    for( ; ; ) {
+        if(bufferConsumed == bufferSize) { break; }
+
+        auto const numWritable = _inputRingBuffer.getNumWritable();
+
+        assert(numWritable != 0);
+
+        auto const numToWrite = std::min(numWritable, (bufferSize - bufferConsumed));
+
+        // 入力信号の異常は数えるだけにする。そのフレームの処理結果は、後続の段階の検査で破棄される
+        if(_config._health != nullptr) {
+            HealthCounts counts;
+            for(int ch = 0; ch < numChannels; ++ch) {
+                counts += NumericalHealth::scan(input.getReadPointer(ch, bufferConsumed), numToWrite, (SampleType)kMaxSampleValue);
+            }
+            _config._health->record(HealthStage::kInput, counts);
+        }
+
+        auto const writeResult = _inputRingBuffer.write(getSubBufferOf(input, numChannels, bufferConsumed, numToWrite));
+        jassert(writeResult);
+        juce::ignoreUnused(writeResult);
+
+        if(_inputRingBuffer.isFull()) {
+            processAudioBlock(params);
+            processed = true;
+        }
+
+        auto const readResult = _outputRingBuffer.read(getSubBufferOf(output, numChannels, bufferConsumed, numToWrite));
+        jassert(readResult);
+        juce::ignoreUnused(readResult);
+
+        _outputRingBuffer.discard(numToWrite);
+
+        bufferConsumed += numToWrite;
+    }
+
+    return processed;
+}
+
+// Helper function to wrap the phase between -pi and pi
+float wrapPhase(float phaseIn)
+{
+    if (phaseIn >= 0) {
+        return (float)(fmod(phaseIn + M_PI, 2.0 * M_PI) - M_PI);
+    } else {
+        return (float)(fmod(phaseIn - M_PI, -2.0 * M_PI) + M_PI);
+    }
+}
+
+#define CEPSTRUM_FFT_FLAG true
+
+template<class SampleType>
+void SpectralEngine<SampleType>::processAudioBlock(FrameParameters const &params)
+{
+    HWM_ENGINE_PROFILE_SCOPE(kFrame);
+
+    auto const fftSize = getFFTSize();
+    auto const overlapSize = getOverlapSize();
+    auto const numBins = getNumBins();
+    auto const numChannels = _inputRingBuffer.getNumChannels();
+
+    // ステレオリンクはチャンネルが 2 つ以上あるときだけ有効にする
+    auto const stereoLinkMode = (numChannels >= 2) ? params._stereoLinkMode : StereoLinkMode::kOff;
+
+    jassert(_signalBuffer.size() == fftSize);
+    jassert(_frequencyBuffer.size() == fftSize);
+    jassert(_cepstrumBuffer.size() == fftSize);
+
+    _inputRingBuffer.readWithoutCopy([&, this](int ch, auto const &bi) {
+        _bufferInfoList[ch] = bi;
+        assert(bi._len1 + bi._len2 >= fftSize);
+    });
+
+    // リンクの有無が切り替わったときは、位相の状態を引き継いで位相が不連続にならないようにする
+    if(stereoLinkMode != StereoLinkMode::kOff && _prevStereoLinkMode == StereoLinkMode::kOff) {
+        _prevInputPhases.copyFrom(getLinkedPhaseIndex(), 0, _prevInputPhases, 0, 0, numBins);
+        for(int v = 0; v < kMaxVoices; ++v) {
+            _prevOutputPhases.copyFrom(getOutputPhaseIndex(getLinkedPhaseIndex(), v), 0,
+                                       _prevOutputPhases, getOutputPhaseIndex(0, v), 0, numBins);
+        }
+    } else if(stereoLinkMode == StereoLinkMode::kOff && _prevStereoLinkMode != StereoLinkMode::kOff) {
+        for(int ch = 0; ch < numChannels; ++ch) {
+            _prevInputPhases.copyFrom(ch, 0, _prevInputPhases, getLinkedPhaseIndex(), 0, numBins);
+            for(int v = 0; v < kMaxVoices; ++v) {
+                _prevOutputPhases.copyFrom(getOutputPhaseIndex(ch, v), 0,
+                                           _prevOutputPhases, getOutputPhaseIndex(getLinkedPhaseIndex(), v), 0, numBins);
+            }
+        }
+    }
+    _prevStereoLinkMode = stereoLinkMode;
+
+    _tmpBuffer.clear();
+    _frameCorrupted = false;
+
+    if(stereoLinkMode != StereoLinkMode::kOff) {
+        processLinkedChannels(params);
+    } else {
+        for(int ch = 0; ch < numChannels; ++ch) {
+            auto & specData = _tmpSpectrums[ch];
+            _frameCaptureGraphs = params._capture.hasChannel(ch) ? params._capture._graphs : 0;
+
+            auto const originalPower = loadFrame(_bufferInfoList[ch]);
+
+            // スペクトルに変換
+            {
+                HWM_ENGINE_PROFILE_SCOPE(kForwardFFT);
+                _fft->perform(_signalBuffer.data(), _frequencyBuffer.data(), false);
+            }
+
+            checkHealth(HealthStage::kForwardFFT, NumericalHealth::scan(_frequencyBuffer.data(), numBins, kMaxSpectrumValue));
+
+            if(isCaptured(SpectrumGraph::kOriginalSpectrum, specData)) {
+                std::copy_n(_frequencyBuffer.data(), numBins, specData._originalSpectrum.data());
+            }
+
+            processSpectrum(ch, specData, params);
+            synthesizeFrame(ch, _frequencyBuffer, originalPower);
+        }
+    }
+
+    if(_frameCorrupted) {
+        recoverFromCorruption();
+    }
+
+    // 合成窓が 0 でない末尾の領域だけを出力にオーバーラップ加算する
+    {
+        HWM_ENGINE_PROFILE_SCOPE(kOverlapAdd);
+        if(_outputRingBuffer.overlapAdd(_tmpBuffer, _synthesisLength - overlapSize, fftSize - _synthesisLength) == false) {
+            assert("should never fail" && false);
+        }
+    }
+    
+    _inputRingBuffer.discard(overlapSize);
+}
+
+template<class SampleType>
+void SpectralEngine<SampleType>::processLinkedChannels(FrameParameters const &params)
+{
+    auto const mode = params._stereoLinkMode;
+    auto const fftSize = getFFTSize();
+    auto const numBins = getNumBins();
+    auto const numChannels = _inputRingBuffer.getNumChannels();
+
+    auto const numVoices = juce::jlimit(1, kMaxVoices, params._numVoices);
+
+    // チャンネルごとの解析は FFT までに留める
+    for(int ch = 0; ch < numChannels; ++ch) {
+        _channelPowers[ch] = loadFrame(_bufferInfoList[ch]);
+
+        {
+            HWM_ENGINE_PROFILE_SCOPE(kForwardFFT);
+            _fft->perform(_signalBuffer.data(), _channelSpectrums[ch].data(), false);
+        }
+
+        checkHealth(HealthStage::kForwardFFT, NumericalHealth::scan(_channelSpectrums[ch].data(), numBins, kMaxSpectrumValue));
+    }
+
+    // 解析に使用するスペクトルを決める
+    if(mode == StereoLinkMode::kMid) {
+        // 位相はミッド信号 (各チャンネルのスペクトルの平均) から取り、振幅は各チャンネルの振幅の平均にする。
+        // ミッド信号の振幅をそのまま使うと、逆相やサイド成分が主のビンで打ち消し合って 0 に近くなり、
+        // 各チャンネルに適用する振幅の比が不安定になってステレオ感が失われる
+        for(int i = 0; i < fftSize; ++i) {
+            ComplexType sum {};
+            float sumMagnitude = 0;
+            int loudest = 0;
+            for(int ch = 0; ch < numChannels; ++ch) {
+                auto const &value = _channelSpectrums[ch][i];
+                auto const magnitude = std::abs(value);
+                sum += value;
+                sumMagnitude += magnitude;
+                if(magnitude > std::abs(_channelSpectrums[loudest][i])) { loudest = ch; }
+            }
+
+            auto const magnitude = sumMagnitude / numChannels;
+            auto const sumAbs = std::abs(sum) / numChannels;
+
+            // ミッド信号が打ち消し合っているビンでは、位相を最も大きいチャンネルから取る
+            auto const &phaseSource = (sumAbs > magnitude * kMinMidMagnitudeRatio) ? sum : _channelSpectrums[loudest][i];
+            auto const phaseSourceAbs = std::abs(phaseSource);
+            _frequencyBuffer[i] = (phaseSourceAbs > 0)
+            ?   phaseSource * (magnitude / phaseSourceAbs)
+            :   ComplexType {};
+        }
+    } else {
+        // 参照するチャンネルがフレームごとに頻繁に切り替わらないように、
+        // 現在のチャンネルより十分 (約 1dB) 大きいときだけ切り替える
+        double const hysteresis = 1.25;
+        auto const loudest = (int)std::distance(_channelPowers.begin(),
+                                                std::max_element(_channelPowers.begin(), _channelPowers.end()));
+        _linkedReferenceChannel = std::min(_linkedReferenceChannel, numChannels - 1);
+        if(_channelPowers[loudest] > _channelPowers[_linkedReferenceChannel] * hysteresis) {
+            _linkedReferenceChannel = loudest;
+        }
+
+        std::copy_n(_channelSpectrums[_linkedReferenceChannel].data(), fftSize, _frequencyBuffer.data());
+    }
+
+    // 代表のスペクトルに対してだけ、スペクトル包絡・瞬時周波数・合成位相を計算する。
+    // 表示用のデータは 0 番目のチャンネルに書き込み、ほかのチャンネルにはあとでコピーする
+    auto & refSpecData = _tmpSpectrums[0];
+    auto const &capture = params._capture;
+    _frameCaptureGraphs = capture.isEmpty() ? 0 : capture._graphs;
+
+    if(isCaptured(SpectrumGraph::kOriginalSpectrum, refSpecData)) {
+        std::copy_n(_frequencyBuffer.data(), numBins, refSpecData._originalSpectrum.data());
+    }
+
+    processSpectrum(getLinkedPhaseIndex(), refSpecData, params);
+
+    // 各チャンネルには、代表のスペクトルとの振幅と位相の差分だけを適用する
+    // (_analysisMagnitude と _prevInputPhases の末尾のチャンネルには、代表のスペクトルの振幅と位相が入っている)。
+    // 位相の差分も適用するので、逆相の成分やチャンネル間の位相差によるステレオ感はそのまま残る。
+    // Mid では代表の振幅が各チャンネルの振幅の平均なので、振幅の比はチャンネル数を超えない
+    float const maxRatio = std::max(kMaxLinkedMagnitudeRatio, (float)numChannels);
+    auto const *refPhases = _prevInputPhases.getReadPointer(getLinkedPhaseIndex());
+    for(int ch = 0; ch < numChannels; ++ch) {
+        auto & spectrum = _channelSpectrums[ch];
+
+        for(int i = 0; i < numBins; ++i) {
+            // 代表の振幅が無視できるほど小さいビンでは差分を求められないので、代表の処理結果をそのまま使う
+            auto const refMagnitude = _analysisMagnitude[i];
+            if(refMagnitude <= std::numeric_limits<float>::min()) {
+                _channelRatios[i] = ComplexType { 1.0f, 0.0f };
+                continue;
+            }
+
+            auto const ratio = std::min(std::abs(spectrum[i]) / refMagnitude, maxRatio);
+            _channelRatios[i] = std::polar(ratio, std::arg(spectrum[i]) - refPhases[i]);
+        }
+
+        // ボイスごとに、合成したビンが参照した解析スペクトルのビンの差分を適用して足し合わせる
+        for(int i = 0; i < numBins; ++i) {
+            ComplexType sum {};
+            for(int v = 0; v < numVoices; ++v) {
+                auto const src = _voiceSourceBins[v][i];
+                if(src >= 0) {
+                    sum += _voiceSpectrums[v][i] * _channelRatios[src];
+                }
+            }
+            spectrum[i] = sum;
+        }
+
+        for(int i = 1; i < fftSize / 2; ++i) {
+            spectrum[fftSize - i] = std::conj(spectrum[i]);
+        }
+
+        if(capture.hasChannel(ch)) {
+            auto & specData = _tmpSpectrums[ch];
+            if(ch != 0) {
+                specData.copyFrom(refSpecData, numBins, capture._graphs);
+            }
+
+            if(capture.hasGraph(SpectrumGraph::kSynthesisSpectrum)) {
+                std::copy_n(spectrum.data(), numBins, specData._synthesisSpectrum.data());
+            }
+        }
+
+        synthesizeFrame(ch, spectrum, _channelPowers[ch]);
+    }
+}
+
+template<class SampleType>
+double SpectralEngine<SampleType>::loadFrame(typename RingBufferType::ConstBufferInfo const &bi)
+{
+    HWM_ENGINE_PROFILE_SCOPE(kFraming);
+
+    auto const fftSize = getFFTSize();
+    auto const *window = _tables->_scaledAnalysisWindow.data();
+    double originalPower = 0;
+
+    // 音量補正の基準となるパワーは、合成窓が 0 でない領域だけで計算する。
+    // 入力信号に掛ける _frameScale は解析窓に含めてあるので、パワーには最後にまとめて掛ける
+    int const powerBegin = fftSize - _synthesisLength;
+
+    for(int i = 0, end = std::min(fftSize, bi._len1); i < end; ++i) {
+        auto const smp = bi._buf1[i];
+        if(i >= powerBegin) {
+            originalPower += smp * smp;
+        }
+        _signalBuffer[i] = ComplexType { (float)(smp * window[i]), 0 };
+    }
+
+    for(int i = bi._len1, end = fftSize; i < end; ++i) {
+        auto const smp = bi._buf2[i - bi._len1];
+        if(i >= powerBegin) {
+            originalPower += smp * smp;
+        }
+        _signalBuffer[i] = ComplexType { (float)(smp * window[i]), 0 };
+    }
+
+    auto const frameScale = _tables->_frameScale;
+    return originalPower * frameScale * frameScale;
+}
+
+template<class SampleType>
+void SpectralEngine<SampleType>::processSpectrum(int phaseIndex, SpectrumData &specData, FrameParameters const &params)
+{
+    auto const fftSize = getFFTSize();
+    auto const numBins = getNumBins();
+    auto const numVoices = juce::jlimit(1, kMaxVoices, params._numVoices);
+
+    // スペクトル包絡と瞬時周波数は、すべてのボイスで共通の解析結果を使用する
+    computeEnvelope(specData, params._envelopeOrder);
+    std::copy_n(specData._envelope.data(), numBins, _originalEnvelope.data());
+    estimatePitch(specData);
+    analyzeFrequencies(phaseIndex);
+
+    auto const correctionRatio = params._pitchCorrection ? updatePitchCorrection(phaseIndex, specData, params) : 1.0;
+
+    // UI にはメインのボイスの処理結果を表示するので、2 つ目以降のボイスは作業用の SpectrumData で処理する
+    for(int v = 0; v < numVoices; ++v) {
+        auto &voiceData = (v == 0) ? specData : _voiceSpectrumData;
+        auto voiceParams = params._voices[v];
+        voiceParams._pitchChangeAmount *= correctionRatio;
+        synthesizeVoice(phaseIndex, v, voiceData, voiceParams, params._envelopeOrder);
+    }
+
+    // ボイスのスペクトルは片側だけを保持しているので、足し合わせてから負の周波数側を埋める
+    std::copy_n(_voiceSpectrums[0].data(), numBins, _frequencyBuffer.data());
+    for(int v = 1; v < numVoices; ++v) {
+        for(int i = 0; i < numBins; ++i) {
+            _frequencyBuffer[i] += _voiceSpectrums[v][i];
+        }
+    }
+
+    for(int i = 1; i < fftSize / 2; ++i) {
+        _frequencyBuffer[fftSize - i] = std::conj(_frequencyBuffer[i]);
+    }
+
+    if(numVoices > 1 && isCaptured(SpectrumGraph::kSynthesisSpectrum, specData)) {
+        std::copy_n(_frequencyBuffer.data(), numBins, specData._synthesisSpectrum.data());
+    }
+}
+
+template<class SampleType>
+void SpectralEngine<SampleType>::synthesizeVoice(int phaseIndex, int voice, SpectrumData &specData, VoiceParameters const &voiceParams, int envelopeOrder)
+{
+    auto const fftSize = getFFTSize();
+    auto const numBins = getNumBins();
+
+    if(voice != 0) {
+        std::copy_n(_originalEnvelope.data(), numBins, specData._envelope.data());
+    }
+
+    shiftFormant(specData, voiceParams._formantExpandAmount);
+    shiftPitch(phaseIndex, voice, voiceParams._pitchChangeAmount);
+
+    for(int i = 0; i < numBins; ++i) {
+        _tmpPhaseBuffer[i] = std::arg(_frequencyBuffer[i]);
+    }
+
+    // ピッチシフト後のスペクトル
+    if(isCaptured(SpectrumGraph::kShiftedSpectrum, specData)) {
+        std::copy_n(_frequencyBuffer.data(), numBins, specData._shiftedSpectrum.data());
+    }
+
+    // ピッチが低い方にシフトされたとき、
+    // シフト後のスペクトルはナイキスト周波数のシフトされた位置で急激に値が下がるため、スペクトルを波形として捉えたときにその波形が不連続になる。
+    // このとき Envelope の次数が小さいと、不連続な部分での値の変動に追従できないため、その差分が FineStructure の方に現れてしまう。
+    // これによって FineStructure がナイキスト周波数のシフトされた位置付近で値が大きくなってしまい、高域のノイズになる。
+    // これを防ぐため、ナイキスト周波数のシフトされた位置の対数振幅スペクトルは、それ以下の振幅スペクトルのミラーとして計算するようにする。
+    if(voiceParams._pitchChangeAmount < 1.0) {
+        auto newNyquistPos = (int)std::round(fftSize * 0.5 * voiceParams._pitchChangeAmount);
+        for(int i = 0; i < fftSize / 2; ++i) {
+            if(newNyquistPos + i >= fftSize / 2) { break; }
+            if(newNyquistPos - i < 0) { break; }
+
+            _frequencyBuffer[newNyquistPos + i] = _frequencyBuffer[newNyquistPos - i];
+        }
+
+        for(int i = 1; i < fftSize / 2; ++i) {
+            _frequencyBuffer[fftSize - i] = _frequencyBuffer[i];
+        }
+    }
+
+    extractFineStructure(specData, envelopeOrder, voiceParams._pitchChangeAmount);
+    recombineSpectrum(specData);
+
+    std::copy_n(_frequencyBuffer.data(), numBins, _voiceSpectrums[voice].data());
+    std::copy_n(_sourceBins.data(), numBins, _voiceSourceBins[voice].data());
+}
+
+template<class SampleType>
+void SpectralEngine<SampleType>::computeEnvelope(SpectrumData &specData, int envelopOrder)
+{
+    HWM_ENGINE_PROFILE_SCOPE(kEnvelope);
+
+    auto const fftSize = getFFTSize();
+
+    // ピッチシフト前のスペクトルからスペクトル包絡を計算
+    for(int i = 0; i < fftSize; ++i) {
+        auto amp = std::abs(_frequencyBuffer[i]);
+        if(amp == 0) {
+            amp += std::numeric_limits<float>::min();
+        }
+
+        auto r = std::log(amp);
+        _tmpFFTBuffer[i] = ComplexType { r, 0.0 };
+    }
+
+    _fft->perform(_tmpFFTBuffer.data(), _cepstrumBuffer.data(), CEPSTRUM_FFT_FLAG);
+
+    // 実数の対数振幅スペクトルのケプストラムは対称なので、片側だけを保持する
+    std::copy_n(_cepstrumBuffer.data(), specData._originalCepstrum.size(), specData._originalCepstrum.data());
+
+    // ケプストラムを liftering してスペクトル包絡を取得
+
+    // envelope
+    _tmpFFTBuffer[0] = _cepstrumBuffer[0];
+    for(int i = 1; i <= fftSize / 2; ++i) {
+        if(i < envelopOrder) {
+            _tmpFFTBuffer[i] = _cepstrumBuffer[i];
+            _tmpFFTBuffer[fftSize - i] = _cepstrumBuffer[i];
+        } else {
+            _tmpFFTBuffer[i] = _tmpFFTBuffer[fftSize - i] = ComplexType { 0, 0 };
+        }
+    }
+
+    _fft->perform(_tmpFFTBuffer.data(), _tmpFFTBuffer2.data(), !CEPSTRUM_FFT_FLAG);
+
+    std::copy_n(_tmpFFTBuffer2.data(), specData._envelope.size(), specData._envelope.data());
+
+    checkHealth(HealthStage::kEnvelope, NumericalHealth::scan(specData._envelope.data(), specData._envelope.size(), kMaxLogAmplitude));
+}
+
+template<class SampleType>
+void SpectralEngine<SampleType>::estimatePitch(SpectrumData &specData)
+{
+    auto const fftSize = getFFTSize();
+    auto const sampleRate = _config._sampleRate;
+    auto const &cepstrum = specData._originalCepstrum;
+
+    int const minQuefrency = std::max(2, (int)std::floor(sampleRate / kMaxF0));
+    int const maxQuefrency = std::min((int)std::ceil(sampleRate / kMinF0), fftSize / 3);
+
+    specData._f0 = 0;
+    specData._f0Confidence = 0;
+
+    if(minQuefrency + 2 >= maxQuefrency) { return; }
+
+    int peak = minQuefrency;
+    double sumAbs = 0;
+    for(int q = minQuefrency; q <= maxQuefrency; ++q) {
+        auto const c = cepstrum[q].real();
+        sumAbs += std::abs(c);
+        if(c > cepstrum[peak].real()) {
+            peak = q;
+        }
+    }
+
+    // 探索範囲の平均的な大きさに対するピークの比を信頼度にする。
+    // 雑音ではこの比がおよそ 5 以下になり、明瞭な有声音では 10 を超える
+    auto const meanAbs = sumAbs / (maxQuefrency - minQuefrency + 1);
+    auto const peakValue = cepstrum[peak].real();
+    if(meanAbs <= 0 || peakValue <= 0) { return; }
+
+    auto const ratio = peakValue / meanAbs;
+    specData._f0Confidence = (float)juce::jlimit(0.0, 1.0, (ratio - 5.0) / 5.0);
+
+    // 放物線補間でピークの位置を細かく求める
+    double offset = 0;
+    if(peak > minQuefrency && peak < maxQuefrency) {
+        auto const l = cepstrum[peak - 1].real();
+        auto const r = cepstrum[peak + 1].real();
+        auto const denom = l - 2.0 * peakValue + r;
+        if(std::abs(denom) > 1e-12) {
+            offset = juce::jlimit(-0.5, 0.5, 0.5 * (l - r) / denom);
+        }
+    }
+
+    specData._f0 = (float)(sampleRate / (peak + offset));
+}
+
+template<class SampleType>
+double SpectralEngine<SampleType>::updatePitchCorrection(int phaseIndex, SpectrumData const &specData, FrameParameters const &params)
+{
+    auto &ratio = _correctionRatios.getReference(phaseIndex);
+
+    // ほかのエンジンが追跡した補正量を使うときは、それに合わせるだけにする
+    if(params._pitchCorrectionRatios != nullptr) {
+        ratio = params._pitchCorrectionRatios[phaseIndex];
+        return ratio;
+    }
+
+    // 無声音のフレームでは直前の補正量を保持する
+    if(specData._f0Confidence < kVoicingThreshold || specData._f0 <= 0) {
+        return ratio;
+    }
+
+    auto const note = 69.0 + 12.0 * std::log2(specData._f0 / 440.0);
+    auto const target = 440.0 * std::pow(2.0, (std::round(note) - 69.0) / 12.0);
+    auto const targetRatio = target / specData._f0;
+
+    // 補正量が急に変わってノイズにならないように、約 20ms の時定数で追従させる
+    auto const timeConstant = 0.02;
+    auto const coeff = 1.0 - std::exp(-getOverlapSize() / (_config._sampleRate * timeConstant));
+    ratio += (targetRatio - ratio) * coeff;
+
+    return ratio;
+}
+
+template<class SampleType>
+void SpectralEngine<SampleType>::shiftFormant(SpectrumData &specData, double formantExpandAmount)
+{
+    HWM_ENGINE_PROFILE_SCOPE(kFormantShift);
+
+    auto const fftSize = getFFTSize();
+
+    std::copy(specData._envelope.begin(), specData._envelope.end(), _tmpFFTBuffer.begin());
+    jassert(specData._envelope.size() == fftSize / 2 + 1);
+
+    for(int i = 0; i <= fftSize / 2; ++i) {
+        double shiftedPos = i / formantExpandAmount;
+        int leftIndex = (int)std::floor(shiftedPos);
+        int rightIndex = (int)std::ceil(shiftedPos);
+        double diff = shiftedPos - leftIndex;
+
+        double leftValue = -1000.0;
+        double rightValue = -1000.0;
+
+        if(leftIndex <= fftSize / 2) {
+            leftValue = _tmpFFTBuffer[leftIndex].real();
+        }
+
+        if(rightIndex <= fftSize / 2) {
+            rightValue = _tmpFFTBuffer[rightIndex].real();
+        }
+
+        double newValue = (1.0 - diff) * leftValue + diff * rightValue;
+        specData._envelope[i].real((float)newValue);
+    }
+}
+
+template<class SampleType>
+void SpectralEngine<SampleType>::analyzeFrequencies(int phaseIndex)
+{
+    HWM_ENGINE_PROFILE_SCOPE(kAnalysis);
+
+    auto const fftSize = getFFTSize();
+    double const hopSize = getOverlapSize();
+    auto const *binPhaseAdvances = _tables->_binPhaseAdvances.data();
+
+    // 瞬時周波数からbin内の正確な周波数を解析
+    for(int i = 0; i <= fftSize / 2; ++i) {
+        auto magnitude = std::abs(_frequencyBuffer[i]);
+        auto phase = std::arg(_frequencyBuffer[i]);
+
+        double phaseDiff = phase - _prevInputPhases.getReadPointer(phaseIndex)[i]; // 前回フレームからの位相の進んだ量
+        _prevInputPhases.getWritePointer(phaseIndex)[i] = phase;
+
+        phaseDiff = wrapPhase(phaseDiff - binPhaseAdvances[i]); // 中心周波数が hopSize によって進む量との差分を検出
+        double binDeviation = phaseDiff * fftSize / (hopSize * 2 * M_PI); // それを周波数ビン1つ分の周波数幅 * hopSize で割る => 周波数ビン1つのなかでの相対位置を 0.0..1.0 で算出する。
+
+        _analysisMagnitude[i] = magnitude;
+        _analysisFrequencies[i] = (float)(i + binDeviation);
+    }
+
+    auto counts = NumericalHealth::scan(_analysisMagnitude.data(), _analysisMagnitude.size(), kMaxSpectrumValue);
+    counts += NumericalHealth::scan(_analysisFrequencies.data(), _analysisFrequencies.size(), kMaxSpectrumValue);
+    checkHealth(HealthStage::kAnalysis, counts);
+}
+
+template<class SampleType>
+void SpectralEngine<SampleType>::shiftPitch(int phaseIndex, int voice, double pitchChangeAmount)
+{
+    HWM_ENGINE_PROFILE_SCOPE(kSynthesis);
+
+    auto const fftSize = getFFTSize();
+    double const hopSize = getOverlapSize();
+    auto const outputPhaseIndex = getOutputPhaseIndex(phaseIndex, voice);
+    auto const *binPhaseAdvances = _tables->_binPhaseAdvances.data();
+
+    // 周波数変更
+    _synthesizeMagnitude.fill(0.0f);
+    _synthesizeFrequencies.fill(0.0f);
+    _sourceBins.fill(-1);
+    for(int i = 0; i <= fftSize / 2; ++i) {
+        int shiftedBin = std::floor(i / pitchChangeAmount + 0.5);
+        if(shiftedBin > fftSize / 2) { break; }
+
+        // magnitude 
+        _synthesizeMagnitude[i] += _analysisMagnitude[shiftedBin];
+        _synthesizeFrequencies[i] = _analysisFrequencies[shiftedBin] * pitchChangeAmount;
+        _sourceBins[i] = shiftedBin;
+    }
+
+    for(int i = 0; i <= fftSize / 2; ++i) {
+        double binDeviation = _synthesizeFrequencies[i] - i;
+        double phaseDiff = binDeviation * 2.0 * M_PI * hopSize / fftSize;
+        phaseDiff += binPhaseAdvances[i];
+
+        auto phase = wrapPhase(_prevOutputPhases.getReadPointer(outputPhaseIndex)[i] + phaseDiff);
+
+        _frequencyBuffer[i] = ComplexType {
+            (float)(_synthesizeMagnitude[i] * std::cos(phase)),
+            (float)(_synthesizeMagnitude[i] * std::sin(phase))
+        };
+
+        _prevOutputPhases.getWritePointer(outputPhaseIndex)[i] = phase;
+    }
+
+    for(int i = 1; i < fftSize / 2; ++i) {
+        _frequencyBuffer[fftSize - i] = std::conj(_frequencyBuffer[i]);
+    }
+
+    // 合成位相は次のフレームに引き継ぐので、スペクトルと合わせて検査する
+    auto counts = NumericalHealth::scan(_frequencyBuffer.data(), getNumBins(), kMaxSpectrumValue);
+    counts += NumericalHealth::scan(_prevOutputPhases.getReadPointer(outputPhaseIndex), getNumBins(), kMaxSpectrumValue);
+    checkHealth(HealthStage::kSynthesis, counts);
+}
+
+template<class SampleType>
+void SpectralEngine<SampleType>::extractFineStructure(SpectrumData &specData, int envelopOrder, double pitchChangeAmount)
+{
+    HWM_ENGINE_PROFILE_SCOPE(kFineStructure);
+
+    auto const fftSize = getFFTSize();
+
+    // ピッチシフト後の波形からケプストラムを計算し、微細構造だけを取り出す
+
+    // 対数振幅スペクトルを FFT してケプストラムを計算
+    for(int i = 0; i < fftSize; ++i) {
+        auto amp = std::abs(_frequencyBuffer[i]);
+        auto r = log(amp + std::numeric_limits<float>::epsilon());
+        _tmpFFTBuffer[i] = ComplexType { r, 0.0 };
+    }
+
+    _fft->perform(_tmpFFTBuffer.data(), _cepstrumBuffer.data(), CEPSTRUM_FFT_FLAG);
+
+    // fine structure
+    _tmpFFTBuffer[0] = ComplexType { 0, 0 };
+    for(int i = 1; i <= fftSize / 2; ++i) {
+        if(i >= envelopOrder) {
+            _tmpFFTBuffer[i] = _cepstrumBuffer[i];
+            _tmpFFTBuffer[fftSize - i] = _cepstrumBuffer[i];
+        } else {
+            _tmpFFTBuffer[i] = _tmpFFTBuffer[fftSize - i] = ComplexType { 0, 0 };
+        }
+    }
+
+    _fft->perform(_tmpFFTBuffer.data(), _tmpFFTBuffer2.data(), !CEPSTRUM_FFT_FLAG);
+
+    // ミラーした領域の微細構造は無視する
+    if(pitchChangeAmount < 1.0) {
+        auto newNyquistPos = (int)std::round(fftSize * 0.5 * pitchChangeAmount);
+
+        for(int i = newNyquistPos; i < fftSize / 2; ++i) {
+            _tmpFFTBuffer2[i] = ComplexType{};
+        }
+    }
+
+    std::copy_n(_tmpFFTBuffer2.data(), specData._fineStructure.size(), specData._fineStructure.data());
+
+    checkHealth(HealthStage::kFineStructure, NumericalHealth::scan(specData._fineStructure.data(), specData._fineStructure.size(), kMaxLogAmplitude));
+
+#if 0
+    // use pitch shifted envelope
+    _tmpFFTBuffer[0] = _cepstrumBuffer[0];
+    for(int i = 1; i <= fftSize / 2; ++i) {
+        if(i < envelopOrder) {
+            _tmpFFTBuffer[i] = _cepstrumBuffer[i];
+            _tmpFFTBuffer[fftSize - i] = _cepstrumBuffer[i];
+        } else {
+            _tmpFFTBuffer[i] = _tmpFFTBuffer[fftSize - i] = ComplexType { 0, 0 };
+        }
+    }
+
+    _fft->perform(_tmpFFTBuffer.data(), _tmpFFTBuffer2.data(), !CEPSTRUM_FFT_FLAG);
+
+    for(int i = 0; i < fftSize; ++i) {
+        specData._envelope[i] = _tmpFFTBuffer2[i];
+    }
+#endif
+}
+
+template<class SampleType>
+void SpectralEngine<SampleType>::recombineSpectrum(SpectrumData &specData)
+{
+    HWM_ENGINE_PROFILE_SCOPE(kRecombine);
+
+    auto const fftSize = getFFTSize();
+    auto const envelopAmount = 1.0;
+    auto const fineStructureAmount = 1.0;
+
+    // フォルマントシフトしたスペクトル包絡とピッチシフト後の微細構造からスペクトルを再構築
+
+    for(int i = 0; i <= fftSize / 2; ++i) {
+        auto const amp = exp(specData._envelope[i].real() * envelopAmount + specData._fineStructure[i].real() * fineStructureAmount);
+
+        _frequencyBuffer[i] = ComplexType {
+            (float)(amp * std::cos(_tmpPhaseBuffer[i])),
+            (float)(amp * std::sin(_tmpPhaseBuffer[i]))
+        };
+    }
+
+    for(int i = 1; i < fftSize / 2; ++i) {
+        _frequencyBuffer[fftSize - i] = std::conj(_frequencyBuffer[i]);
+    }
+
+    checkHealth(HealthStage::kRecombine, NumericalHealth::scan(_frequencyBuffer.data(), getNumBins(), kMaxSpectrumValue));
+
+    // 再合成されたスペクトル
+    if(isCaptured(SpectrumGraph::kSynthesisSpectrum, specData)) {
+        std::copy_n(_frequencyBuffer.data(), specData._synthesisSpectrum.size(), specData._synthesisSpectrum.data());
+    }
+}
+
+template<class SampleType>
+void SpectralEngine<SampleType>::synthesizeFrame(int ch, ArenaArray<ComplexType> &spectrum, double originalPower)
+{
+    auto const fftSize = getFFTSize();
+
+    {
+        HWM_ENGINE_PROFILE_SCOPE(kInverseFFT);
+        _fft->perform(spectrum.data(), _signalBuffer.data(), true);
+    }
+
+    auto const *synthesisWindow = _tables->_synthesisWindow.data();
+    for(int i = 0; i < fftSize; ++i) {
+        _signalBuffer[i] *= synthesisWindow[i];
+    }
+
+    std::transform(_signalBuffer.begin(),
+                   _signalBuffer.end(),
+                   _tmpBuffer.getWritePointer(ch),
+                   [](auto x) { return (SampleType)x.real(); }
+                   );
+
+    double const synthesizedPower = std::reduce(_tmpBuffer.getReadPointer(ch),
+                                                _tmpBuffer.getReadPointer(ch) + fftSize,
+                                                0.0f,
+                                                [](double sum, double x) { return sum + (x * x); }
+                                                );
+
+    float const expectedGainAmount = (float)std::sqrt((synthesizedPower == 0) ? 1.0 : originalPower / synthesizedPower);
+    _smoothedGain.setTargetValue(expectedGainAmount);
+    for(int i = 0; i < fftSize; ++i) {
+        _tmpBuffer.getWritePointer(ch)[i] *= _smoothedGain.getNextValue();
+    }
+
+    checkHealth(HealthStage::kOutput, NumericalHealth::scan(_tmpBuffer.getReadPointer(ch), fftSize, (SampleType)kMaxSampleValue));
+}
+
+template<class SampleType>
+void SpectralEngine<SampleType>::checkHealth(HealthStage stage, HealthCounts const &counts)
+{
+    if(_config._health != nullptr) {
+        _config._health->record(stage, counts);
+    }
+
+    if(counts.isCorrupted()) {
+        _frameCorrupted = true;
+    }
+}
+
+template<class SampleType>
+void SpectralEngine<SampleType>::recoverFromCorruption()
+{
+    // このフレームの合成結果はすべてのチャンネルで破棄する
+    _tmpBuffer.clear();
+
+    _prevInputPhases.clear();
+    _prevOutputPhases.clear();
+    _correctionRatios.fill(1.0);
+
+    // prepare() の直後と同じく、無音から音量補正をやり直す
+    _smoothedGain.setCurrentAndTargetValue(0.0f);
+
+    if(_config._health != nullptr) {
+        _config._health->recordRecovery();
+    }
+}
+
+//==============================================================================
+template class SpectralEngine<float>;
+template class SpectralEngine<double>;
+
+NS_HWM_END
@@ -0,0 +1,400 @@
+#pragma once
+
+#include "Prefix.h"
+#include "RingBuffer.h"
+#include "AudioBufferUtil.h"
+#include "ReferenceableArray.h"
+#include "Arena.h"
+#include "MixedRadixFFT.h"
+#include "SpectralTables.h"
+#include "Profiler.h"
+#include "NumericalHealth.h"
+#include <array>
+#include <cassert>
+
+NS_HWM_BEGIN
+
+//! ステレオ入力のときに、チャンネル間で解析結果を共有するかどうか
+enum class StereoLinkMode {
+    kOff,       //!< チャンネルごとに独立して解析する
+    kMid,       //!< ミッド信号を解析して全チャンネルで共有する
+    kMaxEnergy, //!< パワーが最大のチャンネルを解析して全チャンネルで共有する
+};
+
+//! 出力リングバッファのスケジューリング方法
+enum class LatencyMode {
+    kStandard,  //!< ホストのブロックサイズ分の余裕を持たせる
+    kMinimum,   //!< ホップが揃い次第フレームを処理して、最小のレイテンシーで出力する
+};
+
+//! SpectrumData のうち、UI に表示するグラフの種類
+enum class SpectrumGraph {
+    kOriginalSpectrum,
+    kShiftedSpectrum,
+    kSynthesisSpectrum,
+    kOriginalCepstrum,
+    kEnvelope,
+    kFineStructure,
+    kNumGraphs,
+};
+
+/** UI に表示するために取得するグラフとチャンネルの組み合わせ
+ *
+ *  空のときは、表示用のデータのコピーを一切行わない。
+ *  スレッド間では pack() / unpack() で 1 つの atomic 変数としてやり取りする。
+ */
+struct SpectrumCaptureMask
+{
+    juce::uint32 _graphs = 0;   //!< SpectrumGraph ごとのビット
+    juce::uint32 _channels = 0; //!< チャンネルごとのビット
+
+    static juce::uint32 getGraphBit(SpectrumGraph graph) { return 1u << (int)graph; }
+    static juce::uint32 getAllGraphs() { return (1u << (int)SpectrumGraph::kNumGraphs) - 1; }
+
+    bool isEmpty() const { return _graphs == 0 || _channels == 0; }
+    bool hasGraph(SpectrumGraph graph) const { return (_graphs & getGraphBit(graph)) != 0; }
+    bool hasChannel(int ch) const { return ch < 32 && (_channels & (1u << ch)) != 0; }
+
+    juce::uint64 pack() const { return ((juce::uint64)_channels << 32) | _graphs; }
+    static SpectrumCaptureMask unpack(juce::uint64 value) { return { (juce::uint32)value, (juce::uint32)(value >> 32) }; }
+};
+
+/** 1 フレーム分の解析結果
+ *
+ *  実信号のスペクトル・ケプストラムは対称なので、各配列には 0 .. fftSize / 2 の getNumBins(fftSize) 個のビンだけを格納する。
+ */
+struct SpectrumData
+{
+    //! FFT サイズに対して、各配列に格納するビンの数
+    static int getNumBins(int fftSize) { return fftSize / 2 + 1; }
+
+    // オリジナルの対数振幅スペクトル
+    ReferenceableArray<ComplexType> _originalSpectrum;
+    // ピッチシフト後のスペクトル
+    ReferenceableArray<ComplexType> _shiftedSpectrum;
+    // 合成用のスペクトル
+    ReferenceableArray<ComplexType> _synthesisSpectrum;
+
+    // オリジナルのケプストラム
+    ReferenceableArray<ComplexType> _originalCepstrum;
+    // スペクトル包絡
+    ReferenceableArray<ComplexType> _envelope;
+    // 微細構造
+    ReferenceableArray<ComplexType> _fineStructure;
+
+    // オリジナルのケプストラムから推定した基本周波数 (Hz) と、その信頼度 (0.0..1.0)。
+    // 信頼度が低いときは無声音とみなす
+    float _f0 = 0;
+    float _f0Confidence = 0;
+
+    ReferenceableArray<ComplexType> & getGraph(SpectrumGraph graph)
+    {
+        switch(graph) {
+            case SpectrumGraph::kOriginalSpectrum:  return _originalSpectrum;
+            case SpectrumGraph::kShiftedSpectrum:   return _shiftedSpectrum;
+            case SpectrumGraph::kSynthesisSpectrum: return _synthesisSpectrum;
+            case SpectrumGraph::kOriginalCepstrum:  return _originalCepstrum;
+            case SpectrumGraph::kEnvelope:          return _envelope;
+            default:                                return _fineStructure;
+        }
+    }
+
+    ReferenceableArray<ComplexType> const & getGraph(SpectrumGraph graph) const
+    {
+        return const_cast<SpectrumData &>(*this).getGraph(graph);
+    }
+
+    void resize(int n)
+    {
+        resize(n, SpectrumCaptureMask::getAllGraphs());
+    }
+
+    //! graphs に含まれる配列だけをリサイズする
+    void resize(int n, juce::uint32 graphs)
+    {
+        for(int g = 0; g < (int)SpectrumGraph::kNumGraphs; ++g) {
+            if(graphs & (1u << g)) {
+                getGraph((SpectrumGraph)g).resize(n);
+            }
+        }
+    }
+
+    void clear()
+    {
+        _originalSpectrum.fill(ComplexType{});
+        _shiftedSpectrum.fill(ComplexType{});
+        _synthesisSpectrum.fill(ComplexType{});
+        _originalCepstrum.fill(ComplexType{});
+        _envelope.fill(ComplexType{});
+        _fineStructure.fill(ComplexType{});
+        _f0 = 0;
+        _f0Confidence = 0;
+    }
+
+    void copyFrom(SpectrumData const &src)
+    {
+        assert(_originalSpectrum.size() == src._originalSpectrum.size());
+        copyFrom(src, src._originalSpectrum.size());
+    }
+
+    //! 各配列の先頭から length 個の要素をコピーする
+    void copyFrom(SpectrumData const &src, int length)
+    {
+        copyFrom(src, length, SpectrumCaptureMask::getAllGraphs());
+    }
+
+    //! graphs に含まれる配列の先頭から length 個の要素をコピーする
+    void copyFrom(SpectrumData const &src, int length, juce::uint32 graphs)
+    {
+        for(int g = 0; g < (int)SpectrumGraph::kNumGraphs; ++g) {
+            if((graphs & (1u << g)) == 0) { continue; }
+
+            auto &destArray = getGraph((SpectrumGraph)g);
+            auto const &srcArray = src.getGraph((SpectrumGraph)g);
+            assert(destArray.size() >= length && srcArray.size() >= length);
+            std::copy_n(srcArray.data(), length, destArray.data());
+        }
+
+        _f0 = src._f0;
+        _f0Confidence = src._f0Confidence;
+    }
+};
+
+/** SpectralEngine のうち、サンプルの型に依存しない設定とパラメータ、UI 向けのアクセサ
+ *
+ *  SpectralEngine<float> と SpectralEngine<double> を区別せずに、表示用のエンジンとして参照するために使用する。
+ */
+class SpectralEngineBase
+{
+public:
+    struct Config
+    {
+        double _sampleRate = 44100.0;
+        int _fftSize = 1024;
+        int _overlapCount = 8;
+        int _numChannels = 1;
+        int _maxBlockSize = 512;
+        int _hostBlockSize = 512;       //!< ホストが prepareToPlay で指定したブロックサイズ。Standard モードの出力の余裕に使用する
+        LatencyMode _latencyMode = LatencyMode::kStandard;
+        WindowMode _windowMode = WindowMode::kSymmetric;
+        Profiler *_profiler = nullptr;  //!< 処理の段階ごとの時間を記録する先。nullptr のときは記録しない
+        NumericalHealth *_health = nullptr; //!< 数値の異常を数える先。nullptr のときも、異常の検出と状態のリセットは行う
+    };
+
+    //! 1 回の解析から同時に合成できるボイスの最大数
+    inline static constexpr int kMaxVoices = 4;
+
+    struct VoiceParameters
+    {
+        double _formantExpandAmount = 1.0;
+        double _pitchChangeAmount = 1.0;
+    };
+
+    struct FrameParameters
+    {
+        //! 先頭の _numVoices 個のボイスを合成して足し合わせる
+        std::array<VoiceParameters, kMaxVoices> _voices;
+        int _numVoices = 1;
+        int _envelopeOrder = 0;
+        StereoLinkMode _stereoLinkMode = StereoLinkMode::kOff;
+
+        //! 推定した基本周波数を最も近い平均律の音高に補正してから、各ボイスのピッチシフトを適用する
+        bool _pitchCorrection = false;
+
+        /** nullptr でないときは、基本周波数から補正量を求めずに、ほかのエンジンの getPitchCorrectionRatios() の値で補正する
+         *
+         *  Multi Resolution では低域のエンジンだけが基本周波数を追跡し、中域と高域のエンジンには同じ補正量を渡す。
+         *  帯域ごとに追跡すると、帯域ごとに異なる量で移調されて倍音の関係が崩れるため。
+         */
+        double const *_pitchCorrectionRatios = nullptr;
+
+        //! getSpectrums() に書き込むグラフとチャンネル。含まれないものは更新しない
+        SpectrumCaptureMask _capture;
+    };
+
+    //! 基本周波数の推定に使用する範囲 (Hz)
+    inline static constexpr double kMinF0 = 60.0;
+    inline static constexpr double kMaxF0 = 1000.0;
+
+    //! この信頼度以上のフレームを有声音とみなす
+    inline static constexpr float kVoicingThreshold = 0.3f;
+
+    int getFFTSize() const { return _config._fftSize; }
+    int getOverlapSize() const { return _config._fftSize / _config._overlapCount; }
+    int getNumBins() const { return SpectrumData::getNumBins(_config._fftSize); }
+    int getNumChannels() const { return _config._numChannels; }
+
+    //! 入力された信号が出力されるまでの遅延量
+    int getLatencySamples() const { return _latencySamples; }
+
+    /** 最後に処理したフレームのスペクトル
+     *
+     *  FrameParameters::_capture に含まれるグラフとチャンネルだけが更新される。
+     *  ただし、スペクトル包絡・ケプストラム・微細構造は処理の途中結果としても使用するので、常に更新される。
+     */
+    ReferenceableArray<SpectrumData> const & getSpectrums() const { return _tmpSpectrums; }
+
+protected:
+    SpectralEngineBase() = default;
+    ~SpectralEngineBase() = default;
+
+    Config _config;
+    int _latencySamples = 0;
+    ReferenceableArray<SpectrumData> _tmpSpectrums;
+};
+
+/** Phase Vocoder とケプストラム分析によって、ピッチシフトとフォルマントシフトを行うエンジン
+ *
+ *  入力信号をリングバッファに溜めて、ホップごとに 1 フレームずつ処理し、
+ *  オーバーラップ加算した結果を出力する。
+ *
+ *  SampleType はホストとやり取りする信号の型で、入出力のリングバッファ、窓掛け後の合成フレーム、
+ *  オーバーラップ加算をこの型で行う。FFT とスペクトルの処理は、juce::dsp::FFT に合わせて常に float で行う。
+ *  float と double の両方を SpectralEngine.cpp で明示的にインスタンス化している。
+ */
+template<class SampleType>
+class SpectralEngine : public SpectralEngineBase
+{
+public:
+    using RingBufferType = RingBuffer<SampleType>;
+    using AudioBufferType = juce::AudioBuffer<SampleType>;
+
+    void prepare(Config const &config);
+
+    /** 入力信号を処理して、同じ長さの出力信号を書き込む
+     *
+     *  @pre input.getNumSamples() == output.getNumSamples() && input.getNumSamples() <= Config::_maxBlockSize
+     *  @return 1 フレーム以上処理したかどうか
+     */
+    bool process(AudioBufferType &input, AudioBufferType &output, FrameParameters const &params);
+
+    /** 現在のピッチ補正の倍率
+     *
+     *  チャンネルごとの値と、末尾にステレオリンク時の値を持つ (getNumChannels() + 1 個)。
+     *  同じチャンネル数のエンジンの FrameParameters::_pitchCorrectionRatios に渡すために使用する。
+     */
+    double const * getPitchCorrectionRatios() const { return _correctionRatios.data(); }
+
+private:
+    // 作業用のバッファは prepare() で _arena からまとめて切り出す
+    Arena _arena;
+
+    ArenaArray<ComplexType> _signalBuffer;
+    ArenaArray<ComplexType> _frequencyBuffer;
+    ArenaArray<ComplexType> _cepstrumBuffer;
+    ArenaArray<ComplexType> _tmpFFTBuffer;
+    ArenaArray<ComplexType> _tmpFFTBuffer2;
+    ArenaArray<float> _tmpPhaseBuffer;
+    std::unique_ptr<FFTBackend> _fft;
+
+    // FFT の入出力以外のバッファは、0 .. fftSize / 2 のビンだけを保持する
+
+    // 窓関数などの変更されないテーブル。同じ設定のエンジン間で共有する
+    juce::SharedResourcePointer<SpectralTableCache> _tableCache;
+    std::shared_ptr<SpectralTables const> _tables;
+    int _synthesisLength = 0;   // 合成窓のうち値が 0 でない末尾の領域の長さ
+    juce::AudioSampleBuffer _prevInputPhases;
+    juce::AudioSampleBuffer _prevOutputPhases; // ボイスごとに (チャンネル数 + 1) 個ずつ並べている
+    ArenaArray<float> _analysisMagnitude;
+    ArenaArray<float> _synthesizeMagnitude;
+    ArenaArray<float> _analysisFrequencies;
+    ArenaArray<float> _synthesizeFrequencies;
+    ArenaArray<int> _sourceBins; // 合成スペクトルの各ビンが参照した解析スペクトルのビン (範囲外のときは -1)
+
+    // ハーモナイザー用のバッファ。解析結果はボイス間で共有し、合成だけをボイスごとに行う
+    ArenaArray<ComplexType> _originalEnvelope;
+    std::array<ArenaArray<ComplexType>, kMaxVoices> _voiceSpectrums;
+    std::array<ArenaArray<int>, kMaxVoices> _voiceSourceBins;
+    SpectrumData _voiceSpectrumData; // 2 つ目以降のボイスの作業用
+
+    // ステレオリンク用のバッファ
+    ReferenceableArray<ArenaArray<ComplexType>> _channelSpectrums;
+    ArenaArray<double> _channelPowers;
+    ArenaArray<ComplexType> _channelRatios;   // 代表のスペクトルに対するチャンネルのスペクトルの比
+    int _linkedReferenceChannel = 0;
+    StereoLinkMode _prevStereoLinkMode = StereoLinkMode::kOff;
+
+    RingBufferType _inputRingBuffer;
+    ReferenceableArray<typename RingBufferType::ConstBufferInfo> _bufferInfoList;
+    RingBufferType _outputRingBuffer;
+
+    AudioBufferType _tmpBuffer;
+
+    // 現在処理しているチャンネルで、_tmpSpectrums に書き込む表示専用のグラフ
+    juce::uint32 _frameCaptureGraphs = 0;
+
+    //! 表示専用のグラフを specData に書き込むかどうか
+    bool isCaptured(SpectrumGraph graph, SpectrumData const &specData) const
+    {
+        return (_frameCaptureGraphs & SpectrumCaptureMask::getGraphBit(graph)) != 0 && &specData != &_voiceSpectrumData;
+    }
+
+    // ピッチ補正の倍率。_prevInputPhases と同じく、末尾はステレオリンク時の解析用
+    ArenaArray<double> _correctionRatios;
+
+    // 処理中のフレームで、NaN / Inf や上限を超える値を検出したかどうか。
+    // 検出したフレームは出力せずに、位相などのフレーム間で引き継ぐ状態をリセットする
+    bool _frameCorrupted = false;
+
+    // 変換した信号の音量が変わってしまうのを補正するための係数。
+    // 毎回の解析でこれをやると音量の変化が大きくなりすぎることがあるのでスムーズに変換するようにしている。
+    juce::SmoothedValue<float, juce::ValueSmoothingTypes::Linear> _smoothedGain;
+
+    void processAudioBlock(FrameParameters const &params);
+    void processLinkedChannels(FrameParameters const &params);
+
+    //! _prevInputPhases / _prevOutputPhases のうち、ステレオリンク時の解析に使用するチャンネルのインデックス
+    int getLinkedPhaseIndex() const { return _config._numChannels; }
+
+    //! _prevOutputPhases のうち、指定したボイスの位相の状態を保持するチャンネルのインデックス
+    int getOutputPhaseIndex(int phaseIndex, int voice) const { return voice * (_config._numChannels + 1) + phaseIndex; }
+
+    //! 入力信号を窓掛けして _signalBuffer に読み込む
+    //! @return 読み込んだ信号のパワー
+    double loadFrame(typename RingBufferType::ConstBufferInfo const &bi);
+
+    /** _frequencyBuffer のスペクトルに対してフォルマントシフトとピッチシフトを行い、結果を _frequencyBuffer に書き戻す
+     *
+     *  スペクトル包絡と瞬時周波数の解析は 1 回だけ行い、ボイスごとに合成したスペクトルを足し合わせる。
+     *  各ボイスの合成結果は _voiceSpectrums / _voiceSourceBins にも残る。
+     *
+     *  @param phaseIndex 位相の状態を保持する _prevInputPhases / _prevOutputPhases のチャンネル
+     */
+    void processSpectrum(int phaseIndex, SpectrumData &specData, FrameParameters const &params);
+    void synthesizeVoice(int phaseIndex, int voice, SpectrumData &specData, VoiceParameters const &voiceParams, int envelopeOrder);
+    void computeEnvelope(SpectrumData &specData, int envelopeOrder);
+
+    /** オリジナルのケプストラムのピークから基本周波数を推定して、specData に書き込む
+     *
+     *  スペクトル包絡の計算で求めたケプストラムをそのまま使用するので、追加の FFT は必要ない。
+     *  窓の中に 3 周期以上含まれる周波数だけを探索するため、推定できる下限は FFT サイズによって決まる。
+     */
+    void estimatePitch(SpectrumData &specData);
+
+    //! 推定した基本周波数から、ピッチ補正の倍率を更新して返す。params._pitchCorrectionRatios があるときはその値に合わせる
+    double updatePitchCorrection(int phaseIndex, SpectrumData const &specData, FrameParameters const &params);
+    void shiftFormant(SpectrumData &specData, double formantExpandAmount);
+
+    //! _frequencyBuffer のスペクトルから、各ビンの振幅と瞬時周波数を求める
+    void analyzeFrequencies(int phaseIndex);
+
+    //! 解析した振幅と瞬時周波数から、ピッチを変更したスペクトルを _frequencyBuffer に合成する
+    void shiftPitch(int phaseIndex, int voice, double pitchChangeAmount);
+    void extractFineStructure(SpectrumData &specData, int envelopeOrder, double pitchChangeAmount);
+    void recombineSpectrum(SpectrumData &specData);
+
+    //! スペクトルを逆FFTして窓掛けし、音量を補正して _tmpBuffer の指定したチャンネルに書き込む
+    void synthesizeFrame(int ch, ArenaArray<ComplexType> &spectrum, double originalPower);
+
+    //! 検査の結果を数えて、後続の処理を壊す値があればフレームを破棄するように記録する
+    void checkHealth(HealthStage stage, HealthCounts const &counts);
+
+    /** 壊れたフレームを破棄して、フレーム間で引き継ぐ状態を初期状態に戻す
+     *
+     *  位相と音量補正の状態に NaN が入ると、以降のすべてのフレームが NaN になるので、インスタンスを作り直さずに復帰できるようにする。
+     *  出力リングバッファには壊れたフレームを加算しないので、リングバッファはリセットする必要がない。
+     */
+    void recoverFromCorruption();
+};
+
+NS_HWM_END
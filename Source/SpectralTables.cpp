@@ -0,0 +1,132 @@
+#include "SpectralTables.h"
+
+NS_HWM_BEGIN
+
+//==============================================================================
+// 周期的なハン窓の n 番目の値
+static double hannWindow(int n, int length)
+{
+    return 0.5 * (1.0 - cos(2.0 * M_PI * n / (double)length));
+}
+
+/** 解析窓と合成窓を作成する
+ *
+ *  Low Latency モードでは、解析窓は長さ 2 * (fftSize - M) のハン窓の立ち上がりと長さ 2M のハン窓の立ち下がりをつないだ非対称な窓、
+ *  合成窓は末尾の 2M (= synthesisLength) サンプルだけが 0 でない窓にする。
+ *  解析窓と合成窓の積が末尾 2M サンプルの長さのハン窓になるので、ホップが M 以下であればオーバーラップ加算で元の信号を再構成できる。
+ */
+static void createWindows(WindowMode mode,
+                          int fftSize,
+                          int synthesisLength,
+                          std::vector<float> &analysisWindow,
+                          std::vector<float> &synthesisWindow)
+{
+    analysisWindow.resize(fftSize);
+    synthesisWindow.resize(fftSize);
+
+    if(mode == WindowMode::kSymmetric) {
+        for(int i = 0; i < fftSize; ++i) {
+            analysisWindow[i] = synthesisWindow[i] = (float)hannWindow(i, fftSize);
+        }
+
+        return;
+    }
+
+    int const M = synthesisLength / 2;
+    int const longLength = 2 * (fftSize - M);
+    int const shortBegin = fftSize - synthesisLength;
+
+    for(int i = 0; i < fftSize; ++i) {
+        if(i < fftSize - M) {
+            analysisWindow[i] = (float)std::sqrt(hannWindow(i, longLength));
+        } else {
+            analysisWindow[i] = (float)std::sqrt(hannWindow(i - shortBegin, synthesisLength));
+        }
+
+        if(i < shortBegin) {
+            synthesisWindow[i] = 0.0f;
+        } else if(i < fftSize - M) {
+            auto const denom = std::sqrt(hannWindow(i, longLength));
+            synthesisWindow[i] = (denom > 0) ? (float)(hannWindow(i - shortBegin, synthesisLength) / denom) : 0.0f;
+        } else {
+            synthesisWindow[i] = (float)std::sqrt(hannWindow(i - shortBegin, synthesisLength));
+        }
+    }
+}
+
+//==============================================================================
+SpectralTables::SpectralTables(int fftSize, int overlapCount, WindowMode windowMode)
+:   _fftSize(fftSize)
+,   _overlapSize(fftSize / overlapCount)
+{
+    // Low Latency モードでは、合成窓の長さを FFT サイズの 1/4 (ただしホップの 2 倍以上) に縮める
+    _synthesisLength = (windowMode == WindowMode::kLowLatency)
+    ?   std::min(fftSize, std::max(fftSize / 4, _overlapSize * 2))
+    :   fftSize;
+
+    // Symmetric モードの 1 / overlapCount と同じく、合成窓の長さに対するホップの比率で正規化する
+    _frameScale = (float)_overlapSize / _synthesisLength;
+
+    createWindows(windowMode, fftSize, _synthesisLength, _analysisWindow, _synthesisWindow);
+
+    _scaledAnalysisWindow.resize(fftSize);
+    for(int i = 0; i < fftSize; ++i) {
+        _scaledAnalysisWindow[i] = _analysisWindow[i] * _frameScale;
+    }
+
+    _binPhaseAdvances.resize(fftSize / 2 + 1);
+    for(int i = 0; i <= fftSize / 2; ++i) {
+        _binPhaseAdvances[i] = 2.0 * M_PI * i / fftSize * _overlapSize;
+    }
+}
+
+//==============================================================================
+std::shared_ptr<SpectralTables const> SpectralTableCache::getTables(int fftSize, int overlapCount, WindowMode windowMode)
+{
+    std::unique_lock lock(_mutex);
+
+    auto const key = Key { fftSize, overlapCount, windowMode };
+    if(auto found = _tables[key].lock()) {
+        return found;
+    }
+
+    removeExpiredEntries();
+
+    auto tables = std::make_shared<SpectralTables>(fftSize, overlapCount, windowMode);
+    if(juce::isPowerOfTwo(fftSize) == false) {
+        tables->_mixedRadixPlan = getMixedRadixPlan(fftSize);
+    }
+
+    _tables[key] = tables;
+    return tables;
+}
+
+std::shared_ptr<MixedRadixFFT::Plan const> SpectralTableCache::getMixedRadixPlan(int size)
+{
+    // オーバーラップ数や窓の形状が違っても、FFT サイズが同じなら Plan は共有できる
+    if(auto found = _mixedRadixPlans[size].lock()) {
+        return found;
+    }
+
+    auto plan = std::make_shared<MixedRadixFFT::Plan const>(size);
+    _mixedRadixPlans[size] = plan;
+    return plan;
+}
+
+void SpectralTableCache::removeExpiredEntries()
+{
+    auto const removeExpired = [](auto &entries) {
+        for(auto it = entries.begin(); it != entries.end(); ) {
+            if(it->second.expired()) {
+                it = entries.erase(it);
+            } else {
+                ++it;
+            }
+        }
+    };
+
+    removeExpired(_tables);
+    removeExpired(_mixedRadixPlans);
+}
+
+NS_HWM_END
@@ -0,0 +1,68 @@
+#pragma once
+
+#include <map>
+#include <memory>
+#include <mutex>
+#include <tuple>
+#include <vector>
+#include "Prefix.h"
+#include "MixedRadixFFT.h"
+
+NS_HWM_BEGIN
+
+//! 解析窓と合成窓の組み合わせ
+enum class WindowMode {
+    kSymmetric,     //!< 解析と合成に同じハン窓を使う
+    kLowLatency,    //!< 非対称な解析窓と、新しいサンプル側に寄せた短い合成窓を使う
+};
+
+/** FFT サイズ・オーバーラップ数・窓の形状ごとに決まる、変更されないテーブル
+ *
+ *  SpectralTableCache を通して、同じ設定のエンジン間 (プラグインのインスタンス間を含む) で共有する。
+ */
+struct SpectralTables
+{
+    SpectralTables(int fftSize, int overlapCount, WindowMode windowMode);
+
+    int _fftSize = 0;
+    int _overlapSize = 0;
+    int _synthesisLength = 0;   //!< 合成窓のうち値が 0 でない末尾の領域の長さ
+    float _frameScale = 1.0f;   //!< オーバーラップ加算で音量が大きくならないように入力信号に掛ける係数
+
+    std::vector<float> _analysisWindow;
+    std::vector<float> _scaledAnalysisWindow;   //!< _analysisWindow に _frameScale を掛けたもの
+    std::vector<float> _synthesisWindow;
+
+    //! 各ビンの中心周波数の正弦波が 1 ホップの間に進む位相 (0 .. fftSize / 2)
+    std::vector<double> _binPhaseAdvances;
+
+    //! 2 の累乗でない FFT サイズのときの MixedRadixFFT の Plan。2 の累乗のときは nullptr
+    std::shared_ptr<MixedRadixFFT::Plan const> _mixedRadixPlan;
+};
+
+/** SpectralTables をプロセス全体で共有するためのキャッシュ
+ *
+ *  juce::SharedResourcePointer<SpectralTableCache> で参照する。
+ *  テーブルは std::shared_ptr で返し、キャッシュ側は std::weak_ptr だけを保持するので、
+ *  どのエンジンからも参照されなくなったテーブルは自動的に解放される。
+ *  getTables() はロックを取るので、オーディオスレッドからは呼び出さないこと。
+ */
+class SpectralTableCache
+{
+public:
+    std::shared_ptr<SpectralTables const> getTables(int fftSize, int overlapCount, WindowMode windowMode);
+
+private:
+    using Key = std::tuple<int, int, WindowMode>;
+
+    std::mutex _mutex;
+    std::map<Key, std::weak_ptr<SpectralTables const>> _tables;
+    std::map<int, std::weak_ptr<MixedRadixFFT::Plan const>> _mixedRadixPlans;
+
+    std::shared_ptr<MixedRadixFFT::Plan const> getMixedRadixPlan(int size);
+
+    //! 解放済みのテーブルのエントリを取り除く
+    void removeExpiredEntries();
+};
+
+NS_HWM_END
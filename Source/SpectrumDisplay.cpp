@@ -0,0 +1,109 @@
+#include "SpectrumDisplay.h"
+
+NS_HWM_BEGIN
+
+//==============================================================================
+// 振幅が 0 のときに log が発散しないようにするための下限
+static constexpr float kMinimumDecibels = -240.0f;
+
+// ピークホールドの値を下げる速さ (1 秒あたり)
+static constexpr float kPeakDecayDecibels = 24.0f;
+static constexpr float kPeakDecayCepstrum = 0.5f;
+
+// 自然対数の振幅を dB に変換する係数
+static float const kNaturalLogToDecibels = 20.0f / std::log(10.0f);
+
+//! 表示に使用する単位に変換する
+static float toDisplayValue(SpectrumGraph graph, ComplexType const &value)
+{
+    switch(graph) {
+        case SpectrumGraph::kOriginalCepstrum:
+            return std::abs(value);
+        case SpectrumGraph::kEnvelope:
+        case SpectrumGraph::kFineStructure:
+            // スペクトル包絡と微細構造は、実部に振幅の自然対数が入っている
+            return std::max<float>(value.real() * kNaturalLogToDecibels, kMinimumDecibels);
+        default:
+            return std::max<float>(20.0f * std::log10(std::abs(value)), kMinimumDecibels);
+    }
+}
+
+//==============================================================================
+void SpectrumDisplayReducer::updateBinRanges(int fftSize, double sampleRate)
+{
+    int const numPoints = SpectrumDisplayData::kNumPoints;
+    int const numBins = fftSize / 2 + 1;
+    auto const binWidth = sampleRate / fftSize;
+    auto const minFrequency = (double)SpectrumDisplayData::kMinFrequency;
+    auto const maxFrequency = sampleRate / 2;
+
+    auto const frequencyToBin = [&](int point) {
+        auto const freq = minFrequency * std::pow(maxFrequency / minFrequency, (double)point / (numPoints - 1));
+        return juce::jlimit(0, numBins - 1, (int)std::lround(freq / binWidth));
+    };
+
+    // 表示点 k は、k と k + 1 の中間までのビンをまとめる。
+    // 低域でビンの数が表示点より少ないところは、最も近いビンをそのまま使う
+    for(int k = 0; k < numPoints; ++k) {
+        auto const begin = frequencyToBin(k);
+        auto const end = (k + 1 < numPoints) ? frequencyToBin(k + 1) : numBins;
+        _binBegin[k] = begin;
+        _binEnd[k] = std::max(begin + 1, end);
+    }
+
+    _fftSize = fftSize;
+    _sampleRate = sampleRate;
+    _peakGraphs = 0;
+}
+
+void SpectrumDisplayReducer::reduce(SpectrumData const &src,
+                                    juce::uint32 graphs,
+                                    int fftSize,
+                                    double sampleRate,
+                                    double elapsedSeconds,
+                                    SpectrumDisplayData &dest)
+{
+    if(fftSize != _fftSize || sampleRate != _sampleRate) {
+        updateBinRanges(fftSize, sampleRate);
+    }
+
+    dest._graphs = graphs;
+    dest._minFrequency = SpectrumDisplayData::kMinFrequency;
+    dest._maxFrequency = (float)(sampleRate / 2);
+    dest._f0 = src._f0;
+    dest._f0Confidence = src._f0Confidence;
+
+    for(int g = 0; g < (int)SpectrumGraph::kNumGraphs; ++g) {
+        auto const graph = (SpectrumGraph)g;
+        auto const bit = SpectrumCaptureMask::getGraphBit(graph);
+        if((graphs & bit) == 0) { continue; }
+
+        auto const *data = src.getGraph(graph).data();
+        auto &curve = dest._curves[g];
+        auto &peaks = _peaks[g];
+
+        // 新しく表示されたグラフは、ピークホールドを現在の値から始める
+        auto const peakValid = (_peakGraphs & bit) != 0;
+        auto const decay = (float)elapsedSeconds * ((graph == SpectrumGraph::kOriginalCepstrum) ? kPeakDecayCepstrum : kPeakDecayDecibels);
+
+        for(int k = 0; k < SpectrumDisplayData::kNumPoints; ++k) {
+            auto minValue = toDisplayValue(graph, data[_binBegin[k]]);
+            auto maxValue = minValue;
+            for(int i = _binBegin[k] + 1; i < _binEnd[k]; ++i) {
+                auto const v = toDisplayValue(graph, data[i]);
+                minValue = std::min(minValue, v);
+                maxValue = std::max(maxValue, v);
+            }
+
+            peaks[k] = peakValid ? std::max(maxValue, peaks[k] - decay) : maxValue;
+
+            curve._min[k] = minValue;
+            curve._max[k] = maxValue;
+            curve._peak[k] = peaks[k];
+        }
+    }
+
+    _peakGraphs = graphs;
+}
+
+NS_HWM_END
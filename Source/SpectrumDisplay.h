@@ -0,0 +1,72 @@
+#pragma once
+
+#include <array>
+#include "Prefix.h"
+#include "SpectralEngine.h"
+
+NS_HWM_BEGIN
+
+/** Spectrum コンポーネントに渡す、表示用に間引いたスペクトル
+ *
+ *  FFT のビンを対数周波数で等間隔な kNumPoints 個の点にまとめ、点ごとの最小値・最大値・ピークホールドの値を持つ。
+ *  スペクトル・スペクトル包絡・微細構造は dB、ケプストラムは絶対値で格納する。
+ *  固定長なので、UI とのやり取りでメモリを確保することはない。
+ */
+struct SpectrumDisplayData
+{
+    inline static constexpr int kNumPoints = 512;
+    inline static constexpr float kMinFrequency = 20.0f;
+
+    struct Curve
+    {
+        std::array<float, kNumPoints> _min {};
+        std::array<float, kNumPoints> _max {};
+        std::array<float, kNumPoints> _peak {};
+    };
+
+    juce::uint32 _graphs = 0;       //!< 値が入っているグラフ (SpectrumCaptureMask::getGraphBit() の組み合わせ)
+    float _minFrequency = kMinFrequency;    //!< 0 番目の点の周波数
+    float _maxFrequency = 0;                //!< 最後の点の周波数 (ナイキスト周波数)
+    float _f0 = 0;
+    float _f0Confidence = 0;
+    std::array<Curve, (int)SpectrumGraph::kNumGraphs> _curves;
+
+    bool hasGraph(SpectrumGraph graph) const { return (_graphs & SpectrumCaptureMask::getGraphBit(graph)) != 0; }
+    Curve const & getCurve(SpectrumGraph graph) const { return _curves[(int)graph]; }
+};
+
+/** SpectrumData を SpectrumDisplayData に間引く
+ *
+ *  低優先度のスレッドで使用する。FFT サイズやサンプリングレートが変わったときだけ、ビンと表示点の対応表を作り直す。
+ */
+class SpectrumDisplayReducer
+{
+public:
+    /** src のうち graphs に含まれるグラフを dest に書き込む
+     *
+     *  @param elapsedSeconds 前回の reduce() からの経過時間。ピークホールドの減衰に使用する
+     */
+    void reduce(SpectrumData const &src,
+                juce::uint32 graphs,
+                int fftSize,
+                double sampleRate,
+                double elapsedSeconds,
+                SpectrumDisplayData &dest);
+
+private:
+    using Curve = SpectrumDisplayData::Curve;
+
+    int _fftSize = 0;
+    double _sampleRate = 0;
+    juce::uint32 _peakGraphs = 0;   // _peaks の値が有効なグラフ
+
+    // 表示点ごとのビンの範囲 [begin, end)
+    std::array<int, SpectrumDisplayData::kNumPoints> _binBegin {};
+    std::array<int, SpectrumDisplayData::kNumPoints> _binEnd {};
+
+    std::array<std::array<float, SpectrumDisplayData::kNumPoints>, (int)SpectrumGraph::kNumGraphs> _peaks {};
+
+    void updateBinRanges(int fftSize, double sampleRate);
+};
+
+NS_HWM_END
@@ -0,0 +1,70 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include "Prefix.h"
+
+NS_HWM_BEGIN
+
+/** 1 つの書き込みスレッドから 1 つの読み込みスレッドへ、最新のデータを受け渡すためのトリプルバッファ
+ *
+ *  書き込み側と読み込み側はそれぞれ専用のバッファを持ち、残りの 1 つを atomic 変数の交換でやり取りする。
+ *  どちらの操作もロックを取らず、相手のスレッドを待つこともない (wait-free)。
+ *  読み込み側が追いつかないときは、読まれなかった古いデータは上書きされる。
+ */
+template<class T>
+class TripleBuffer
+{
+public:
+    //! 書き込み側の専用バッファ。publish() を呼ぶまで読み込み側からは見えない
+    T & getWriteBuffer() { return _buffers[_writeIndex]; }
+
+    //! 書き込んだデータを公開する (書き込みスレッドから呼び出す)
+    void publish()
+    {
+        auto const prev = _middle.exchange(_writeIndex | kDirtyFlag, std::memory_order_acq_rel);
+        _writeIndex = prev & kIndexMask;
+    }
+
+    /** 新しく公開されたデータがあれば、読み込み側のバッファと交換する (読み込みスレッドから呼び出す)
+     *
+     *  @return 新しいデータを取得したかどうか
+     */
+    bool acquire()
+    {
+        if((_middle.load(std::memory_order_relaxed) & kDirtyFlag) == 0) {
+            return false;
+        }
+
+        auto const prev = _middle.exchange(_readIndex, std::memory_order_acq_rel);
+        _readIndex = prev & kIndexMask;
+        return true;
+    }
+
+    //! 読み込み側の専用バッファ。最後に acquire() したデータを保持している
+    T const & getReadBuffer() const { return _buffers[_readIndex]; }
+
+    /** すべてのバッファに関数を適用する
+     *
+     *  バッファの確保などの初期化に使用する。
+     *  書き込みスレッドと読み込みスレッドのどちらもこのオブジェクトにアクセスしていないときにだけ呼び出せる。
+     */
+    template<class F>
+    void forEachBuffer(F f)
+    {
+        for(auto &b: _buffers) {
+            f(b);
+        }
+    }
+
+private:
+    inline static constexpr int kIndexMask = 0x3;
+    inline static constexpr int kDirtyFlag = 0x4;
+
+    std::array<T, 3> _buffers;
+    int _writeIndex = 0;
+    std::atomic<int> _middle { 1 };
+    int _readIndex = 2;
+};
+
+NS_HWM_END
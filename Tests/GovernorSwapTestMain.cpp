@@ -0,0 +1,213 @@
+/** CPU Governor が品質を下げてエンジンを差し替えるときに、出力が途切れないことを確認するテスト
+ *
+ *  処理が間に合わない状況を作って CPU Governor に段階を下げさせ、エンジンの差し替えとクロスフェードの前後で
+ *  出力の RMS が一定以上に保たれることを確認する。
+ *  処理の速さはマシンによって異なるので、はじめに処理時間を計測して、処理時間とブロックの長さの比が
+ *  kTargetLoad になるようなサンプルレートで準備する。
+ *
+ *  使い方:
+ *      FormantAndPitchGovernorSwapTest
+ */
+
+#include "Prefix.h"
+#include "FFTDefines.h"
+#include "PluginProcessor.h"
+#include "TestUtil.h"
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+
+NS_HWM_BEGIN
+
+static constexpr int kBlockSize = 256;
+
+//! 処理時間を計測するときのサンプルレートと、計測する長さ
+static constexpr double kCalibrationSampleRate = 48000.0;
+static constexpr int kCalibrationSamples = 48000;
+
+//! 処理時間とブロックの長さの比の目標。CpuGovernor::kHighLoad を十分に超える値にする
+static constexpr double kTargetLoad = 4.0;
+
+//! ホストが使用しうるサンプルレートの上限
+static constexpr double kMaxSampleRate = 384000.0;
+
+//! テスト信号の周期 (サンプル数)。サンプルレートによらず、RMS を求める窓に整数個の周期が入るようにする
+static constexpr int kPeriodSamples = 200;
+static constexpr int kRmsWindowSize = kPeriodSamples * 10;
+
+//! 差し替えの前後で、出力の RMS が差し替え前の RMS に対してこの比を下回ったら失敗とする
+static constexpr double kMinRelativeRms = 0.25;
+
+//! テスト全体の時間の上限
+static constexpr double kTimeoutMs = 120000.0;
+
+//! 処理の重い設定にして、CPU Governor が下げられる段階を残しておく
+static bool configure(juce::AudioProcessor &processor, bool governorEnabled)
+{
+    return setParameterValue(processor, ParameterIds::fftSize, (float)(std::size(FFTDefines::fftSizes) - 1))
+        && setParameterValue(processor, ParameterIds::overlapCount, (float)(std::size(FFTDefines::overlapCounts) - 1))
+        && setParameterValue(processor, ParameterIds::numVoices, (float)SpectralEngineBase::kMaxVoices)
+        && setParameterValue(processor, ParameterIds::dryWetRate, 1.0f)
+        && setParameterValue(processor, ParameterIds::cpuGovernor, governorEnabled ? 1.0f : 0.0f);
+}
+
+//! kBlockSize ごとに processBlock を呼び出して、出力の RMS を kRmsWindowSize サンプルごとに求める
+class OutputMonitor
+{
+public:
+    OutputMonitor(juce::AudioProcessor &processor, double sampleRate)
+    :   _processor(processor)
+    ,   _buffer(processor.getTotalNumOutputChannels(), kBlockSize)
+    ,   _signal(sampleRate, sampleRate / kPeriodSamples)
+    {}
+
+    //! 1 ブロックを処理する。窓が埋まるたびに onWindow(rms) を呼び出す
+    template<class Callback>
+    void processBlock(Callback &&onWindow)
+    {
+        _signal.fill(_buffer, kBlockSize);
+        _processor.processBlock(_buffer, _midiBuffer);
+
+        for(int i = 0; i < kBlockSize; ++i) {
+            for(int ch = 0; ch < _buffer.getNumChannels(); ++ch) {
+                auto const value = (double)_buffer.getSample(ch, i);
+                _sumOfSquares += value * value;
+            }
+
+            if(++_windowPosition == kRmsWindowSize) {
+                onWindow(std::sqrt(_sumOfSquares / (kRmsWindowSize * _buffer.getNumChannels())));
+                _sumOfSquares = 0;
+                _windowPosition = 0;
+            }
+        }
+
+        _numProcessed += kBlockSize;
+    }
+
+    juce::int64 getNumProcessed() const { return _numProcessed; }
+
+private:
+    juce::AudioProcessor &_processor;
+    juce::AudioBuffer<float> _buffer;
+    juce::MidiBuffer _midiBuffer;
+    TestSignal _signal;
+    double _sumOfSquares = 0;
+    int _windowPosition = 0;
+    juce::int64 _numProcessed = 0;
+};
+
+//! CPU Governor を無効にした状態で、1 サンプルあたりの処理時間を計測する
+static double measureSecondsPerSample()
+{
+    PluginAudioProcessor processor;
+    if(configure(processor, false) == false) { return 0; }
+
+    processor.prepareToPlay(kCalibrationSampleRate, kBlockSize);
+    OutputMonitor monitor(processor, kCalibrationSampleRate);
+
+    auto const startTicks = juce::Time::getHighResolutionTicks();
+    while(monitor.getNumProcessed() < kCalibrationSamples) {
+        monitor.processBlock([](double) {});
+    }
+    auto const elapsedTicks = juce::Time::getHighResolutionTicks() - startTicks;
+
+    processor.releaseResources();
+    return juce::Time::highResolutionTicksToSeconds(elapsedTicks) / (double)monitor.getNumProcessed();
+}
+
+static int runTest()
+{
+    juce::ScopedJuceInitialiser_GUI juceInitialiser;
+
+    auto const secondsPerSample = measureSecondsPerSample();
+    if(secondsPerSample <= 0) {
+        return 1;
+    }
+
+    auto const sampleRate = juce::jlimit(kCalibrationSampleRate, kMaxSampleRate, kTargetLoad / secondsPerSample);
+    std::cerr << "Preparing at " << sampleRate << " Hz (expected load " << secondsPerSample * sampleRate << ")" << std::endl;
+
+    // CPU Governor は出力が安定してから有効にする。有効にした時点の差し替えも検査の対象になる
+    PluginAudioProcessor processor;
+    if(configure(processor, false) == false) {
+        return 1;
+    }
+
+    processor.prepareToPlay(sampleRate, kBlockSize);
+
+    auto const initialStatus = processor.getEngineStatusForUI();
+    auto const crossfadeLength = (int)std::ceil(sampleRate * Defines::engineCrossfadeSeconds);
+
+    // 構築した直後のエンジンは、レイテンシーの間は無音を出力し、そのあと FFT サイズの間に出力が立ち上がる
+    auto const settleSamples = (juce::int64)processor.getLatencySamples() + initialStatus._fftSize;
+
+    enum class Phase {
+        kSettling,          //!< 出力が安定するのを待っている
+        kWaitingForStep,    //!< CPU Governor が段階を下げるのを待っている
+        kWaitingForSwap,    //!< 下げた設定のエンジンからクロスフェードが始まるのを待っている
+        kFinishing,         //!< クロスフェードが終わるまで処理を続けている
+    };
+
+    OutputMonitor monitor(processor, sampleRate);
+    auto phase = Phase::kSettling;
+    double referenceRms = 0;
+    juce::int64 finishPosition = 0;
+    bool succeeded = true;
+    auto const startTime = juce::Time::getMillisecondCounterHiRes();
+
+    auto const onWindow = [&](double rms) {
+        if(phase == Phase::kSettling) {
+            if(monitor.getNumProcessed() < settleSamples) { return; }
+
+            referenceRms = rms;
+            std::cerr << "Reference RMS " << referenceRms << std::endl;
+            if(setParameterValue(processor, ParameterIds::cpuGovernor, 1.0f) == false) {
+                succeeded = false;
+            }
+            phase = Phase::kWaitingForStep;
+            return;
+        }
+
+        if(rms < referenceRms * kMinRelativeRms) {
+            std::cerr << "Output dropped to RMS " << rms << " at sample " << monitor.getNumProcessed() << std::endl;
+            succeeded = false;
+        }
+    };
+
+    while(succeeded) {
+        monitor.processBlock(onWindow);
+
+        auto const status = processor.getEngineStatusForUI();
+
+        if(phase == Phase::kWaitingForStep && status._governorLevel > 0) {
+            std::cerr << "Governor stepped down at sample " << monitor.getNumProcessed() << std::endl;
+            phase = Phase::kWaitingForSwap;
+        } else if(phase == Phase::kWaitingForSwap
+                  && (status._fftSize != initialStatus._fftSize || status._overlapCount != initialStatus._overlapCount))
+        {
+            std::cerr << "Crossfade to fftSize " << status._fftSize << ", overlapCount " << status._overlapCount
+                      << " started at sample " << monitor.getNumProcessed() << std::endl;
+            finishPosition = monitor.getNumProcessed() + crossfadeLength + status._fftSize + kRmsWindowSize * 4;
+            phase = Phase::kFinishing;
+        } else if(phase == Phase::kFinishing && monitor.getNumProcessed() >= finishPosition) {
+            break;
+        }
+
+        if(juce::Time::getMillisecondCounterHiRes() - startTime > kTimeoutMs) {
+            std::cerr << "Timed out before the governor finished a step" << std::endl;
+            succeeded = false;
+        }
+    }
+
+    processor.releaseResources();
+
+    std::cerr << (succeeded ? "Passed" : "Failed") << std::endl;
+    return succeeded ? 0 : 1;
+}
+
+NS_HWM_END
+
+int main()
+{
+    return hwm::runTest();
+}
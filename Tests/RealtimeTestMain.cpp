@@ -0,0 +1,295 @@
+/** PluginAudioProcessor の processBlock で、実行時間が保証されない関数が呼び出されないことを確認するテスト
+ *
+ *  FFT サイズ・オーバーラップ数・エンジン・ボイス数・Multi Resolution・処理の精度の組み合わせを切り替えながら、
+ *  prepareToPlay で準備したサイズより大きなものを含むさまざまなブロックサイズで processBlock を呼び出す。
+ *  設定の変更はプラグインと同じくバックグラウンドスレッドがエンジンを構築し、オーディオスレッドが差し替えるので、
+ *  差し替えとクロスフェードの処理も検査の対象になる。
+ *  ピッチ・フォルマント・Dry/Wet・出力ゲインなどはブロックごとに値を動かして、オートメーションの処理も検査する。
+ *  RealtimeChecker が違反を検出したら、スタックトレースを標準エラー出力に書き出して 0 以外の値を返す。
+ *  このターゲットは HWM_ENABLE_REALTIME_CHECKER=1 でビルドする。
+ *
+ *  使い方:
+ *      FormantAndPitchRealtimeTest [--abort-on-violation]
+ */
+
+#include "Prefix.h"
+#include "FFTDefines.h"
+#include "PluginProcessor.h"
+#include "RealtimeChecker.h"
+#include "TestUtil.h"
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+#include <type_traits>
+#include <vector>
+
+#if HWM_ENABLE_REALTIME_CHECKER == 0
+ #error "The realtime test requires HWM_ENABLE_REALTIME_CHECKER=1"
+#endif
+
+NS_HWM_BEGIN
+
+static constexpr double kSampleRate = 48000.0;
+
+//! prepareToPlay に渡すブロックサイズ
+static constexpr int kPreparedBlockSize = 256;
+
+//! processBlock に渡すブロックサイズ。prepareToPlay で準備したサイズ (Defines::minimumMaxBlockSize に切り上げられる) より大きなものも含める
+static constexpr int kBlockSizes[] = { 1, 64, 256, 480, 512, 1024, 3000 };
+
+//! 検査する FFT サイズのインデックス。最小・既定・最大と、2 の累乗でないサイズ
+static constexpr int kFFTSizeIndices[] = {
+    0, FFTDefines::fftSizeDefaultIndex, 8, (int)std::size(FFTDefines::fftSizes) - 1
+};
+
+//! 設定の変更がオーディオスレッドに反映されるのを待つ時間の上限
+static constexpr double kReconfigureTimeoutMs = 10000.0;
+
+struct TestCase
+{
+    int _engineIndex = 0;
+    int _numVoices = 1;
+    bool _multiResolution = false;
+    int _fftSizeIndex = 0;
+    int _overlapCountIndex = 0;
+};
+
+/** 検査する設定の組み合わせを作る
+ *
+ *  FFT サイズとオーバーラップ数を最も内側のループにしているので、連続する 2 つの設定は必ず
+ *  FFT サイズかオーバーラップ数が異なる。runTestCases() はこれを使って、設定が反映されたことを判定する。
+ */
+static std::vector<TestCase> createTestCases()
+{
+    std::vector<TestCase> testCases;
+
+    auto const addCases = [&](int engineIndex, int numVoices, bool multiResolution) {
+        for(auto fftSizeIndex: kFFTSizeIndices) {
+            for(int overlapCountIndex = 0; overlapCountIndex < (int)std::size(FFTDefines::overlapCounts); ++overlapCountIndex) {
+                testCases.push_back({ engineIndex, numVoices, multiResolution, fftSizeIndex, overlapCountIndex });
+            }
+        }
+    };
+
+    // Phase Vocoder
+    for(auto numVoices: { 1, (int)SpectralEngineBase::kMaxVoices }) {
+        for(auto multiResolution: { false, true }) {
+            addCases(0, numVoices, multiResolution);
+        }
+    }
+
+    // PSOLA はボイス数と Multi Resolution を使用しない
+    addCases(1, 1, false);
+
+    return testCases;
+}
+
+static bool applyTestCase(juce::AudioProcessor &processor, TestCase const &testCase)
+{
+    return setParameterValue(processor, ParameterIds::engine, (float)testCase._engineIndex)
+        && setParameterValue(processor, ParameterIds::numVoices, (float)testCase._numVoices)
+        && setParameterValue(processor, ParameterIds::multiResolution, testCase._multiResolution ? 1.0f : 0.0f)
+        && setParameterValue(processor, ParameterIds::fftSize, (float)testCase._fftSizeIndex)
+        && setParameterValue(processor, ParameterIds::overlapCount, (float)testCase._overlapCountIndex);
+}
+
+/** ブロックサイズを順に切り替えながら、テスト用の信号を processBlock に渡す
+ *
+ *  ホストのオートメーションのように、processBlock を呼び出す前に毎回パラメータの値を動かす。
+ *  これで、値が変わったときの ParameterSnapshot の更新とスムージングも検査の対象になる。
+ */
+template<class SampleType>
+class BlockFeeder
+{
+public:
+    explicit BlockFeeder(juce::AudioProcessor &processor)
+    :   _processor(processor)
+    ,   _buffer(processor.getTotalNumInputChannels(), *std::max_element(std::begin(kBlockSizes), std::end(kBlockSizes)))
+    {
+        // 周期をずらして、値の組み合わせがブロックごとに変わるようにする
+        addAutomation(ParameterIds::pitch, -100.0f, 100.0f, 37);
+        addAutomation(ParameterIds::formant, -100.0f, 100.0f, 53);
+        addAutomation(ParameterIds::dryWetRate, 0.0f, 1.0f, 29);
+        addAutomation(ParameterIds::outputGain, Defines::outputGainMin, Defines::outputGainMax, 41);
+        addAutomation(ParameterIds::harmonyPitches[0], -100.0f, 100.0f, 47);
+    }
+
+    //! すべてのオートメーションのパラメータが見つかったかどうか
+    bool isValid() const { return _valid; }
+
+    //! 次のブロックサイズで processBlock を一度呼び出す。@return 処理したサンプル数
+    int processNextBlock()
+    {
+        auto const blockSize = kBlockSizes[_blockSizeIndex];
+        _blockSizeIndex = (_blockSizeIndex + 1) % std::size(kBlockSizes);
+
+        applyAutomation();
+        _signal.fill(_buffer, blockSize);
+
+        // 確保済みのバッファの先頭 blockSize サンプルを参照するだけなので、ここではメモリを確保しない
+        juce::AudioBuffer<SampleType> block(_buffer.getArrayOfWritePointers(), _buffer.getNumChannels(), blockSize);
+        _processor.processBlock(block, _midiBuffer);
+        return blockSize;
+    }
+
+    //! numSamples サンプル以上を処理する
+    void process(int numSamples)
+    {
+        for(int processed = 0; processed < numSamples; ) {
+            processed += processNextBlock();
+        }
+    }
+
+private:
+    //! _min から _max までを _periodInBlocks ブロックの周期の三角波で往復するオートメーション
+    struct Automation
+    {
+        juce::RangedAudioParameter *_parameter = nullptr;
+        float _min = 0;
+        float _max = 0;
+        int _periodInBlocks = 1;
+    };
+
+    juce::AudioProcessor &_processor;
+    juce::AudioBuffer<SampleType> _buffer;
+    juce::MidiBuffer _midiBuffer;
+    TestSignal _signal { kSampleRate, 220.0 };
+    std::vector<Automation> _automations;
+    bool _valid = true;
+    std::size_t _blockSizeIndex = 0;
+    int _blockCount = 0;
+
+    void addAutomation(juce::String const &parameterId, float min, float max, int periodInBlocks)
+    {
+        auto *parameter = findParameter(_processor, parameterId);
+        if(parameter == nullptr) {
+            _valid = false;
+            return;
+        }
+
+        _automations.push_back({ parameter, min, max, periodInBlocks });
+    }
+
+    void applyAutomation()
+    {
+        for(auto const &automation: _automations) {
+            auto const phase = (float)(_blockCount % automation._periodInBlocks) / automation._periodInBlocks;
+            auto const triangle = 1.0f - std::abs(2.0f * phase - 1.0f);
+            auto const value = automation._min + (automation._max - automation._min) * triangle;
+            automation._parameter->setValueNotifyingHost(automation._parameter->convertTo0to1(value));
+        }
+
+        ++_blockCount;
+    }
+};
+
+/** 記録した違反を標準エラー出力に書き出して消去する
+ *
+ *  @return 違反がなかったかどうか
+ */
+static bool reportViolations(char const *precisionName)
+{
+    auto const numViolations = RealtimeChecker::getNumViolations();
+    if(numViolations == 0) {
+        return true;
+    }
+
+    std::cerr << numViolations << " violation(s) on the audio thread (" << precisionName << " precision)" << std::endl;
+    for(auto const &report: RealtimeChecker::getViolationReports()) {
+        std::cerr << report.toStdString() << std::endl;
+    }
+
+    // releaseResources() が同じ違反をもう一度ログに書き出さないように消去しておく
+    RealtimeChecker::clearViolations();
+    return false;
+}
+
+/** testCases の設定を順に適用しながら processBlock を呼び出す
+ *
+ *  @return 違反がなく、すべての設定がオーディオスレッドに反映されたかどうか
+ */
+template<class SampleType>
+static bool runTestCases(juce::AudioProcessor &processor, std::vector<TestCase> const &testCases)
+{
+    constexpr bool isDouble = std::is_same_v<SampleType, double>;
+    auto const precisionName = isDouble ? "double" : "single";
+    std::cerr << "Testing with " << precisionName << " precision" << std::endl;
+
+    processor.setProcessingPrecision(isDouble
+                                     ? juce::AudioProcessor::doublePrecision
+                                     : juce::AudioProcessor::singlePrecision);
+    processor.prepareToPlay(kSampleRate, kPreparedBlockSize);
+
+    auto const crossfadeLength = (int)std::ceil(kSampleRate * Defines::engineCrossfadeSeconds);
+    auto const &pluginProcessor = dynamic_cast<PluginAudioProcessor &>(processor);
+
+    BlockFeeder<SampleType> feeder(processor);
+    bool succeeded = feeder.isValid();
+
+    for(auto const &testCase: testCases) {
+        if(succeeded == false) {
+            break;
+        }
+
+        if(applyTestCase(processor, testCase) == false) {
+            succeeded = false;
+            break;
+        }
+
+        auto const fftSize = FFTDefines::fftSizes[testCase._fftSizeIndex];
+        auto const overlapCount = FFTDefines::overlapCounts[testCase._overlapCountIndex];
+
+        // バックグラウンドスレッドが新しいエンジンを構築し、オーディオスレッドが差し替えるまで処理を続ける
+        auto const startTime = juce::Time::getMillisecondCounterHiRes();
+        for( ; ; ) {
+            auto const status = pluginProcessor.getEngineStatusForUI();
+            if(status._fftSize == fftSize && status._overlapCount == overlapCount) {
+                break;
+            }
+
+            if(juce::Time::getMillisecondCounterHiRes() - startTime > kReconfigureTimeoutMs) {
+                std::cerr << "Timed out waiting for fftSize " << fftSize << ", overlapCount " << overlapCount << std::endl;
+                succeeded = false;
+                break;
+            }
+
+            feeder.processNextBlock();
+            juce::Thread::sleep(1);
+        }
+
+        if(succeeded == false) {
+            break;
+        }
+
+        // クロスフェードが終わり、新しいエンジンで FFT のフレームが何度か処理されるまで続ける
+        feeder.process(crossfadeLength + fftSize * 2);
+    }
+
+    succeeded = reportViolations(precisionName) && succeeded;
+    processor.releaseResources();
+    return succeeded;
+}
+
+static int runTests(juce::ArgumentList const &args)
+{
+    juce::ScopedJuceInitialiser_GUI juceInitialiser;
+
+    RealtimeChecker::setAbortOnViolation(args.containsOption("--abort-on-violation"));
+
+    PluginAudioProcessor processor;
+
+    auto const testCases = createTestCases();
+
+    auto succeeded = runTestCases<float>(processor, testCases);
+    succeeded = runTestCases<double>(processor, testCases) && succeeded;
+
+    std::cerr << (succeeded ? "Passed" : "Failed") << std::endl;
+    return succeeded ? 0 : 1;
+}
+
+NS_HWM_END
+
+int main(int argc, char *argv[])
+{
+    return hwm::runTests(juce::ArgumentList(argc, argv));
+}
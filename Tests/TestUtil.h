@@ -0,0 +1,69 @@
+#pragma once
+
+#include "Prefix.h"
+#include <cmath>
+#include <iostream>
+
+NS_HWM_BEGIN
+
+//! ID で指定したパラメータを探す。見つからないときは nullptr を返す
+inline juce::RangedAudioParameter * findParameter(juce::AudioProcessor &processor, juce::String const &parameterId)
+{
+    for(auto *parameter: processor.getParameters()) {
+        auto *ranged = dynamic_cast<juce::RangedAudioParameter *>(parameter);
+        if(ranged != nullptr && ranged->getParameterID() == parameterId) {
+            return ranged;
+        }
+    }
+
+    std::cerr << "Unknown parameter: " << parameterId.toStdString() << std::endl;
+    return nullptr;
+}
+
+//! ID で指定したパラメータに、正規化していない値を設定する
+inline bool setParameterValue(juce::AudioProcessor &processor, juce::String const &parameterId, float value)
+{
+    auto *parameter = findParameter(processor, parameterId);
+    if(parameter == nullptr) { return false; }
+
+    parameter->setValueNotifyingHost(parameter->convertTo0to1(value));
+    return true;
+}
+
+/** テスト用の入力信号
+ *
+ *  基本周波数の推定とピッチの変更が働くように、倍音を含む信号に小さなノイズを加える。
+ *  チャンネルごとに位相をずらして、ステレオの処理も通るようにする。
+ */
+class TestSignal
+{
+public:
+    TestSignal(double sampleRate, double frequency)
+    :   _omega(2.0 * juce::MathConstants<double>::pi * frequency / sampleRate)
+    {}
+
+    //! buffer の先頭 length サンプルに、続きの信号を書き込む
+    template<class SampleType>
+    void fill(juce::AudioBuffer<SampleType> &buffer, int length)
+    {
+        for(int ch = 0; ch < buffer.getNumChannels(); ++ch) {
+            auto *data = buffer.getWritePointer(ch);
+            auto const phaseOffset = ch * 0.5;
+            for(int i = 0; i < length; ++i) {
+                auto const phase = _omega * (double)(_position + i) + phaseOffset;
+                auto const value = 0.3 * std::sin(phase) + 0.15 * std::sin(2.0 * phase) + 0.1 * std::sin(3.0 * phase)
+                                 + 0.01 * (_random.nextDouble() * 2.0 - 1.0);
+                data[i] = (SampleType)value;
+            }
+        }
+
+        _position += length;
+    }
+
+private:
+    double _omega = 0;
+    juce::Random _random { 1 };
+    juce::int64 _position = 0;
+};
+
+NS_HWM_END